@@ -62,6 +62,9 @@
 /* Define to 1 if you have the ANSI C header files. */
 #define STDC_HEADERS 1
 
+/* Define to 1 to use io_uring in the event loop */
+/* #undef USE_IO_URING */
+
 /* Version number of package */
 #define VERSION "0.1"
 
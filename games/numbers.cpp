@@ -24,22 +24,37 @@
 
 #include <string>
 #include <vector>
+#include <ctype.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <rsl/net/irc/text.h>
-#include "gamesbot.h"
 #include "game.h"
+#include "gamescript.h"
 #include "highscore.h"
 #include "timers.h"
 
 using namespace Rsl::Net::IRC;
 
-static GamesBot* bot = 0;
-static Timers* timers = 0;
 static HighScore* highscore = 0;
 
+/* Letters, digits and []\`^{}|-_, not starting with a digit or a dash */
+static bool IsNickname(const char* text)
+{
+  size_t length = strlen(text);
+  if (length == 0 || length > 30 || isdigit((unsigned char)*text) || *text == '-')
+    return false;
+
+  for (const char* p = text; *p != '\0'; p++)
+  {
+    if (!isalnum((unsigned char)*p) && !strchr("[]\\`^{}|-_", *p))
+      return false;
+  }
+  return true;
+}
+
 static const unsigned int numbersTable[] = {
  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 25, 50,
  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 25, 75,
@@ -53,6 +68,10 @@ static const unsigned int numbersTable[] = {
 
 #define numbersTableLength sizeof(numbersTable) / sizeof(const unsigned int)
 
+/* Round timers don't need to be exact, let them be coalesced with others */
+#define ROUNDSTEP_SLACK 1000
+#define ROUNDSTART_SLACK 500
+
 /**
  ** infix -> postfix
  **/
@@ -199,49 +218,72 @@ static inline char* parseExpression(const char* expr, char* outputQueue, char**
 }
 
 
-class GameNumbers : public Game
+/* Rounds of numbers being played in a channel */
+class NumbersSession : public GameSession, private GameScript
 {
 public:
-  static GameNumbers* Instance()
+  NumbersSession(GameChannel* channel, int randomness)
+    : m_channel(channel), m_randomness(randomness), m_roundStarted(false)
   {
-    static GameNumbers* instance = 0;
-    if (!instance)
-      instance = new GameNumbers();
-    return instance;
   }
 
-public:
-  GameNumbers()
-    : m_roundStarted(false)
+  void Start()
   {
-    m_randomness = open("/dev/urandom", O_RDONLY);
+    m_channel->Send(IRCText("%C03Numbers game started!%C"));
+    Resume();
   }
 
-  virtual ~GameNumbers()
+  void Stop()
   {
-    close(m_randomness);
-    timers->Destroy(m_timer);
+    m_channel->Send(IRCText("%C03Numbers game stopped!%C"));
+    Cancel();
+    m_roundStarted = false;
   }
 
-  const char* GetName() { return "numbers"; }
-
-  void Start()
+  /* A round lasts two minutes with a reminder every 40 seconds, unless
+   * someone gets the exact value first.
+   */
+  void Run()
   {
-    bot->Send(IRCText("%C03Numbers game started!%C"));
-    StartRound();
+    GAME_SCRIPT_BEGIN();
+    for (;;)
+    {
+      StartRound();
+      while (m_timeRemaining > 0)
+      {
+        GAME_SCRIPT_WAIT(40000, ROUNDSTEP_SLACK);
+        if (WasWoken())
+          break;
+        m_timeRemaining -= 40;
+        if (m_timeRemaining > 0)
+          SendReminder();
+      }
+
+      m_roundStarted = false;
+      if (!WasWoken())
+        EndRound();
+      GAME_SCRIPT_SLEEP(4500, ROUNDSTART_SLACK);
+    }
+    GAME_SCRIPT_END();
   }
 
-  void Stop()
+  void OnMessage(const GameMessage& msg)
   {
-    bot->Send(IRCText("%C03Numbers game stopped!%C"));
-    timers->Destroy(m_timer);
-    m_roundStarted = false;
+    if (msg.command.Empty())
+      ParseAnswer(msg.source.GetData(), msg.kind, msg.text.GetData());
+    else
+      RunCommand(msg.source.GetData(), msg.command, msg.text.GetData());
   }
 
   void ParseText(const char* source, const char* dest, const char* text)
+  {
+    ParseAnswer(source, (*dest == '#' ? GAME_CHANNEL_NETWORK : GAME_CHANNEL_OTHER), text);
+  }
+
+  void ParseAnswer(const char* source, int kind, const char* text)
   {
     char postfix[STACKSIZE];
-    if (*dest == '#' && m_roundStarted && parseExpression(text, postfix))
+    if (kind == GAME_CHANNEL_NETWORK && m_roundStarted && parseExpression(text, postfix))
     {
       int numNumbers = sizeof(m_roundNumbers) / sizeof(int);
       int copyNumbers[numNumbers];
@@ -271,7 +313,7 @@ public:
         }
         if (!found)
         {
-          bot->Send(IRCText("%s: Invalid number '%d'", source, number));
+          m_channel->Send(IRCText("%s: Invalid number '%d'", source, number));
           return;
         }
       }
@@ -343,55 +385,51 @@ public:
     {
       m_roundNumbers[i] = numbersTable[m_roundNumbers[i]];
     }
-    qsort(m_roundNumbers, numNumbers, sizeof(int), GameNumbers::compare);
+    qsort(m_roundNumbers, numNumbers, sizeof(int), NumbersSession::compare);
 
     m_timeRemaining = 120;
     m_winner = "";
     m_winnerValue = 0;
-    bot->Send(IRCText("Round time: %C042 minutes%C"));
-    bot->Send(IRCText("Use the numbers %C12%s%C to get the target %C03%d%C", GetNumberList().c_str(), m_target));
-    m_timer = timers->Create(GameNumbers::StaticRoundStep, 3, 40000);
+    m_channel->Send(IRCText("Round time: %C042 minutes%C"), SEND_RESULT);
+    m_channel->Send(IRCText("Use the numbers %C12%s%C to get the target %C03%d%C", GetNumberList().c_str(), m_target),
+                    SEND_RESULT);
     m_roundStarted = true;
   }
 
-  void RoundStep()
+  void SendReminder()
   {
-    m_timeRemaining -= 40;
-    if (m_timeRemaining > 0)
+    if (m_channel->IsShedding())
     {
-      bot->Send(IRCText("Time remaining: %C04%d seconds%C", m_timeRemaining));
-      bot->Send(IRCText("Use the numbers %C12%s%C to get the target %C03%d%C", GetNumberList().c_str(), m_target));
+      /* A single line, that also replaces a previous reminder not sent yet */
+      m_channel->Send(IRCText("Time remaining: %C04%d seconds%C, numbers %C12%s%C, target %C03%d%C",
+                              m_timeRemaining, GetNumberList().c_str(), m_target), SEND_BULK);
     }
     else
     {
-      if (m_winner == "")
-      {
-        bot->Send(IRCText("%C04Time is over!%C Good luck in the next round..."));
-      }
-      else
-      {
-        bot->Send(IRCText("%C04Time is over!%C The winner is %C12%s%C (%C03%d%C)", m_winner.c_str(), m_winnerValue));
-        int diff = m_target - m_winnerValue;
-        if (diff < 0)
-          diff = -diff;
-        if (diff > 5)
-          bot->Send(IRCText("%C12Difference is bigger than 5, so no point for you%C"));
-        else
-          SetWinner(m_winner.c_str());
-      }
-      m_timer = timers->Create(GameNumbers::StaticRoundStart, 1, 4500);
-      m_roundStarted = false;
+      m_channel->Send(IRCText("Time remaining: %C04%d seconds%C", m_timeRemaining), SEND_BULK);
+      m_channel->Send(IRCText("Use the numbers %C12%s%C to get the target %C03%d%C", GetNumberList().c_str(), m_target),
+                      SEND_BULK);
     }
   }
 
-  static void StaticRoundStep(void*)
-  {
-    GameNumbers::Instance()->RoundStep();
-  }
-
-  static void StaticRoundStart(void*)
+  void EndRound()
   {
-    GameNumbers::Instance()->StartRound();
+    if (m_winner == "")
+    {
+      m_channel->Send(IRCText("%C04Time is over!%C Good luck in the next round..."), SEND_RESULT);
+    }
+    else
+    {
+      m_channel->Send(IRCText("%C04Time is over!%C The winner is %C12%s%C (%C03%d%C)", m_winner.c_str(), m_winnerValue),
+                      SEND_RESULT);
+      int diff = m_target - m_winnerValue;
+      if (diff < 0)
+        diff = -diff;
+      if (diff > 5)
+        m_channel->Send(IRCText("%C12Difference is bigger than 5, so no point for you%C"), SEND_RESULT);
+      else
+        SetWinner(m_winner.c_str());
+    }
   }
 
   void ProcessExpression(const char* source, char* expr)
@@ -435,7 +473,7 @@ public:
         if (GET_STACKSIZE() < 2) return;
         if ( stackP[0] == 0 )
         {
-          bot->Send(IRCText("%s: Division by zero", source));
+          m_channel->Send(IRCText("%s: Division by zero", source));
           return;
         }
         stackP[-1] /= stackP[0];
@@ -457,13 +495,11 @@ public:
 
     if (valueStack[0] == m_target)
     {
-      /* Exact value */
-      timers->Destroy(m_timer);
-      m_timer = timers->Create(GameNumbers::StaticRoundStart, 1, 4500);
+      /* Exact value, the round script goes on to the next one */
       m_roundStarted = false;
-
-      bot->Send(IRCText("%B%C03%s calculated the exact value! Congratulations%C%B", source));
+      m_channel->Send(IRCText("%B%C03%s calculated the exact value! Congratulations%C%B", source), SEND_RESULT);
       SetWinner(source);
+      Wake();
 
       return;
     }
@@ -475,28 +511,53 @@ public:
     if (winnerDiff < 0)
       winnerDiff = -winnerDiff;
 
-    bot->Send(IRCText("%s: %d", source, valueStack[0]));
+    /* Echoing every attempt is the first thing to go under load */
+    if (!m_channel->IsShedding())
+      m_channel->Send(IRCText("%s: %d", source, valueStack[0]));
     if (diff < winnerDiff)
     {
       m_winner = source;
       m_winnerValue = valueStack[0];
-      bot->Send(IRCText("%C06New nearest value for %s!%C", source));
+      m_channel->Send(IRCText("%C06New nearest value for %s!%C", source));
     }
 
 #undef GET_STACKSIZE
   }
 
+  void RunCommand(const char* source, const TextView& command, const char* args)
+  {
+    if (command.Equals("top"))
+      SendTop(source, highscore->GetScore(source, "numbers"), SEND_INTERACTIVE);
+    else if (command.Equals("rank"))
+    {
+      const char* nickname = (*args != '\0' ? args : source);
+      if (!IsNickname(nickname))
+      {
+        m_channel->Send(IRCText("%s: that is not a nickname", source));
+        return;
+      }
+      m_channel->Send(IRCText("%s: %C12%s%C has %C03%d%C points", source, nickname,
+                              highscore->GetScore(nickname, "numbers")));
+    }
+  }
+
   void SetWinner(const char* nickname)
   {
     int curScore = highscore->GetScore(nickname, "numbers");
     highscore->SetScore(nickname, "numbers", curScore + 1);
+    SendTop(nickname, curScore + 1, SEND_RESULT);
+  }
 
+  /* The top five, with nickname highlighted or added at the end */
+  void SendTop(const char* nickname, int score, SendPriority priority)
+  {
     std::vector<std::string> nicknames;
     std::vector<int> scores;
 
     highscore->GetGameTop("numbers", nicknames, scores, 5);
 
-    std::string topList("%BHigh scores:%B ");
+    ReplyPacker topList;
+    topList.AddHeader(IRCText("%BHigh scores:%B"));
     bool appearsNickInTop = false;
     for (unsigned int i = 0; i < nicknames.size(); i++)
     {
@@ -504,29 +565,28 @@ public:
       if (!strcasecmp(nicknames[i].c_str(), nickname))
       {
         appearsNickInTop = true;
-        snprintf(tmp, sizeof(tmp), "%%C%02d%%B%s: %d%%B%%C, ", 5+i, nicknames[i].c_str(), scores[i]);
+        snprintf(tmp, sizeof(tmp), "%%C%02d%%B%s: %d%%B%%C", 5+i, nicknames[i].c_str(), scores[i]);
       }
       else
-        snprintf(tmp, sizeof(tmp), "%%C%02d%s: %d%%C, ", 5+i, nicknames[i].c_str(), scores[i]);
+        snprintf(tmp, sizeof(tmp), "%%C%02d%s: %d%%C", 5+i, nicknames[i].c_str(), scores[i]);
 
-      topList += tmp;
+      topList.Add(IRCText(std::string(tmp)));
     }
-    topList = topList.substr(0, topList.length() - 2);
 
     if (!appearsNickInTop)
     {
       char tmp[256];
-      snprintf(tmp, sizeof(tmp), " ... %%B%s: %d%%B", nickname, curScore + 1);
-      topList += tmp;
+      snprintf(tmp, sizeof(tmp), "... %%B%s: %d%%B", nickname, score);
+      topList.Add(IRCText(std::string(tmp)));
     }
 
-    bot->Send(IRCText(topList));
+    m_channel->Send(topList, priority);
   }
 
 private:
+  GameChannel* m_channel;
   std::string m_winner;
   int m_winnerValue;
-  Timer* m_timer;
   int m_timeRemaining;
   int m_randomness;
   int m_target;
@@ -534,18 +594,53 @@ private:
   bool m_roundStarted;
 };
 
+/* The numbers game module, shared by all the sessions */
+class NumbersGame : public Game
+{
+public:
+  NumbersGame()
+  {
+    m_randomness = open("/dev/urandom", O_RDONLY);
+  }
+
+  virtual ~NumbersGame()
+  {
+    close(m_randomness);
+  }
+
+  const char* GetName() { return "numbers"; }
+
+  GameSession* CreateSession(GameChannel* channel)
+  {
+    return new NumbersSession(channel, m_randomness);
+  }
+
+  const char* const* GetCommands()
+  {
+    static const char* const commands[] = { "top", "rank", 0 };
+    return commands;
+  }
+
+private:
+  int m_randomness;
+};
+
+static NumbersGame* game = 0;
+
+
+GAME_API_EXPORT
 
 extern "C" Game* startup()
 {
-  bot = GamesBot::Instance();
-  timers = Timers::Instance();
   highscore = HighScore::Instance();
 
-  return GameNumbers::Instance();
+  game = new NumbersGame();
+  return game;
 }
 
 extern "C" void cleanup()
 {
-  delete GameNumbers::Instance();
+  delete game;
+  game = 0;
 }
 
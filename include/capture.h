@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+/* Inbound traffic recorded to replay it later. The file starts with
+ * CAPTURE_MAGIC, and then has a record per line: the nanoseconds since the
+ * previous record, the index of the network and the length of the line as
+ * varints, and the bytes of the line without its CR LF.
+ */
+#define CAPTURE_MAGIC "GBCAP\001\0\0"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_MAX_LINE 8192
+
+class CaptureWriter
+{
+public:
+  CaptureWriter();
+  ~CaptureWriter();
+
+  bool Create(const char* path);
+  bool Ok() const;
+  int Errno() const;
+  const char* Error() const;
+
+  /* Records every complete line of the buffer, all of them received at time */
+  void Write(uint64_t time, unsigned int network, const char* buffer, size_t length);
+  void Flush();
+  void Close();
+
+  unsigned long GetRecords() const;
+
+private:
+  void WriteVarint(uint64_t value);
+
+  int m_errno;
+  std::string m_error;
+  FILE* m_fp;
+  uint64_t m_lastTime;
+  unsigned long m_records;
+};
+
+class CaptureReader
+{
+public:
+  struct Record
+  {
+    uint64_t time;          /* Nanoseconds since the first record */
+    unsigned int network;
+    size_t length;
+    char line[CAPTURE_MAX_LINE];
+  };
+
+public:
+  CaptureReader();
+  ~CaptureReader();
+
+  bool Create(const char* path);
+  bool Ok() const;
+  int Errno() const;
+  const char* Error() const;
+
+  /* False at the end of the file, or if it is damaged */
+  bool Next(Record& record);
+
+private:
+  bool ReadVarint(uint64_t& value);
+
+  int m_errno;
+  std::string m_error;
+  FILE* m_fp;
+  uint64_t m_time;
+  bool m_first;
+};
+
+#endif /* #ifndef __CAPTURE_H */
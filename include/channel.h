@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CHANNEL_H
+#define __CHANNEL_H
+
+#include <string>
+#include <rsl/net/irc/text.h>
+#include "game.h"
+#include "network.h"
+#include "textview.h"
+#include "timers.h"
+#include "workers.h"
+
+/* A channel of some network where a game session is running. Calls into
+ * the session are posted to the strand of the channel, so a session never
+ * runs in two threads at once. Its output goes back to the main thread,
+ * which is the only one that writes to the networks.
+ */
+class Channel : public GameChannel
+{
+public:
+  Channel(Network* network, const char* name, Game* game, int apiVersion, TimerGroup timers);
+
+  const char* GetName() const;
+  void Send(const Rsl::Net::IRC::IRCText& msg, SendPriority priority = SEND_INTERACTIVE);
+  void Send(const ReplyPacker& reply, SendPriority priority = SEND_INTERACTIVE);
+  bool IsShedding() const;
+
+  Network* GetNetwork() const;
+  Game* GetGame() const;
+  GameSession* GetSession() const;
+  TimerGroup GetTimerGroup() const;
+
+  void Start();
+
+  /* Copies the message for the session, with the command name in lowercase.
+   * Must be called from the main thread.
+   */
+  void Deliver(const GameMessage& msg);
+
+  /* Stops the session and releases the channel once the calls already
+   * posted have run. Must be called from the main thread.
+   */
+  void Close();
+
+private:
+  virtual ~Channel();
+
+  static void DoStart(void* channel);
+  static void DoDeliver(void* text);
+  static void DoClose(void* channel);
+  static void DoSend(void* reply);
+  static void DispatchTimer(TimerHandle timer, void* channel);
+  static void DoTimer(void* timer);
+  static void DoTimerCopy(void* timer);
+
+  Network* m_network;
+  std::string m_name;
+  Game* m_game;
+  int m_apiVersion;         /* Of the game module */
+  GameSession* m_session;
+  TimerGroup m_timers;
+  Strand* m_strand;
+};
+
+#endif /* #ifndef __CHANNEL_H */
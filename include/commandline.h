@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __COMMANDLINE_H
+#define __COMMANDLINE_H
+
+#include "textview.h"
+
+/* The words of a command, split without allocating: they are copied once
+ * to a buffer of the object, so every word is NUL terminated. Words past
+ * COMMAND_MAX_WORDS, and text past COMMAND_MAX_LENGTH, are dropped; an IRC
+ * line can't be longer anyway.
+ */
+class CommandLine
+{
+public:
+  enum
+  {
+    COMMAND_MAX_LENGTH = 512,
+    COMMAND_MAX_WORDS = 16
+  };
+
+public:
+  CommandLine();
+
+  /* Words are separated by one or more spaces. Returns how many there are */
+  size_t Parse(const char* text);
+
+  size_t GetCount() const { return m_count; }
+  const TextView& operator[](size_t pos) const { return m_words[pos]; }
+
+private:
+  char m_buffer[COMMAND_MAX_LENGTH + 1];
+  TextView m_words[COMMAND_MAX_WORDS];
+  size_t m_count;
+};
+
+#endif /* #ifndef __COMMANDLINE_H */
@@ -25,35 +25,72 @@
 #ifndef __COMMANDS_H
 #define __COMMANDS_H
 
-#include <rsl/net/irc/client.h>
-#include <rsl/net/irc/user.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
+#include "commandline.h"
 #include "gamesbot.h"
 
+/* Commands said with "!". The core ones go through a small perfect hash,
+ * the ones registered by games through an open addressing table rebuilt
+ * whenever games are loaded. Both are found in constant time however many
+ * commands there are, ignoring case.
+ */
 class CommandHandler
 {
-  typedef void (*cmd_t)(GamesBot*, const Rsl::Net::IRC::IRCUser*, const Rsl::Net::IRC::IRCUser*, const std::vector<std::string>& params);
+  typedef void (*cmd_t)(GamesBot*, const char* source, const char* dest, const CommandLine& params);
 
   struct Command
   {
-    std::string name;
+    const char* name;
+    size_t length;
     cmd_t callback;
   };
 
+  struct GameCommand
+  {
+    std::string name;         /* Lowercase */
+    uint32_t hash;
+    const Game* game;         /* 0 for an empty slot */
+  };
+
 public:
   static CommandHandler* Instance();
 
 public:
   CommandHandler();
-  void RegisterCommand(const std::string& commandName, cmd_t callback);
 
-  void Handle(const Rsl::Net::IRC::IRCUser* source, const Rsl::Net::IRC::IRCUser* dest, const std::string& text);
+  /* Runs the core command of the line. False if it isn't one */
+  bool Handle(const char* source, const char* dest, const char* text);
+
+  /* Several games may handle the same command, each in its own channels.
+   * Core commands can't be taken. Must be followed by RebuildGameCommands().
+   */
+  bool RegisterGameCommand(const char* name, const Game* game);
+  void ClearGameCommands();
+  void RebuildGameCommands();
+
+  /* Whether the game handles the command, name isn't NUL terminated */
+  bool IsGameCommand(const Game* game, const char* name, size_t length) const;
 
 private:
-  std::vector<Command> m_commands;
+  static constexpr unsigned int CoreHash(const char* name, size_t length);
+  static constexpr bool CoreHashIsPerfect(const Command* commands, size_t count);
+  const Command* FindCore(const char* name, size_t length) const;
+  static uint32_t HashName(const char* name, size_t length);
+  void InsertGameCommand(const GameCommand& command);
+
+  enum
+  {
+    CORE_TABLE_SIZE = 8,
+    GAME_TABLE_MIN = 16
+  };
+  Command m_core[CORE_TABLE_SIZE];
+
+  std::vector<GameCommand> m_gameCommands; /* As registered */
+  std::vector<GameCommand> m_gameTable;    /* Power of two slots, at most half full */
 
-#define COMMAND(x) static void cmd_ ## x (GamesBot* bot, const Rsl::Net::IRC::IRCUser*, const Rsl::Net::IRC::IRCUser*, const std::vector<std::string>& params)
+#define COMMAND(x) static void cmd_ ## x (GamesBot* bot, const char* source, const char* dest, const CommandLine& params)
   COMMAND(games);
   COMMAND(list);
   COMMAND(start);
@@ -26,6 +26,7 @@
 #define __CONFIGURATION_H
 
 #include <string>
+#include <vector>
 #include <rsl/file/ini/iniparser.h>
 
 class Configuration
@@ -40,25 +41,70 @@ public:
   int Errno() const;
   const char* Error() const;
 
-  struct
+  struct IRCServerConfig
   {
     const char* address;
     const char* service;
     const char* password;
     bool useSSL;
     const char* sslCert;
-  } IRCServer;
+    unsigned int floodBurst;    /* Lines that can be sent at once */
+    unsigned int floodInterval; /* Miliseconds to earn another line */
+    bool floodStrict;           /* Drain priorities in strict order instead of weighted */
+    unsigned int shedQueue;     /* Lines waiting to start shedding periodic traffic, 0 to ignore */
+    unsigned int shedDelay;     /* Miliseconds the oldest line can wait before shedding, 0 to ignore */
+    unsigned int connectTimeout; /* Miliseconds to connect and to be welcomed */
+    unsigned int reconnectDelay; /* Miliseconds before the first reconnection, doubled on each failure */
+    unsigned int reconnectMax;   /* Maximum miliseconds between reconnections */
+  };
 
-  struct
+  struct BotConfig
   {
     const char* nickname;
     const char* username;
     const char* fullname;
     const char* password;
     const char* channel;
-  } Bot;
+  };
+
+  /* One network per [ircserver]/[bot] pair. Additional networks are read
+   * from [ircserver2]/[bot2], [ircserver3]/[bot3] and so on.
+   */
+  struct NetworkConfig
+  {
+    const char* name;
+    IRCServerConfig IRCServer;
+    BotConfig Bot;
+  };
+
+  std::vector<NetworkConfig> Networks;
+
+  struct CommandCost
+  {
+    std::string name;
+    unsigned int cost;
+  };
+
+  /* Shared by every network, from the optional [ratelimit] section. What
+   * each user and each channel can spend per window: a line said to a game
+   * costs answerCost, a command its entry in costs or else commandCost.
+   */
+  struct RateLimitConfig
+  {
+    unsigned int window;        /* Miliseconds, 0 disables the limits */
+    unsigned int userBudget;    /* 0 disables this limit only */
+    unsigned int channelBudget; /* Same */
+    unsigned int answerCost;
+    unsigned int commandCost;
+    std::vector<CommandCost> costs;
+  };
+
+  RateLimitConfig RateLimit;
 
 private:
+  bool LoadNetwork(const std::string& serverSection, const std::string& botSection);
+  void LoadRateLimit();
+
   int m_errno;
   std::string m_error;
   Rsl::File::Ini::IniParser m_parser;
@@ -87,6 +87,9 @@ public:
   int Errno() const;
   const char* Error() const;
 
+  /* Formatted by sqlite3_mprintf(), strings from users go in '%q'. Returns
+   * 0 on errors.
+   */
   DatabaseResult* Query(const char* query, ...);
   int ChangedRows();
 
@@ -25,20 +25,120 @@
 #ifndef __GAME_H
 #define __GAME_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <rsl/net/irc/text.h>
+#include "replypacker.h"
+#include "sendpriority.h"
+#include "textview.h"
+
 class Game;
+class GameChannel;
+
+/* Version of the interface between the bot and the game modules. Modules
+ * built against this header export it with GAME_API_EXPORT. Those without
+ * it are version 1, and their sessions only get ParseText() and OnCommand().
+ *
+ *   1: ParseText() and OnCommand()
+ *   2: OnMessage() with a GameMessage
+ */
+#define GAME_API_VERSION 2
+#define GAME_API_EXPORT extern "C" int apiversion() { return GAME_API_VERSION; }
 
 typedef Game* (*gameStartup_t)();
 typedef void (*gameCleanup_t)();
+typedef int (*gameApiVersion_t)();
 
-class Game
+enum GameChannelKind
+{
+  GAME_CHANNEL_NETWORK = 0,   /* #channel */
+  GAME_CHANNEL_LOCAL = 1,     /* &channel, only in one server */
+  GAME_CHANNEL_OTHER = 2
+};
+
+/* The same nickname in the same network has the same handle whatever its
+ * case, for as long as it keeps talking. After it quits, changes its nick or
+ * stays silent for half an hour it gets a new one the next time, and the old
+ * handle isn't given to anybody else until its slot has been reused 4096
+ * times. 0 is no user, when there are too many.
+ */
+typedef uint32_t GameUser;
+
+/* A line said in the channel of a session. The views are NUL terminated,
+ * and only valid during the call. New members are only added at the end,
+ * size tells how much of it the bot filled.
+ */
+struct GameMessage
+{
+  size_t size;            /* sizeof(GameMessage) for the bot */
+  GameChannel* channel;   /* Where the session is played */
+  int kind;               /* GameChannelKind of dest */
+  GameUser user;          /* Who said it */
+  uint64_t received;      /* CLOCK_MONOTONIC nanoseconds when the line was read */
+  TextView source;
+  TextView dest;
+  TextView command;       /* Lowercase name of a game command, empty for other lines */
+  TextView text;          /* The line, or whatever follows the command name */
+};
+
+/* Channel where a game session is played, implemented by the bot */
+class GameChannel
 {
 public:
-  virtual ~Game() {};
+  virtual ~GameChannel() {};
+
+  virtual const char* GetName() const = 0;
+  virtual void Send(const Rsl::Net::IRC::IRCText& msg, SendPriority priority = SEND_INTERACTIVE) = 0;
+  virtual void Send(const ReplyPacker& reply, SendPriority priority = SEND_INTERACTIVE) = 0;
+
+  /* True while the bot is overloaded, periodic and redundant output should
+   * be merged or skipped.
+   */
+  virtual bool IsShedding() const = 0;
+};
+
+/* A game running in one channel. Timers created from a session belong to
+ * that session, and are cancelled when it is destroyed.
+ */
+class GameSession
+{
+public:
+  virtual ~GameSession() {};
 
-  virtual const char* GetName() = 0;
   virtual void Start() = 0;
   virtual void Stop() = 0;
   virtual void ParseText(const char* source, const char* dest, const char* text) = 0;
+
+  /* One of the commands of the game said in its channel, args is whatever
+   * follows the command name.
+   */
+  virtual void OnCommand(const char* source, const char* dest, const char* command, const char* args) {};
+
+  /* Every line for the session, commands included, since version 2. It
+   * must stay the last one, older modules don't have it in their vtable.
+   */
+  virtual void OnMessage(const GameMessage& msg)
+  {
+    if (msg.command.Empty())
+      ParseText(msg.source.GetData(), msg.dest.GetData(), msg.text.GetData());
+    else
+      OnCommand(msg.source.GetData(), msg.dest.GetData(), msg.command.GetData(), msg.text.GetData());
+  }
+};
+
+/* A game module, returned by the startup function of the module */
+class Game
+{
+public:
+  virtual ~Game() {};
+
+  virtual const char* GetName() = 0;
+  virtual GameSession* CreateSession(GameChannel* channel) = 0;
+
+  /* Commands handled by the sessions, like "top" for "!top", ending with
+   * a null pointer. They are registered when the game is loaded.
+   */
+  virtual const char* const* GetCommands() { return 0; }
 };
 
 #endif /* #ifndef __GAME_H */
@@ -27,10 +27,17 @@
 
 #include <string>
 #include <vector>
+#include <tr1/unordered_map>
 #include <rsl/net/irc/client.h>
 #include <rsl/net/irc/text.h>
+#include "capture.h"
+#include "channel.h"
 #include "configuration.h"
 #include "game.h"
+#include "histogram.h"
+#include "network.h"
+#include "ratelimiter.h"
+#include "timers.h"
 
 typedef void * MODULEHANDLE;
 
@@ -61,33 +68,107 @@ public:
 
   bool Initialize(int argc, char* argv[], char* envp[]);
   bool Run();
+  void Shutdown();
 
-  const Rsl::Net::IRC::IRCClient& GetClient() const;
+  Network* FindNetwork(const Rsl::Net::IRC::IRCClient* client) const;
+  Network* GetCurrentNetwork() const;
+  void DumpNetworks() const;
+  void DumpReplay() const;
 
-  void OnConnect();
-  void Send(const Rsl::Net::IRC::IRCText& msg);
+  /* Whether a session runs in the channel, usable before the line is parsed */
+  bool HasSession(const Network* network, const TextView& name) const;
+
+  void OnNetworkReadable(Network* network);
+  void OnNetworkReceived(Network* network, const char* data, ssize_t length);
+  void OnPing(Network* network, const char* text);
+  void OnPrivmsg(const char* source, const char* dest, const char* text);
+  void OnUserGone(Network* network, const char* nickname);
+  void FlushNetworks();
+  /* On the network being dispatched */
+  void Send(const char* target, const Rsl::Net::IRC::IRCText& msg, SendPriority priority = SEND_INTERACTIVE);
+  void Send(const char* target, const ReplyPacker& reply, SendPriority priority = SEND_INTERACTIVE);
   void Quit(const Rsl::Net::IRC::IRCText& msg);
   void SendToGame(const char* source, const char* dest, const char* text);
+  void SendCommandToGame(const char* source, const char* dest, const char* text);
 
-  const char* GetGame() const;
-  bool StartGame(const char* name);
-  void StopGame();
+  /* Games are played per channel of the network being dispatched */
+  const char* GetGame(const char* channel) const;
+  bool StartGame(const char* channel, const char* name);
+  void StopGame(const char* channel);
   bool ReloadGames();
   void UnloadGames();
   const std::vector<std::string> ListGames() const;
 
 protected:
   Game* FindGame(const char* name) const;
+  TimerGroup GetGameGroup(const Game* game) const;
+  int GetGameVersion(const Game* game) const;
+  Channel* FindChannel(const Network* network, const char* name) const;
+  Channel* StartSession(Network* network, const char* channel, Game* game);
+  void StopSession(Channel* channel);
+  long Replay();
+  bool AllowLine(const char* source, const char* dest, const char* text);
+  unsigned int GetCommandCost(const char* text) const;
+  static void DoEvictLimits(void* bot);
+  GameUser ResolveUser(const char* nickname);
+  void ReleaseUser(uint32_t index);
+  static void DoEvictUsers(void* bot);
+  void DeliverToGame(Channel* channel, const char* source, const char* dest,
+                     const TextView& command, const char* text);
 
 private:
   int m_errno;
   std::string m_error;
   Configuration m_config;
-  Rsl::Net::IRC::IRCClient m_client;
-  Game* m_game;
+  std::vector<Network *> m_networks;
+  Network* m_curNetwork;  /* Network whose messages are being dispatched */
+
+  /* Running sessions, by network and lowercase channel name */
+  typedef std::tr1::unordered_map<std::string, Channel *> ChannelMap;
+  ChannelMap m_channels;
+  mutable std::string m_channelKey;
+
+  /* What users and channels can make the bot do, by network and lowercase name */
+  RateLimiter m_userLimits;
+  RateLimiter m_channelLimits;
+  std::string m_limitKey;
+  TimerHandle m_evictTimer;
+
+  /* Handles given to the games for each nickname, by network and lowercase
+   * name. The map holds indexes into the slots; a handle is its slot index
+   * plus one in the low bits and the times the slot was reused in the high ones.
+   */
+  struct UserSlot
+  {
+    GameUser handle;
+    uint64_t lastSeen;
+    std::string key;        /* Empty while the slot is free */
+  };
+  typedef std::tr1::unordered_map<std::string, uint32_t> UserMap;
+  UserMap m_users;
+  std::vector<UserSlot> m_userSlots;
+  std::vector<uint32_t> m_freeUsers;
+  TimerHandle m_userTimer;
+
   std::vector<Game *> m_games;
   std::vector<MODULEHANDLE> m_gameModules;
+  std::vector<TimerGroup> m_gameGroups;
+  std::vector<int> m_gameVersions;
   std::string m_gamesPath;
+  bool m_running;
+
+  /* Recording the traffic, or replaying it instead of connecting */
+  CaptureWriter* m_capture;
+  CaptureReader* m_replay;
+  CaptureReader::Record* m_replayRecord;
+  bool m_replayPending;     /* The record was read but not dispatched yet */
+  bool m_replayFast;        /* As fast as possible instead of at the recorded pace */
+  FILE* m_replaySink;
+  uint64_t m_replayStart;
+  uint64_t m_replayEnd;
+  unsigned long m_replayLines;
+  Histogram m_replayLatency;  /* Nanoseconds dispatching each line */
+  Histogram m_replayLateness; /* Nanoseconds behind the recorded pace */
 };
 
 #endif /* #ifndef __GAMESBOT_H */
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GAMESCRIPT_H
+#define __GAMESCRIPT_H
+
+#include "timers.h"
+
+/* Lets a session write its rounds as straight code that waits, instead of
+ * a state machine spread over timer callbacks. Scripts are stackless: the
+ * only state kept across a wait is the point to resume from and the
+ * members of the object. Waiting allocates nothing but a timer from the
+ * timers pool.
+ *
+ *   void Run()
+ *   {
+ *     GAME_SCRIPT_BEGIN();
+ *     for (;;)
+ *     {
+ *       StartRound();
+ *       GAME_SCRIPT_WAIT(120000, 1000);
+ *       if (!WasWoken())
+ *         TimeIsOver();
+ *       GAME_SCRIPT_SLEEP(4500, 500);
+ *     }
+ *     GAME_SCRIPT_END();
+ *   }
+ *
+ * Run() is called by Resume() from the session calls and its timers, which
+ * never run concurrently. Limits, since the script is a switch:
+ *  - Locals don't survive a wait. Run() returns on every wait, so whatever
+ *    is needed after one goes in a member, and a local initialized before
+ *    a wait and still in scope after it doesn't compile.
+ *  - A script can't wait inside a switch of its own.
+ * Each wait takes its resume point from __COUNTER__, so several waits may
+ * share a line, a macro included.
+ */
+class GameScript
+{
+public:
+  GameScript()
+    : m_resumeAt(0), m_timer(0), m_waiting(false), m_woken(false)
+  {
+  }
+
+  virtual ~GameScript()
+  {
+    Cancel();
+  }
+
+  /* Runs from the beginning, or from where it waits */
+  void Resume()
+  {
+    m_timer = 0;
+    Run();
+  }
+
+  /* Back to the beginning, without running */
+  void Cancel()
+  {
+    if (m_timer)
+      Timers::Instance()->Destroy(m_timer);
+    m_timer = 0;
+    m_resumeAt = 0;
+    m_waiting = false;
+  }
+
+  /* Ends a GAME_SCRIPT_WAIT() before its time. Returns false if the script
+   * wasn't waiting, for example because someone else woke it first.
+   */
+  bool Wake()
+  {
+    if (!m_waiting)
+      return false;
+
+    Timers::Instance()->Destroy(m_timer);
+    m_waiting = false;
+    m_woken = true;
+    Resume();
+    return true;
+  }
+
+  bool IsWaiting() const { return m_waiting; }
+  bool IsFinished() const { return m_resumeAt == -1; }
+
+protected:
+  virtual void Run() = 0;
+
+  /* After a GAME_SCRIPT_WAIT(), whether it was ended by Wake() */
+  bool WasWoken() const { return m_woken; }
+
+  /* In the timers group current when the script is resumed */
+  void Suspend(unsigned int ms, unsigned int slack, bool wakeable)
+  {
+    m_waiting = wakeable;
+    m_woken = false;
+    m_timer = Timers::Instance()->Create(GameScript::DoResume, 1, ms, this, slack);
+  }
+
+  int m_resumeAt;           /* Of the wait, 0 to start, -1 finished */
+
+private:
+  static void DoResume(void* script)
+  {
+    ((GameScript *)script)->m_waiting = false;
+    ((GameScript *)script)->Resume();
+  }
+
+  TimerHandle m_timer;
+  bool m_waiting;           /* In a GAME_SCRIPT_WAIT() */
+  bool m_woken;
+};
+
+#define GAME_SCRIPT_BEGIN() switch (m_resumeAt) { case 0:
+
+#define GAME_SCRIPT_SUSPEND(ms, slack, wakeable) GAME_SCRIPT_SUSPEND_AT(ms, slack, wakeable, __COUNTER__ + 1)
+
+#define GAME_SCRIPT_SUSPEND_AT(ms, slack, wakeable, point) \
+  do { Suspend((ms), (slack), (wakeable)); m_resumeAt = (point); return; case (point):; } while (0)
+
+/* Waits for ms miliseconds, that may be delayed up to slack */
+#define GAME_SCRIPT_SLEEP(ms, slack) GAME_SCRIPT_SUSPEND(ms, slack, false)
+
+/* Waits like GAME_SCRIPT_SLEEP(), or until Wake() is called */
+#define GAME_SCRIPT_WAIT(ms, slack) GAME_SCRIPT_SUSPEND(ms, slack, true)
+
+#define GAME_SCRIPT_END() } m_resumeAt = -1
+
+#endif /* #ifndef __GAMESCRIPT_H */
@@ -28,6 +28,7 @@
 #include <string>
 #include <vector>
 #include "database.h"
+#include "mutex.h"
 
 class HighScore
 {
@@ -42,6 +43,9 @@ public:
   void SetScore(const char* nickname, const char* game, int score);
 
   void GetGameTop(const char* game, std::vector<std::string>& nicknames, std::vector<int>& scores, int limit = -1);
+
+private:
+  Mutex m_mutex; /* Games update the scores from the worker threads */
 };
 
 #endif /* #ifndef __HIGHSCORE_H */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram: every power of two is split in HISTOGRAM_SUB_BUCKETS
+ * linear buckets, so values are recorded with an error below 12.5% using a
+ * fixed amount of memory and no allocations.
+ */
+class Histogram
+{
+public:
+  enum
+  {
+    HISTOGRAM_SUB_BITS = 3,
+    HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS,
+    HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+  };
+
+public:
+  Histogram();
+
+  inline void Record(uint64_t value)
+  {
+    m_buckets[BucketFor(value)]++;
+    m_count++;
+    m_sum += value;
+    if (value > m_max)
+      m_max = value;
+  }
+
+  void Reset();
+  void Merge(const Histogram& other);
+
+  uint64_t Count() const;
+  uint64_t Max() const;
+  uint64_t Mean() const;
+  uint64_t Percentile(double percentile) const; /* Upper bound of the bucket, percentile in [0, 100] */
+
+private:
+  static inline unsigned int BucketFor(uint64_t value)
+  {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+      return (unsigned int)value;
+
+    unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (unsigned int)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+  }
+
+  static uint64_t BucketUpperBound(unsigned int bucket);
+
+  uint64_t m_buckets[HISTOGRAM_BUCKETS];
+  uint64_t m_count;
+  uint64_t m_sum;
+  uint64_t m_max;
+};
+
+#endif /* #ifndef __HISTOGRAM_H */
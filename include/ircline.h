@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __IRCLINE_H
+#define __IRCLINE_H
+
+#include "textview.h"
+
+#define IRC_MAX_PARAMS 15
+
+enum IRCCommand
+{
+  IRC_COMMAND_UNKNOWN,
+  IRC_COMMAND_NUMERIC,
+  IRC_COMMAND_PING,
+  IRC_COMMAND_PONG,
+  IRC_COMMAND_PRIVMSG,
+  IRC_COMMAND_NOTICE,
+  IRC_COMMAND_JOIN,
+  IRC_COMMAND_PART,
+  IRC_COMMAND_QUIT,
+  IRC_COMMAND_KICK,
+  IRC_COMMAND_MODE,
+  IRC_COMMAND_NICK,
+  IRC_COMMAND_TOPIC,
+  IRC_COMMAND_INVITE,
+  IRC_COMMAND_ERROR
+};
+
+/* A message parsed in place. Every view points into the line, and all but
+ * the prefix are also NUL terminated.
+ */
+struct IRCLine
+{
+  TextView prefix;    /* Without the leading colon, empty if none */
+  TextView nick;      /* Of the prefix, up to the '!' */
+  TextView command;
+  IRCCommand type;
+  int numeric;        /* For IRC_COMMAND_NUMERIC */
+  TextView params[IRC_MAX_PARAMS];
+  unsigned int numParams;
+  bool trailing;      /* The last param came after a colon */
+};
+
+/* What a quick look at a raw line tells, without modifying it */
+struct IRCScan
+{
+  IRCCommand type;
+  int numeric;
+  TextView target;    /* First param */
+  TextView text;      /* Trailing param right after the target, empty if none */
+};
+
+typedef void (*IRCLineCbk_t)(IRCLine& line, void* userData);
+typedef bool (*IRCFilterCbk_t)(const IRCScan& scan, void* userData); /* False to skip the line */
+
+IRCCommand ircClassify(const char* command, size_t length, int& numeric);
+
+/* Parses a line without its CRLF, overwriting the separators. line[length]
+ * must be writable. Returns false if it's not a message.
+ */
+bool ircParseLine(char* line, size_t length, IRCLine& out);
+
+/* Finds the command and the target of a line that ends at lineEnd. Bytes
+ * up to limit may be read. Returns false if the line doesn't look like a
+ * message, so it can't be skipped safely.
+ */
+bool ircScanLine(const char* line, const char* lineEnd, const char* limit, IRCScan& out);
+bool ircScanLineScalar(const char* line, const char* lineEnd, IRCScan& out);
+
+/* Parses every complete line of the buffer in place, and calls cbk with
+ * each message. Lines that the filter rejects after scanning them are
+ * skipped without being parsed. Returns the bytes consumed, the rest is an
+ * incomplete line.
+ */
+size_t ircParseLines(char* buffer, size_t length, IRCLineCbk_t cbk, void* userData, IRCFilterCbk_t filter = 0);
+
+#endif /* #ifndef __IRCLINE_H */
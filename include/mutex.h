@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __MUTEX_H
+#define __MUTEX_H
+
+#include <pthread.h>
+
+class Mutex
+{
+  friend class Condition;
+
+public:
+  /* A recursive mutex can be locked again by the thread that holds it */
+  Mutex(bool recursive = false)
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (recursive)
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    m_depth = 0;
+  }
+
+  ~Mutex()
+  {
+    pthread_mutex_destroy(&m_mutex);
+  }
+
+  inline void Lock() { pthread_mutex_lock(&m_mutex); m_depth++; }
+  inline void Unlock() { m_depth--; pthread_mutex_unlock(&m_mutex); }
+
+  /* Releases a recursive mutex held by the caller, however many times it
+   * was locked. Returns that count, to lock it back with Relock().
+   */
+  inline unsigned int UnlockAll()
+  {
+    unsigned int depth = m_depth;
+    for (unsigned int i = 0; i < depth; i++)
+      Unlock();
+    return depth;
+  }
+
+  inline void Relock(unsigned int depth)
+  {
+    for (unsigned int i = 0; i < depth; i++)
+      Lock();
+  }
+
+private:
+  Mutex(const Mutex&);
+  Mutex& operator=(const Mutex&);
+
+  pthread_mutex_t m_mutex;
+  unsigned int m_depth; /* Times locked by the owner, only touched while held */
+};
+
+class Condition
+{
+public:
+  Condition() { pthread_cond_init(&m_cond, 0); }
+  ~Condition() { pthread_cond_destroy(&m_cond); }
+
+  /* The mutex must be locked by the caller */
+  inline void Wait(Mutex& mutex) { pthread_cond_wait(&m_cond, &mutex.m_mutex); }
+  inline void Signal() { pthread_cond_signal(&m_cond); }
+  inline void Broadcast() { pthread_cond_broadcast(&m_cond); }
+
+private:
+  Condition(const Condition&);
+  Condition& operator=(const Condition&);
+
+  pthread_cond_t m_cond;
+};
+
+/* Holds a mutex locked during its lifetime */
+class MutexLock
+{
+public:
+  MutexLock(Mutex& mutex)
+    : m_mutex(mutex)
+  {
+    m_mutex.Lock();
+  }
+
+  ~MutexLock()
+  {
+    m_mutex.Unlock();
+  }
+
+private:
+  Mutex& m_mutex;
+};
+
+#endif /* #ifndef __MUTEX_H */
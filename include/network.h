@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __NETWORK_H
+#define __NETWORK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <rsl/net/irc/client.h>
+#include <rsl/net/irc/text.h>
+#include "capture.h"
+#include "configuration.h"
+#include "ircline.h"
+#include "reactor.h"
+#include "replypacker.h"
+#include "sendqueue.h"
+#include "timers.h"
+#include "workers.h"
+
+enum NetworkState
+{
+  NETWORK_STOPPED,
+  NETWORK_WAITING,     /* For the next connection attempt */
+  NETWORK_CONNECTING,  /* Waiting for the socket to be writable, or for the SSL client thread */
+  NETWORK_REGISTERING, /* Connected, waiting for the welcome of the server */
+  NETWORK_CONNECTED
+};
+
+class Network;
+struct ConnectAttempt;
+
+typedef void (*NetworkClientCbk_t)(Rsl::Net::IRC::IRCClient& client);
+typedef void (*NetworkLineCbk_t)(Network* network, IRCLine& line);
+typedef bool (*NetworkFilterCbk_t)(Network* network, const IRCScan& scan);
+
+/* A connection to one IRC network. The database, the games and the timers
+ * are shared by every network in the process.
+ */
+class Network
+{
+public:
+  struct Stats
+  {
+    unsigned long readEvents;   /* Times the socket was readable */
+    unsigned long messagesIn;   /* Messages dispatched to the bot */
+    unsigned long filtered;     /* Lines skipped by the filter without being parsed */
+    unsigned long messagesOut;  /* Messages sent */
+    long memory;                /* Resident memory taken by the client, in bytes */
+    uint64_t connectedAt;       /* CLOCK_MONOTONIC nanoseconds, 0 while disconnected */
+    unsigned long attempts;     /* Connection attempts */
+    unsigned long connects;     /* Times the server welcomed us */
+    unsigned long shedEvents;   /* Times load shedding started */
+    uint64_t shedTime;          /* Nanoseconds spent shedding, until the last time it stopped */
+  };
+
+public:
+  Network(const Configuration::NetworkConfig& config);
+  ~Network();
+
+  /* Resolves the server of plain connections. SSL ones need an IRC client
+   * for each connection attempt, clientCbk registers its callbacks.
+   */
+  bool Create(NetworkClientCbk_t clientCbk);
+  bool Ok() const;
+  int Errno() const;
+  const char* Error() const;
+
+  const char* GetName() const;
+  const char* GetChannel() const;
+  int GetFd() const; /* -1 while disconnected */
+  Rsl::Net::IRC::IRCClient* GetClient(); /* 0 while connecting, and on plain connections */
+  const Stats& GetStats() const;
+  const SendQueue::Stats& GetQueueStats() const;
+  const SendQueue::LevelStats& GetQueueStats(SendPriority priority) const;
+  NetworkState GetState() const;
+
+  /* Connects, and reconnects with exponential backoff whenever the
+   * connection is lost, until stopped. The socket is registered in the
+   * reactor with cbk while connected. Unless it uses SSL, the reactor reads
+   * it and hands the data to recvCbk, which passes it to OnReceived(). Its
+   * lines are parsed in place and handed to lineCbk, instead of going
+   * through the IRC client callbacks. Lines for which filterCbk returns
+   * false after a quick scan are not even parsed.
+   */
+  void Start(ReactorCbk_t cbk, ReactorRecvCbk_t recvCbk, NetworkLineCbk_t lineCbk, NetworkFilterCbk_t filterCbk = 0);
+  void Stop();
+
+  /* Attempts still connecting after this are just left to finish, once the
+   * workers may be gone.
+   */
+  static void CloseAttempts();
+
+  /* Lines received on a plain connection are also written to capture */
+  void SetCapture(CaptureWriter* capture, unsigned int index);
+
+  /* Instead of connecting, takes its lines from ReplayLine() and writes
+   * whatever it sends to sink, one line each with the network name and the
+   * priority, without waiting for flood tokens.
+   */
+  void StartReplay(NetworkLineCbk_t lineCbk, NetworkFilterCbk_t filterCbk, FILE* sink);
+  void ReplayLine(const char* line, size_t length);
+
+  /* When the lines being dispatched were read, CLOCK_MONOTONIC nanoseconds */
+  uint64_t GetReceivedAt() const;
+
+  void OnConnect();
+  void OnReadable();
+  void OnReceived(const char* data, ssize_t length);
+  void OnMessage();
+  void OnWritable();
+  void OnNicknameInUse();
+
+  /* Lines are queued, and written by Flush() at the pace allowed by the
+   * server flood rules.
+   */
+  void Send(const Rsl::Net::IRC::IRCText& msg, SendPriority priority = SEND_INTERACTIVE);
+  void Send(const char* target, const Rsl::Net::IRC::IRCText& msg, SendPriority priority = SEND_INTERACTIVE);
+  void Send(const char* target, const ReplyPacker& reply, SendPriority priority = SEND_INTERACTIVE);
+  void SendLine(const std::string& line, SendPriority priority);
+  void Flush(); /* Does nothing while waiting for the socket or for tokens */
+  void Quit(const Rsl::Net::IRC::IRCText& msg);
+
+  /* Longest text of a message to target that the server can relay with our
+   * prefix, 0 if not even an empty one fits.
+   */
+  size_t GetMaxText(const char* target) const;
+
+  /* While the send queue is too deep or too slow, games should merge or
+   * skip their periodic and redundant output. Safe from any thread.
+   */
+  bool IsShedding() const;
+
+private:
+  static void* ConnectMain(void* attempt);
+  static void ConnectDone(void* attempt);
+  static void DeleteClient(void* client);
+  Rsl::Net::IRC::IRCClient* NewClient();
+  static void DoReconnect(void* network);
+  static void DoTimeout(void* network);
+  void Connect();
+  void ConnectClient();
+  void OnConnected();
+  void Register();
+  void CloseSocket();
+  void Disconnect(const char* reason);
+  void ScheduleReconnect();
+
+  static void DoLine(IRCLine& line, void* network);
+  static bool DoFilter(const IRCScan& scan, void* network);
+
+  static void DoFlush(void* network);
+  static ssize_t DoWrite(const iovec* iov, int count, void* network);
+  bool SendMessage(const char* line, size_t length);
+  void Drain(bool force);
+  void WantWrite(bool want);
+  void UpdateLoad();
+
+  int m_errno;
+  std::string m_error;
+  const Configuration::NetworkConfig& m_config;
+  Rsl::Net::IRC::IRCClient* m_client;
+  NetworkClientCbk_t m_clientCbk;
+  Stats m_stats;
+
+  struct Address
+  {
+    sockaddr_storage addr;
+    socklen_t length;
+  };
+  std::vector<Address> m_addresses; /* Of the server, tried in turn */
+  unsigned int m_nextAddress;
+  std::string m_nickname;           /* Asked for while registering */
+
+  NetworkState m_state;
+  ReactorCbk_t m_reactorCbk;
+  ReactorRecvCbk_t m_recvCbk;
+  NetworkLineCbk_t m_lineCbk;
+  NetworkFilterCbk_t m_filterCbk;
+  int m_fd;                 /* Ours on plain connections, the SSL client may close its own first */
+  ConnectAttempt* m_attempt; /* SSL connect in progress, it owns its client until it ends */
+  TimerHandle m_stateTimer; /* Next attempt, or connection timeout */
+  unsigned int m_failures;  /* Attempts since the server last welcomed us */
+  unsigned int m_seed;      /* For the backoff jitter */
+
+  /* Lines are at most 512 bytes, the rest is room to read several at once */
+  enum { NETWORK_RECV_BUFFER = 8192 };
+  char m_recvBuffer[NETWORK_RECV_BUFFER + 1];
+  size_t m_recvLength;
+  uint64_t m_receivedAt;
+
+  SendQueue m_sendQueue;
+  TimerHandle m_flushTimer; /* Waiting for tokens */
+  bool m_wantWrite;         /* Waiting for the socket */
+  bool m_shedding;
+  uint64_t m_shedStart;
+
+  CaptureWriter* m_capture;
+  unsigned int m_captureIndex;
+  FILE* m_sink;             /* Replaying */
+};
+
+#endif /* #ifndef __NETWORK_H */
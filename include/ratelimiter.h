@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RATELIMITER_H
+#define __RATELIMITER_H
+
+#include <stdint.h>
+#include <string>
+#include <tr1/unordered_map>
+
+/* Sliding window rate limiter. Each key has a budget of cost per window,
+ * and what it spent is estimated from the counts of the current and the
+ * previous fixed windows, weighting the previous one by how much of it is
+ * still inside the sliding window. That takes two counters per key instead
+ * of a timestamp per event. Keys idle for two windows are forgotten by
+ * Evict().
+ */
+class RateLimiter
+{
+public:
+  struct Entry
+  {
+    uint64_t windowStart;   /* CLOCK_MONOTONIC nanoseconds */
+    unsigned int current;   /* Spent in the current window */
+    unsigned int previous;  /* Spent in the previous one */
+  };
+
+  struct Stats
+  {
+    unsigned long allowed;
+    unsigned long limited;
+    unsigned long evicted;
+  };
+
+public:
+  RateLimiter();
+
+  /* A window of 0 miliseconds or a budget of 0 disables the limiter */
+  void Configure(unsigned int window, unsigned int budget);
+  bool Enabled() const;
+
+  /* The entry of the key, created if it's new. It stays valid until the
+   * next Evict().
+   */
+  Entry* Get(const std::string& key, uint64_t now);
+  bool Fits(const Entry* entry, unsigned int cost, uint64_t now) const;
+  void Charge(Entry* entry, unsigned int cost);
+  void Reject();
+
+  size_t Evict(uint64_t now);
+  size_t GetSize() const;
+  const Stats& GetStats() const;
+
+private:
+  typedef std::tr1::unordered_map<std::string, Entry> EntryMap;
+
+  uint64_t m_window;        /* In nanoseconds */
+  unsigned int m_budget;
+  EntryMap m_entries;
+  Stats m_stats;
+};
+
+#endif /* #ifndef __RATELIMITER_H */
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+struct epoll_event;
+struct io_uring_sqe;
+struct iovec;
+
+/* Interest and readiness flags */
+#define REACTOR_READ    0x01
+#define REACTOR_WRITE   0x02
+#define REACTOR_ERROR   0x04 /* Only reported, error and hang up are always watched */
+#define REACTOR_EDGE    0x08 /* Edge triggered, the handler must drain the fd */
+
+typedef void (*ReactorCbk_t)(int fd, unsigned int events, void* userData);
+
+/* What the reactor read from an fd, only valid during the call. The length
+ * is 0 when the peer closed the connection, and -errno on errors.
+ */
+typedef void (*ReactorRecvCbk_t)(int fd, const char* data, ssize_t length, void* userData);
+
+/* io_uring is only available when built with --enable-io-uring, and falls
+ * back to epoll if the kernel doesn't support it.
+ */
+enum ReactorBackend
+{
+  REACTOR_EPOLL,
+  REACTOR_IO_URING
+};
+
+/* epoll based event loop. Every component that owns a file descriptor
+ * registers it here with the events it is interested in, and gets its
+ * callback called when the fd is ready.
+ */
+class Reactor
+{
+public:
+  static Reactor* Instance();
+
+public:
+  struct Stats
+  {
+    unsigned long polls;    /* Poll calls */
+    unsigned long events;   /* Dispatched events */
+    unsigned long syscalls; /* Spent waiting, registering events, reading and sending */
+  };
+
+public:
+  Reactor(ReactorBackend backend);
+  ~Reactor();
+
+  bool Ok() const;
+  int Errno() const;
+  const char* Error() const;
+
+  bool Add(int fd, unsigned int events, ReactorCbk_t cbk, void* userData = 0);
+  bool Modify(int fd, unsigned int events);
+  void Remove(int fd);
+
+  /* The reactor reads the fd itself, instead of reporting REACTOR_READ, and
+   * the callback only gets REACTOR_WRITE. With io_uring the reads go to
+   * buffers provided to the kernel, and complete in the same io_uring_enter
+   * that waits for the events. Not for edge triggered fds.
+   */
+  bool SetReceiver(int fd, ReactorRecvCbk_t cbk);
+
+  /* Like sendmsg with MSG_DONTWAIT and MSG_NOSIGNAL. With io_uring the data
+   * is copied and goes to the kernel with the next Poll, along with the
+   * sends of every other fd. Until that one completes further sends fail
+   * with EAGAIN, and REACTOR_WRITE is reported when it does. Its error, if
+   * any, is returned by the next Send.
+   */
+  ssize_t Send(int fd, const iovec* iov, int count);
+
+  /* Hands the queued reads and sends to the kernel without waiting */
+  void Flush();
+
+  /* Waits for events and dispatches them. Returns the number of events or
+   * -1 on error. The timeout is in miliseconds, -1 waits forever.
+   */
+  int Poll(int timeout);
+
+  ReactorBackend GetBackend() const;
+  const Stats& GetStats() const;
+
+private:
+  enum { REACTOR_MAX_EVENTS = 64 };
+
+  enum { REACTOR_RECV_SIZE = 4096 };
+
+  struct Handler
+  {
+    ReactorCbk_t cbk;
+    ReactorRecvCbk_t recvCbk;
+    void* userData;
+    unsigned int events;
+    uint32_t generation; /* Detects events for fds removed in the same Poll */
+    uint32_t instance;   /* The same, but kept by Modify() for the io_uring reads and sends */
+    unsigned int send;   /* io_uring send slot in use plus one, 0 if none */
+    int sendError;       /* Of the last io_uring send, for the next Send() */
+    bool armed;          /* io_uring polls are one shot, and rearmed after each event */
+    bool receiving;      /* Same for the io_uring reads */
+  };
+
+  bool CreateEpoll();
+  int PollEpoll(int timeout);
+  void ReceiveEpoll(int fd);
+
+  /* Memory shared with the kernel, always 0 when built without io_uring */
+  struct Ring;
+
+  bool CreateRing();
+  void DestroyRing();
+  int PollRing(int timeout);
+  io_uring_sqe* GetSqe();
+  io_uring_sqe* NextSqe();
+  void PushSqe();
+  bool Arm(int fd);
+  void Disarm(uint64_t userData);
+  bool Submit(unsigned int minComplete, int timeout);
+  ssize_t SendRing(int fd, const iovec* iov, int count);
+  void ProvideBuffers();
+  void CompleteRecv(uint32_t fd, uint32_t instance, int32_t res, uint32_t flags);
+  void CompleteSend(uint32_t slot, int32_t res);
+
+  Ring* m_ring;
+  std::vector<int> m_unarmed; /* Found the io_uring submission queue full */
+
+  int m_errno;
+  std::string m_error;
+  ReactorBackend m_backend;
+  Stats m_stats;
+  int m_epollFd;
+  std::vector<Handler> m_handlers; /* Indexed by fd */
+  epoll_event* m_events;
+  char* m_buffer;      /* epoll reads for the receivers */
+};
+
+#endif /* #ifndef __REACTOR_H */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __REPLYPACKER_H
+#define __REPLYPACKER_H
+
+#include <string>
+#include <vector>
+#include <rsl/net/irc/text.h>
+
+/* Builds a reply from logical items, that are packed into as few lines as
+ * the protocol allows once the target is known. Items are joined with the
+ * separator, and only an item that doesn't fit in a line by itself is
+ * split, never inside a UTF-8 sequence nor inside a formatting code.
+ */
+class ReplyPacker
+{
+public:
+  ReplyPacker(const char* separator = ", ");
+
+  /* A header is joined to the next item with a space instead of the separator */
+  void AddHeader(const Rsl::Net::IRC::IRCText& header);
+  void Add(const Rsl::Net::IRC::IRCText& item);
+  void Break(); /* The next item starts a new line */
+  bool Empty() const;
+
+  /* Appends the packed lines, of at most maxBytes bytes each, none if it
+   * is 0. The pieces of a split item start with the formatting codes left
+   * active by the previous ones.
+   */
+  void Pack(size_t maxBytes, std::vector<std::string>& lines) const;
+
+private:
+  enum
+  {
+    ITEM_HEADER = 0x01,
+    ITEM_BREAK = 0x02  /* Starts a new line */
+  };
+
+  struct Item
+  {
+    std::string text;
+    unsigned int flags;
+  };
+
+  static size_t SplitPoint(const std::string& text, size_t start, size_t maxBytes);
+
+  std::string m_separator;
+  std::vector<Item> m_items;
+  bool m_break;
+};
+
+#endif /* #ifndef __REPLYPACKER_H */
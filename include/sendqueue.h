@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SENDQUEUE_H
+#define __SENDQUEUE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include "histogram.h"
+#include "sendpriority.h"
+
+struct iovec;
+
+/* Writes like sendmsg, returns the bytes written or -1 and errno */
+typedef ssize_t (*SendQueueWriteCbk_t)(const iovec* iov, int count, void* userData);
+
+/* Outbound lines of a connection. Lines leave at the pace of a token bucket
+ * sized after the flood rules of the server: up to burst lines at once, then
+ * one more every interval miliseconds. Each drain writes every line it is
+ * allowed to with a single write.
+ *
+ * Every priority has its own queue. Critical lines go first and don't take
+ * tokens. The rest are drained either in strict priority order, or by
+ * weighted round robin so that bulk traffic is slowed down but never
+ * starved.
+ */
+class SendQueue
+{
+public:
+  struct Stats
+  {
+    unsigned long depth;         /* Lines waiting */
+    unsigned long highWater;     /* Maximum depth reached */
+    unsigned long queued;        /* Lines pushed */
+    unsigned long sent;          /* Lines completely written */
+    unsigned long bytes;         /* Bytes written */
+    unsigned long writes;        /* Write system calls */
+    unsigned long partialWrites; /* Writes cut short by a full socket */
+    unsigned long throttled;     /* Drains stopped by the token bucket */
+    unsigned long dropped;       /* Lines removed by Drop() */
+  };
+
+  struct LevelStats
+  {
+    unsigned long depth;
+    unsigned long highWater;
+    unsigned long queued;
+    unsigned long sent;
+    Histogram latency;           /* From Push() until completely written, in nanoseconds */
+  };
+
+  enum Policy
+  {
+    SENDQUEUE_STRICT,
+    SENDQUEUE_WEIGHTED
+  };
+
+  /* Drain results */
+  enum
+  {
+    SENDQUEUE_ERROR = -1,
+    SENDQUEUE_BLOCKED = -2, /* The socket is full, wait until it is writable */
+    SENDQUEUE_THROTTLED = -3 /* Out of tokens, see GetNextToken() */
+  };
+
+public:
+  SendQueue(unsigned int burst = 5, unsigned int interval = 2000, Policy policy = SENDQUEUE_WEIGHTED);
+
+  void SetRate(unsigned int burst, unsigned int interval);
+  void SetPolicy(Policy policy);
+
+  /* The line goes without the trailing CRLF, now is CLOCK_MONOTONIC nanoseconds */
+  void Push(const std::string& line, SendPriority priority, uint64_t now);
+  void Clear();
+  bool Empty() const;
+
+  /* Removes the waiting lines of a priority that start with prefix, except
+   * one already partially written. Returns how many were removed.
+   */
+  unsigned int Drop(SendPriority priority, const std::string& prefix);
+
+  /* Writes as many lines as the bucket allows. Returns the number of lines
+   * written, 0 if the queue is empty, or one of the results above when some
+   * lines had to stay queued. Forced drains ignore the bucket. A write that
+   * fails with EAGAIN blocks the queue.
+   */
+  int Drain(SendQueueWriteCbk_t writeCbk, void* userData, uint64_t now, bool force = false);
+
+  /* CLOCK_MONOTONIC nanoseconds when the next token will be available */
+  uint64_t GetNextToken() const;
+  /* When the oldest line subject to flood control was pushed, 0 if there is none */
+  uint64_t GetOldest() const;
+  const Stats& GetStats() const;
+  const LevelStats& GetLevelStats(SendPriority priority) const;
+
+private:
+  enum { SENDQUEUE_MAX_IOV = 64 };
+
+  struct Line
+  {
+    std::string text;
+    uint64_t queuedAt;
+  };
+
+  void Refill(uint64_t now);
+  int Pick(const size_t* cursors, unsigned int* credits, bool tokens) const;
+
+  std::deque<Line> m_lines[SEND_PRIORITIES];
+  int m_partial;         /* Priority of the line partially written, -1 if none */
+  size_t m_offset;       /* Bytes of that line already written */
+  Policy m_policy;
+  unsigned int m_credits[SEND_PRIORITIES]; /* Left in this weighted round */
+  unsigned int m_burst;
+  uint64_t m_interval;   /* Nanoseconds per token */
+  unsigned int m_tokens;
+  uint64_t m_lastRefill;
+  Stats m_stats;
+  LevelStats m_levels[SEND_PRIORITIES];
+};
+
+#endif /* #ifndef __SENDQUEUE_H */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __TEXTVIEW_H
+#define __TEXTVIEW_H
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+/* A piece of text owned by someone else, usually a buffer being parsed. It
+ * stays valid as long as that buffer does.
+ */
+class TextView
+{
+public:
+  TextView()
+    : m_data(""), m_length(0)
+  {
+  }
+
+  TextView(const char* data, size_t length)
+    : m_data(data), m_length(length)
+  {
+  }
+
+  TextView(const char* str)
+    : m_data(str), m_length(strlen(str))
+  {
+  }
+
+  const char* GetData() const { return m_data; }
+  size_t GetLength() const { return m_length; }
+  bool Empty() const { return m_length == 0; }
+  char operator[](size_t pos) const { return m_data[pos]; }
+
+  bool Equals(const TextView& other) const
+  {
+    return m_length == other.m_length && memcmp(m_data, other.m_data, m_length) == 0;
+  }
+
+  bool EqualsNoCase(const TextView& other) const
+  {
+    return m_length == other.m_length && strncasecmp(m_data, other.m_data, m_length) == 0;
+  }
+
+  std::string ToString() const { return std::string(m_data, m_length); }
+
+private:
+  const char* m_data;
+  size_t m_length;
+};
+
+#endif /* #ifndef __TEXTVIEW_H */
@@ -25,10 +25,32 @@
 #ifndef __TIMERS_H
 #define __TIMERS_H
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "histogram.h"
+#include "mutex.h"
+
 class Timer; /* Timer data is private */
 
 typedef void (*TimerCbk_t)(void* userData);
 
+/* Opaque reference to a scheduled timer. A handle stays safe to use after its
+ * timer has expired or been destroyed: it simply stops being valid. 0 is never
+ * a valid handle.
+ */
+typedef uint64_t TimerHandle;
+
+/* Owner token for a set of timers. Destroying a group cancels all its timers
+ * and subgroups at once. 0 means no group.
+ */
+typedef uint64_t TimerGroup;
+
+/* Hands an expired timer to someone else, for example the thread that owns
+ * its group, who must then call Timers::RunDispatched() with it.
+ */
+typedef void (*TimerDispatchCbk_t)(TimerHandle timer, void* dispatchData);
+
 class Timers
 {
   friend class Timer;
@@ -36,22 +58,179 @@ class Timers
 public:
   static Timers* Instance();
 
+public:
+  struct Stats
+  {
+    unsigned long wakeups;      /* Execute calls that fired some timer */
+    unsigned long expirations;  /* Fired timers */
+    unsigned long savedWakeups; /* Wakeups avoided by coalescing timers with slack */
+    unsigned long poolSize;     /* Timer slots allocated */
+    unsigned long poolUsed;     /* Timer slots in use */
+    unsigned long poolHighWater;
+  };
+
+  /* How late the timers with a label fire and how long their callbacks take, in nanoseconds */
+  struct Latency
+  {
+    std::string label;
+    Histogram lateness;
+    Histogram duration;
+  };
+
 public:
   ~Timers();
 
-  Timer* Create(TimerCbk_t cbk, int nrep, unsigned int ms, void* userData = 0);
-  void Destroy(Timer* timer);
+  /* A timer with slack can be delayed up to slack miliseconds, so that it
+   * expires in the same pass as other timers close to it.
+   */
+  TimerHandle Create(TimerCbk_t cbk, int nrep, unsigned int ms, void* userData = 0, unsigned int slack = 0,
+                     TimerGroup group = 0);
+  void Destroy(TimerHandle timer);
+  bool IsValid(TimerHandle timer) const;
   void Execute();
+  void RunDispatched(TimerHandle timer); /* Does nothing if it was destroyed meanwhile */
   long GetNextExecution() const; /* In miliseconds */
+  uint64_t GetNextDeadline() const; /* CLOCK_MONOTONIC nanoseconds, 0 if there are no timers */
+  int GetFd();
+
+  static uint64_t CurrentTime(); /* CLOCK_MONOTONIC nanoseconds */
+  Stats GetStats() const;
+
+  TimerGroup CreateGroup(); /* Subgroup of the current group */
+  void DestroyGroup(TimerGroup group);
+  bool IsValidGroup(TimerGroup group) const;
+
+  /* Group for the timers created without an explicit one, per thread.
+   * While a timer callback runs this is the group of that timer. Returns
+   * the previous one.
+   */
+  TimerGroup SetCurrentGroup(TimerGroup group);
+
+  /* Timers and subgroups take the dispatcher of their group when created.
+   * A timer handed to a dispatcher keeps its slot until RunDispatched(),
+   * unless it or its group is destroyed meanwhile.
+   */
+  void SetGroupDispatcher(TimerGroup group, TimerDispatchCbk_t dispatcher, void* dispatchData);
+
+  /* Timers take the label of their group when created, groups the label of
+   * their parent. Labels are copied.
+   */
+  void SetLabel(TimerHandle timer, const char* label);
+  void SetGroupLabel(TimerGroup group, const char* label);
+  std::vector<Latency> GetLatencies() const;
+  void DumpLatencies() const;
 
 private:
+  /* Hierarchical timing wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots each.
+   * A slot in level N covers WHEEL_SLOTS^N miliseconds, so six levels of 64
+   * slots span more than two years with a resolution of one milisecond.
+   */
+  enum
+  {
+    WHEEL_BITS = 6,
+    WHEEL_SLOTS = 1 << WHEEL_BITS,
+    WHEEL_LEVELS = 6
+  };
+
+  /* Timers are allocated from slabs of TIMER_SLAB_SIZE, which are only
+   * released on destruction.
+   */
+  enum
+  {
+    TIMER_SLAB_BITS = 8,
+    TIMER_SLAB_SIZE = 1 << TIMER_SLAB_BITS
+  };
+
+  struct Node
+  {
+    Node* next;
+    Node* prev;
+  };
+
+  struct Dispatcher
+  {
+    TimerDispatchCbk_t cbk;
+    void* data;
+  };
+
+  /* Subgroups hang from their parent in a list. Indexes plus one, 0 for none */
+  struct GroupLinks
+  {
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t next;
+    uint32_t prev;
+  };
+
   Timers();
-  void DeleteFromList(Timer* timer);
   void InsertTimer(Timer* timer);
-  Timer* FindTimer(Timer* timer);
+  void DeleteFromList(Timer* timer);
+  Timer* LookupTimer(TimerHandle timer) const;
+  Timer* FindTimer(TimerHandle timer) const;
+  bool IsAlive(const Timer* timer) const;
+  void ReleaseTimer(Timer* timer);
+  bool ReleaseGroup(TimerGroup group);
+  void RecycleGroup(uint32_t index);
+  void ReleaseDispatched();
+  void GrowPool();
+  bool NextExpiration(int& level, int& slot, uint64_t& deadline) const;
+  void FireTimer(Timer* timer, uint64_t& now);
+  Latency* FindLatency(const char* label);
+  void Rearm();
+
+  Node m_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t m_occupied[WHEEL_LEVELS];
+  uint64_t m_elapsed; /* Current wheel position, in miliseconds */
+
+  /* Timers out of the wheel waiting for RunDispatched(), swept by Execute()
+   * to release those whose group was destroyed.
+   */
+  Node m_dispatched;
+
+  /* timerfd armed at the next expiration, so the main loop can be woken by the kernel */
+  int m_fd;
+  uint64_t m_armedDeadline;
+
+  Stats m_stats;
+  std::vector<uint64_t> m_firedTicks; /* Scratch space to account coalesced wakeups */
+  std::vector<Latency *> m_latencies;
+
+  /* Timer pool, a handle holds the index of its slot */
+  std::vector<Timer *> m_slabs;
+  std::vector<uint32_t> m_freeIndices;
 
-  Timer* m_firstTimer;
-  Timer* m_lastTimer;
+  /* Groups are cancelled by bumping their generation, their timers are
+   * released when the wheel reaches them. Subgroups are cancelled along
+   * with their parent, so a group is valid while its generation matches.
+   */
+  std::vector<uint32_t> m_groupGenerations;
+  std::vector<GroupLinks> m_groupLinks;
+  std::vector<Latency *> m_groupLatencies;
+  std::vector<Dispatcher> m_groupDispatchers;
+  std::vector<uint32_t> m_freeGroups;
+
+  /* Every method can be called from any thread. Callbacks run unlocked,
+   * even if Execute() is entered with the mutex already held.
+   */
+  mutable Mutex m_mutex;
+};
+
+/* Makes the timers created during its lifetime belong to a group */
+class TimerGroupScope
+{
+public:
+  TimerGroupScope(TimerGroup group)
+    : m_previous(Timers::Instance()->SetCurrentGroup(group))
+  {
+  }
+
+  ~TimerGroupScope()
+  {
+    Timers::Instance()->SetCurrentGroup(m_previous);
+  }
+
+private:
+  TimerGroup m_previous;
 };
 
 #endif /* #ifndef __TIMERS_H */
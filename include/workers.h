@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __WORKERS_H
+#define __WORKERS_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "mutex.h"
+
+typedef void (*WorkCbk_t)(void* userData);
+
+class Strand; /* Strand data is private */
+
+/* Double ended queue on a ring that only grows, so that once it had room
+ * for its busiest moment pushing and popping never allocate.
+ */
+template <typename T>
+class WorkQueue
+{
+public:
+  WorkQueue()
+    : m_first(0), m_size(0)
+  {
+  }
+
+  size_t Size() const { return m_size; }
+  const T& Front() const { return m_items[m_first]; }
+  const T& Back() const { return m_items[(m_first + m_size - 1) & (m_items.size() - 1)]; }
+
+  void PushBack(const T& item)
+  {
+    if (m_size == m_items.size())
+    {
+      std::vector<T> items(m_size > 0 ? m_size * 2 : 16);
+      for (size_t i = 0; i < m_size; i++)
+        items[i] = m_items[(m_first + i) & (m_items.size() - 1)];
+      m_items.swap(items);
+      m_first = 0;
+    }
+    m_items[(m_first + m_size) & (m_items.size() - 1)] = item;
+    m_size++;
+  }
+
+  void PopFront()
+  {
+    m_first = (m_first + 1) & (m_items.size() - 1);
+    m_size--;
+  }
+
+  void PopBack()
+  {
+    m_size--;
+  }
+
+private:
+  std::vector<T> m_items; /* Its size is a power of two */
+  size_t m_first;
+  size_t m_size;
+};
+
+/* Thread pool for the game logic. Work is posted to strands: the tasks of a
+ * strand run one after another, in the order they were posted, but
+ * different strands run in parallel. Each worker has its own queue of
+ * runnable strands and steals from the others when it runs out of work.
+ *
+ * Workers hand results back to the main thread with Reply(), which never
+ * blocks. The main thread watches GetFd() and calls RunReplies().
+ */
+class Workers
+{
+public:
+  static Workers* Instance();
+
+public:
+  struct Stats
+  {
+    unsigned long threads;
+    unsigned long tasks;    /* Tasks run */
+    unsigned long steals;   /* Strands taken from the queue of another worker */
+    unsigned long replies;  /* Replies run in the main thread */
+  };
+
+public:
+  ~Workers();
+
+  bool Ok() const;
+  int Errno() const;
+  const char* Error() const;
+
+  /* Without threads the tasks run in the thread that posts them */
+  bool Start(unsigned int numThreads);
+  void Stop();
+
+  Strand* CreateStrand();
+  void DestroyStrand(Strand* strand); /* After its pending tasks have run */
+  void Post(Strand* strand, WorkCbk_t cbk, void* userData);
+  void Wait(); /* Until every posted task has run */
+
+  void Reply(WorkCbk_t cbk, void* userData);
+  int GetFd() const;
+  void RunReplies();
+
+  Stats GetStats() const;
+
+private:
+  Workers();
+
+  enum { STRAND_BATCH = 16 }; /* Tasks run from a strand before giving others a chance */
+
+  struct Worker
+  {
+    Workers* pool;
+    unsigned int index;
+    pthread_t thread;
+    Mutex mutex;
+    WorkQueue<Strand *> queue; /* The owner takes from the front, thieves from the back */
+    unsigned long tasks;
+    unsigned long steals;
+  };
+
+  /* Intrusive multiple producer, single consumer queue. Producers only swap
+   * the head, the consumer owns the tail. There is always a node in the
+   * queue, so neither side needs a lock.
+   */
+  struct ReplyNode
+  {
+    ReplyNode* next;
+    WorkCbk_t cbk;
+    void* userData;
+  };
+
+  static void* WorkerMain(void* worker);
+  void Schedule(Strand* strand);
+  void Enqueue(Worker* worker, Strand* strand);
+  Strand* Take(Worker* worker);
+  void RunStrand(Worker* worker, Strand* strand);
+  void PushReply(ReplyNode* node);
+  ReplyNode* PopReply();
+
+  int m_errno;
+  std::string m_error;
+
+  std::vector<Worker *> m_workers;
+  unsigned int m_nextWorker;
+  bool m_running; /* Changed with the idle mutex held */
+
+  /* Idle workers sleep until some strand is scheduled */
+  Mutex m_idleMutex;
+  Condition m_idleCondition;
+  unsigned int m_pending;   /* Scheduled strands not taken yet */
+  unsigned int m_sleeping;
+
+  /* Strands scheduled or running, for Wait() */
+  Condition m_doneCondition;
+  unsigned int m_busy;
+
+  ReplyNode* m_replyHead;
+  ReplyNode* m_replyTail;
+  ReplyNode m_replyStub;
+  int m_replySignalled;
+  int m_replyFd;
+
+  unsigned long m_tasks;  /* Of the workers already stopped */
+  unsigned long m_steals;
+  unsigned long m_replies;
+};
+
+#endif /* #ifndef __WORKERS_H */
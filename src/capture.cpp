@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "capture.h"
+
+/* Large writes, a busy network receives hundreds of lines per second */
+#define CAPTURE_BUFFER (256 * 1024)
+
+CaptureWriter::CaptureWriter()
+  : m_errno(0), m_error(""), m_fp(0), m_lastTime(0), m_records(0)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+  Close();
+}
+
+bool CaptureWriter::Create(const char* path)
+{
+  m_fp = fopen(path, "wb");
+  if (!m_fp)
+  {
+    m_errno = errno;
+    m_error = strerror(errno);
+    return false;
+  }
+  setvbuf(m_fp, 0, _IOFBF, CAPTURE_BUFFER);
+
+  if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH, 1, m_fp) != 1)
+  {
+    m_errno = errno;
+    m_error = strerror(errno);
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+bool CaptureWriter::Ok() const
+{
+  return !m_errno;
+}
+
+int CaptureWriter::Errno() const
+{
+  return m_errno;
+}
+
+const char* CaptureWriter::Error() const
+{
+  return m_error.c_str();
+}
+
+void CaptureWriter::WriteVarint(uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    putc_unlocked((int)(value & 0x7F) | 0x80, m_fp);
+    value >>= 7;
+  }
+  putc_unlocked((int)value, m_fp);
+}
+
+void CaptureWriter::Write(uint64_t time, unsigned int network, const char* buffer, size_t length)
+{
+  if (!m_fp)
+    return;
+
+  const char* start = buffer;
+  const char* end = buffer + length;
+  while (start < end)
+  {
+    const char* newline = (const char *)memchr(start, '\n', end - start);
+    if (!newline)
+      break;
+
+    const char* lineEnd = newline;
+    if (lineEnd > start && lineEnd[-1] == '\r')
+      lineEnd--;
+
+    if (lineEnd > start)
+    {
+      WriteVarint(m_records > 0 && time > m_lastTime ? time - m_lastTime : 0);
+      WriteVarint(network);
+      WriteVarint(lineEnd - start);
+      fwrite(start, lineEnd - start, 1, m_fp);
+      m_lastTime = time;
+      m_records++;
+    }
+    start = newline + 1;
+  }
+}
+
+void CaptureWriter::Flush()
+{
+  if (m_fp)
+    fflush(m_fp);
+}
+
+void CaptureWriter::Close()
+{
+  if (m_fp)
+  {
+    fclose(m_fp);
+    m_fp = 0;
+  }
+}
+
+unsigned long CaptureWriter::GetRecords() const
+{
+  return m_records;
+}
+
+
+CaptureReader::CaptureReader()
+  : m_errno(0), m_error(""), m_fp(0), m_time(0), m_first(true)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+  if (m_fp)
+    fclose(m_fp);
+}
+
+bool CaptureReader::Create(const char* path)
+{
+  char magic[CAPTURE_MAGIC_LENGTH];
+
+  m_fp = fopen(path, "rb");
+  if (!m_fp)
+  {
+    m_errno = errno;
+    m_error = strerror(errno);
+    return false;
+  }
+  setvbuf(m_fp, 0, _IOFBF, CAPTURE_BUFFER);
+
+  if (fread(magic, sizeof(magic), 1, m_fp) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0)
+  {
+    m_errno = EINVAL;
+    m_error = "Not a traffic capture";
+    return false;
+  }
+
+  return true;
+}
+
+bool CaptureReader::Ok() const
+{
+  return !m_errno;
+}
+
+int CaptureReader::Errno() const
+{
+  return m_errno;
+}
+
+const char* CaptureReader::Error() const
+{
+  return m_error.c_str();
+}
+
+bool CaptureReader::ReadVarint(uint64_t& value)
+{
+  value = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7)
+  {
+    int c = getc_unlocked(m_fp);
+    if (c == EOF)
+      return false;
+    value |= (uint64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool CaptureReader::Next(Record& record)
+{
+  uint64_t delta;
+  uint64_t network;
+  uint64_t length;
+
+  if (!m_fp || !ReadVarint(delta))
+    return false;
+  if (!ReadVarint(network) || !ReadVarint(length) || length > CAPTURE_MAX_LINE ||
+      fread(record.line, length, 1, m_fp) != 1)
+  {
+    m_errno = EINVAL;
+    m_error = "Truncated or damaged record";
+    return false;
+  }
+
+  m_time = (m_first ? 0 : m_time + delta);
+  m_first = false;
+  record.time = m_time;
+  record.network = (unsigned int)network;
+  record.length = (size_t)length;
+  return true;
+}
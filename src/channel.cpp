@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "channel.h"
+
+using namespace Rsl::Net::IRC;
+
+/* Copies of the data handed between threads */
+
+/* A message for the session: this header followed by the source, dest,
+ * command and text, each NUL terminated, all in a single allocation.
+ */
+struct ChannelText
+{
+  ChannelText* next;      /* In the pool */
+  size_t capacity;        /* Bytes for the strings */
+  Channel* channel;
+  int kind;
+  GameUser user;
+  uint64_t received;
+  size_t sourceLength;
+  size_t destLength;
+  size_t commandLength;
+  size_t textLength;
+};
+
+/* Big enough for any IRC line. The buffers are taken from the main thread
+ * and given back from the workers to a second list, which the main thread
+ * takes whole when its own runs out. Only one thread takes from the shared
+ * list, so pushing to it with a compare and swap is safe.
+ */
+#define CHANNEL_TEXT_CAPACITY (1024 - sizeof(ChannelText))
+static ChannelText* s_freeTexts = 0;
+static ChannelText* s_returnedTexts = 0;
+
+static ChannelText* AllocText(size_t length)
+{
+  if (length <= CHANNEL_TEXT_CAPACITY)
+  {
+    if (!s_freeTexts)
+      s_freeTexts = __atomic_exchange_n(&s_returnedTexts, (ChannelText *)0, __ATOMIC_ACQUIRE);
+    if (s_freeTexts)
+    {
+      ChannelText* text = s_freeTexts;
+      s_freeTexts = text->next;
+      return text;
+    }
+    length = CHANNEL_TEXT_CAPACITY;
+  }
+
+  ChannelText* text = (ChannelText *)malloc(sizeof(ChannelText) + length);
+  if (text)
+    text->capacity = length;
+  return text;
+}
+
+static void FreeText(ChannelText* text)
+{
+  if (text->capacity != CHANNEL_TEXT_CAPACITY)
+  {
+    free(text);
+    return;
+  }
+
+  ChannelText* head = __atomic_load_n(&s_returnedTexts, __ATOMIC_RELAXED);
+  do
+    text->next = head;
+  while (!__atomic_compare_exchange_n(&s_returnedTexts, &head, text, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+struct ChannelReply
+{
+  ChannelReply(Network* network_, const std::string& target_, const ReplyPacker& reply_, SendPriority priority_)
+    : network(network_), target(target_), reply(reply_), priority(priority_)
+  {
+  }
+
+  Network* network;
+  std::string target;
+  ReplyPacker reply;
+  SendPriority priority;
+};
+
+/* Every call into the session runs inside the session timer group, so the
+ * timers it creates are cancelled with it.
+ */
+Channel::Channel(Network* network, const char* name, Game* game, int apiVersion, TimerGroup timers)
+  : m_network(network), m_name(name), m_game(game), m_apiVersion(apiVersion), m_session(0), m_timers(timers)
+{
+  m_strand = Workers::Instance()->CreateStrand();
+  Timers::Instance()->SetGroupDispatcher(m_timers, Channel::DispatchTimer, this);
+
+  TimerGroupScope scope(m_timers);
+  m_session = m_game->CreateSession(this);
+}
+
+Channel::~Channel()
+{
+  {
+    TimerGroupScope scope(m_timers);
+    delete m_session;
+  }
+  Timers::Instance()->DestroyGroup(m_timers);
+}
+
+const char* Channel::GetName() const
+{
+  return m_name.c_str();
+}
+
+void Channel::Send(const IRCText& msg, SendPriority priority)
+{
+  ReplyPacker reply;
+  reply.Add(msg);
+  Send(reply, priority);
+}
+
+void Channel::Send(const ReplyPacker& reply, SendPriority priority)
+{
+  Workers::Instance()->Reply(Channel::DoSend, new ChannelReply(m_network, m_name, reply, priority));
+}
+
+bool Channel::IsShedding() const
+{
+  return m_network->IsShedding();
+}
+
+void Channel::DoSend(void* userData)
+{
+  ChannelReply* reply = (ChannelReply *)userData;
+  reply->network->Send(reply->target.c_str(), reply->reply, reply->priority);
+  delete reply;
+}
+
+Network* Channel::GetNetwork() const
+{
+  return m_network;
+}
+
+Game* Channel::GetGame() const
+{
+  return m_game;
+}
+
+GameSession* Channel::GetSession() const
+{
+  return m_session;
+}
+
+TimerGroup Channel::GetTimerGroup() const
+{
+  return m_timers;
+}
+
+void Channel::Start()
+{
+  Workers::Instance()->Post(m_strand, Channel::DoStart, this);
+}
+
+void Channel::DoStart(void* userData)
+{
+  Channel* channel = (Channel *)userData;
+  TimerGroupScope scope(channel->m_timers);
+  channel->m_session->Start();
+}
+
+void Channel::Deliver(const GameMessage& msg)
+{
+  size_t length = msg.source.GetLength() + msg.dest.GetLength() + msg.command.GetLength() + msg.text.GetLength() + 4;
+  ChannelText* copy = AllocText(length);
+  if (!copy)
+  {
+    printf("Cannot copy a message for the session in %s, dropped\n", m_name.c_str());
+    return;
+  }
+
+  copy->channel = this;
+  copy->kind = msg.kind;
+  copy->user = msg.user;
+  copy->received = msg.received;
+  copy->sourceLength = msg.source.GetLength();
+  copy->destLength = msg.dest.GetLength();
+  copy->commandLength = msg.command.GetLength();
+  copy->textLength = msg.text.GetLength();
+
+  char* p = (char *)(copy + 1);
+  memcpy(p, msg.source.GetData(), copy->sourceLength);
+  p += copy->sourceLength;
+  *p++ = '\0';
+  memcpy(p, msg.dest.GetData(), copy->destLength);
+  p += copy->destLength;
+  *p++ = '\0';
+  for (size_t i = 0; i < copy->commandLength; i++)
+    *p++ = tolower(msg.command[i]);
+  *p++ = '\0';
+  memcpy(p, msg.text.GetData(), copy->textLength);
+  p[copy->textLength] = '\0';
+
+  Workers::Instance()->Post(m_strand, Channel::DoDeliver, copy);
+}
+
+/* The views point to the copy, which lives until the session returns */
+void Channel::DoDeliver(void* userData)
+{
+  ChannelText* text = (ChannelText *)userData;
+  Channel* channel = text->channel;
+  const char* source = (const char *)(text + 1);
+  const char* dest = source + text->sourceLength + 1;
+  const char* command = dest + text->destLength + 1;
+  const char* line = command + text->commandLength + 1;
+  {
+    TimerGroupScope scope(channel->m_timers);
+    GameSession* session = channel->m_session;
+
+    if (channel->m_apiVersion >= 2)
+    {
+      GameMessage msg;
+      msg.size = sizeof(GameMessage);
+      msg.channel = channel;
+      msg.kind = text->kind;
+      msg.user = text->user;
+      msg.received = text->received;
+      msg.source = TextView(source, text->sourceLength);
+      msg.dest = TextView(dest, text->destLength);
+      msg.command = TextView(command, text->commandLength);
+      msg.text = TextView(line, text->textLength);
+      session->OnMessage(msg);
+    }
+    else if (text->commandLength == 0)
+      session->ParseText(source, dest, line);
+    else
+      session->OnCommand(source, dest, command, line);
+  }
+  FreeText(text);
+}
+
+/* Timers are only dispatched from the main thread, so once the group is
+ * destroyed here no timer task can be posted to the strand anymore.
+ */
+void Channel::Close()
+{
+  Workers* workers = Workers::Instance();
+  Strand* strand = m_strand;
+
+  Timers::Instance()->DestroyGroup(m_timers);
+  workers->Post(strand, Channel::DoClose, this);
+  workers->DestroyStrand(strand);
+}
+
+void Channel::DoClose(void* userData)
+{
+  Channel* channel = (Channel *)userData;
+  {
+    TimerGroupScope scope(channel->m_timers);
+    channel->m_session->Stop();
+  }
+  delete channel;
+}
+
+/* The handle goes as the argument of the task, the heap is only used
+ * where pointers are too small for it.
+ */
+void Channel::DispatchTimer(TimerHandle timer, void* channel)
+{
+  Strand* strand = ((Channel *)channel)->m_strand;
+  if (sizeof(void *) >= sizeof(TimerHandle))
+    Workers::Instance()->Post(strand, Channel::DoTimer, (void *)(uintptr_t)timer);
+  else
+    Workers::Instance()->Post(strand, Channel::DoTimerCopy, new TimerHandle(timer));
+}
+
+void Channel::DoTimer(void* timer)
+{
+  Timers::Instance()->RunDispatched((TimerHandle)(uintptr_t)timer);
+}
+
+void Channel::DoTimerCopy(void* userData)
+{
+  TimerHandle* timer = (TimerHandle *)userData;
+  Timers::Instance()->RunDispatched(*timer);
+  delete timer;
+}
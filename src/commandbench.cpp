@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Measures the command path: splitting the text of a "!" line into words,
+ * with CommandLine as the bot does, against copying every word into a
+ * vector of strings as it used to. The last pass starts from the raw IRC
+ * line, parsing it in place before splitting the command.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <string>
+#include <vector>
+#include "commandline.h"
+#include "ircline.h"
+
+static const char* commandMix[] =
+{
+  ":player!user@host.example.com PRIVMSG #numbers :!start numbers",
+  ":player!user@host.example.com PRIVMSG #numbers :!stop",
+  ":someone!~someone@192.168.1.20 PRIVMSG #games :!list",
+  ":other!other@users.example.org PRIVMSG #numbers :!top",
+  ":other!other@users.example.org PRIVMSG #numbers :!rank   somebody",
+  ":helper!help@staff.example.net PRIVMSG #games :!games",
+  ":admin!admin@staff.example.net PRIVMSG #games :!refresh now please"
+};
+#define COMMAND_LINES (sizeof(commandMix) / sizeof(commandMix[0]))
+
+/* Counts the allocations of each pass */
+static unsigned long allocations = 0;
+
+void* operator new(size_t size)
+{
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+static inline uint64_t Now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* How the commands used to be split */
+static inline void Split(const std::string& str, std::vector<std::string>& dest)
+{
+  int p;
+  int i = 0;
+
+  do
+  {
+    while (str[i] == ' ')
+      i++;
+
+    p = str.find(" ", i);
+    if (p > -1)
+    {
+      dest.push_back(str.substr(i, p - i));
+      i = p + 1;
+    }
+  } while (p > -1);
+
+  if (str[i] != '\0')
+    dest.push_back(str.substr(i));
+}
+
+struct Totals
+{
+  unsigned long lines;
+  unsigned long words;
+};
+
+static void SplitLine(IRCLine& line, void* userData)
+{
+  Totals* totals = (Totals *)userData;
+  CommandLine params;
+
+  totals->lines++;
+  if (line.type == IRC_COMMAND_PRIVMSG && line.numParams == 2 && line.params[1][0] == '!')
+    totals->words += params.Parse(line.params[1].GetData() + 1);
+}
+
+static void Report(const char* name, const Totals& totals, uint64_t elapsed, unsigned long allocs)
+{
+  double seconds = elapsed / 1e9;
+  printf("%-8s %lu lines in %.3f s, %.2f M lines/s, %.1f ns/line, %.2f words/line, %.2f allocations/line\n",
+         name, totals.lines, seconds, totals.lines / seconds / 1e6, elapsed / (double)totals.lines,
+         totals.words / (double)totals.lines, allocs / (double)totals.lines);
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned int numLines = 100000;
+  unsigned int rounds = 50;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:r:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l': numLines = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        printf("Usage: %s [-l lines per round] [-r rounds]\n", argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  std::string traffic;
+  std::vector<std::string> texts;
+  srand(1);
+  for (unsigned int i = 0; i < numLines; i++)
+  {
+    const char* line = commandMix[rand() % COMMAND_LINES];
+    traffic.append(line).append("\r\n");
+    texts.push_back(strstr(line, " :!") + 3);
+  }
+
+  std::vector<char> buffer(traffic.length() + 1);
+  Totals totals;
+  printf("%u commands per round, %u rounds\n", numLines, rounds);
+
+  memset(&totals, 0, sizeof(totals));
+  allocations = 0;
+  uint64_t start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    for (unsigned int i = 0; i < numLines; i++)
+    {
+      CommandLine params;
+      totals.words += params.Parse(texts[i].c_str());
+    }
+    totals.lines += numLines;
+  }
+  Report("views", totals, Now() - start, allocations);
+
+  memset(&totals, 0, sizeof(totals));
+  allocations = 0;
+  start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    for (unsigned int i = 0; i < numLines; i++)
+    {
+      std::vector<std::string> params;
+      Split(texts[i].c_str(), params);
+      totals.words += params.size();
+    }
+    totals.lines += numLines;
+  }
+  Report("strings", totals, Now() - start, allocations);
+
+  /* Restoring the buffer is part of the cost, just like receiving it would be */
+  memset(&totals, 0, sizeof(totals));
+  allocations = 0;
+  start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    memcpy(&buffer[0], traffic.data(), traffic.length());
+    ircParseLines(&buffer[0], traffic.length(), SplitLine, &totals);
+  }
+  Report("raw", totals, Now() - start, allocations);
+
+  return EXIT_SUCCESS;
+}
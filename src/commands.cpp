@@ -22,6 +22,9 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
 #include <string>
 #include <vector>
 #include "commands.h"
@@ -30,72 +33,91 @@
 
 using namespace Rsl::Net::IRC;
 
-#define COMMAND(x) void CommandHandler::cmd_ ## x (GamesBot* bot, const IRCUser* source, const IRCUser* dest, const std::vector<std::string>& params)
+#define COMMAND(x) void CommandHandler::cmd_ ## x (GamesBot* bot, const char* source, const char* dest, const CommandLine& params)
+
+/* Replies go to the channel where the command was said, or back to the user in private */
+#define CHANNEL (dest)
+#define REPLYTO (*CHANNEL == '#' ? CHANNEL : source)
+#define REPLY(x) bot->Send(REPLYTO, x)
 
 
 COMMAND(games)
 {
-  bot->Send(IRCText("%C03List of commands:%C"));
-  bot->Send(IRCText("%C12!list%C           Lists the available games"));
-  bot->Send(IRCText("%C12!start <game>%C   Starts a game"));
-  bot->Send(IRCText("%C12!stop%C           Stops the current game"));
-  bot->Send(IRCText("%C12!refresh%C        Reloads the available games"));
+  ReplyPacker reply(" | ");
+  reply.AddHeader(IRCText("%C03List of commands:%C"));
+  reply.Add(IRCText("%C12!list%C lists the available games"));
+  reply.Add(IRCText("%C12!start <game>%C starts a game in this channel"));
+  reply.Add(IRCText("%C12!stop%C stops the game of this channel"));
+  reply.Add(IRCText("%C12!refresh%C reloads the available games"));
+  REPLY(reply);
 }
 
 COMMAND(list)
 {
-  bot->Send(IRCText("%C03Available games:%C"));
+  ReplyPacker reply;
+  reply.AddHeader(IRCText("%C03Available games:%C"));
   const std::vector<std::string>& availGames = bot->ListGames();
 
   for (std::vector<std::string>::const_iterator i = availGames.begin();
        i != availGames.end();
        i++)
   {
-    if ((*i) == bot->GetGame())
-      bot->Send(IRCText("%B%C02*%C%B %s", (*i).c_str()));
+    if ((*i) == bot->GetGame(CHANNEL))
+      reply.Add(IRCText("%B%C02*%C%B %s", (*i).c_str()));
     else
-      bot->Send((*i).c_str());
+      reply.Add(IRCText("%s", (*i).c_str()));
   }
+  REPLY(reply);
 }
 
 COMMAND(start)
 {
-  if (params.size() < 2)
+  if (params.GetCount() < 2)
+    return;
+
+  if (*CHANNEL != '#')
+  {
+    REPLY(IRCText("%C04Error:%C Games must be started in a channel"));
     return;
+  }
 
-  const char* curGame = bot->GetGame();
+  const char* curGame = bot->GetGame(CHANNEL);
   if (*curGame != '\0')
   {
-    bot->Send(IRCText("%C04Error:%C There is an already started game, use %C12!stop%C to stop it."));
+    REPLY(IRCText("%C04Error:%C There is an already started game, use %C12!stop%C to stop it."));
   }
   else
   {
-    bot->Send(IRCText("Starting game %C12%s%C ...", params[1].c_str()));
-    if (!bot->StartGame(params[1].c_str()))
-      bot->Send(IRCText("%C04Error:%C Unable to start game \"%s\"", params[1].c_str()));
+    REPLY(IRCText("Starting game %C12%s%C ...", params[1].GetData()));
+    if (!bot->StartGame(CHANNEL, params[1].GetData()))
+      REPLY(IRCText("%C04Error:%C Unable to start game \"%s\"", params[1].GetData()));
   }
 }
 
 COMMAND(stop)
 {
-  const char* curGame = bot->GetGame();
+  const char* curGame = bot->GetGame(CHANNEL);
   if (*curGame == '\0')
   {
-    bot->Send(IRCText("%C04Error:%C There are not running games"));
+    REPLY(IRCText("%C04Error:%C There are not running games"));
   }
   else
   {
-    bot->Send(IRCText("Stopping game %C12%s%C...", curGame));
-    bot->StopGame();
+    REPLY(IRCText("Stopping game %C12%s%C...", curGame));
+    bot->StopGame(CHANNEL);
   }
 }
 
 COMMAND(refresh)
 {
-  bot->Send(IRCText("Refreshing games ..."));
+  REPLY(IRCText("Refreshing games ..."));
   bot->ReloadGames();
-  bot->Send(IRCText("Done!"));
+  REPLY(IRCText("Done!"));
 }
+
+#undef REPLY
+#undef REPLYTO
+#undef CHANNEL
 /* */
 
 
@@ -110,72 +132,156 @@ CommandHandler* CommandHandler::Instance()
   return instance;
 }
 
-CommandHandler::CommandHandler()
+/* Perfect for the core commands: the first letter, twice the last one and
+ * twice the length, lowercase. Found by trying shifts until none collide,
+ * a new core command may need a new one; the build checks it.
+ */
+constexpr unsigned int CommandHandler::CoreHash(const char* name, size_t length)
 {
-#define ADDCOMMAND(x) RegisterCommand( #x , CommandHandler::cmd_ ##x )
-  ADDCOMMAND(games);
-  ADDCOMMAND(list);
-  ADDCOMMAND(start);
-  ADDCOMMAND(stop);
-  ADDCOMMAND(refresh);
-#undef ADDCOMMAND
+  return ((name[0] | 0x20) + ((name[length - 1] | 0x20) << 1) + (length << 1)) & (CORE_TABLE_SIZE - 1);
 }
 
-void CommandHandler::RegisterCommand(const std::string& name, cmd_t callback)
+constexpr bool CommandHandler::CoreHashIsPerfect(const Command* commands, size_t count)
 {
-  Command cmd;
-  cmd.name = name;
-  cmd.callback = callback;
-  m_commands.push_back(cmd);
+  for (size_t i = 0; i < count; i++)
+  {
+    for (size_t j = i + 1; j < count; j++)
+    {
+      if (CoreHash(commands[i].name, commands[i].length) == CoreHash(commands[j].name, commands[j].length))
+        return false;
+    }
+  }
+  return true;
 }
 
-static inline void Split(const std::string& str, std::vector<std::string>& dest)
+CommandHandler::CommandHandler()
 {
-  int p;
-  int i = 0;
+  memset(m_core, 0, sizeof(m_core));
 
-  do
+#define ADDCOMMAND(x) { #x , sizeof(#x) - 1, CommandHandler::cmd_ ##x }
+  static constexpr Command coreCommands[] =
   {
-    while (str[i] == ' ')
-    {
-      i++;
-    }
+    ADDCOMMAND(games),
+    ADDCOMMAND(list),
+    ADDCOMMAND(start),
+    ADDCOMMAND(stop),
+    ADDCOMMAND(refresh)
+  };
+#undef ADDCOMMAND
+  static_assert(CoreHashIsPerfect(coreCommands, sizeof(coreCommands) / sizeof(coreCommands[0])),
+                "Two core commands share a slot, CoreHash() needs other shifts");
 
-    p = str.find(" ", i);
-    if (p > -1)
-    {
-      dest.push_back(str.substr(i, p - i));
-      i = p + 1;
-    }
-  } while (p > -1);
+  for (unsigned int i = 0; i < sizeof(coreCommands) / sizeof(coreCommands[0]); i++)
+    m_core[CoreHash(coreCommands[i].name, coreCommands[i].length)] = coreCommands[i];
+
+  RebuildGameCommands();
+}
+
+const CommandHandler::Command* CommandHandler::FindCore(const char* name, size_t length) const
+{
+  if (length == 0)
+    return 0;
+
+  const Command* command = &m_core[CoreHash(name, length)];
+  if (command->length == length && strncasecmp(command->name, name, length) == 0)
+    return command;
+  return 0;
+}
 
-  if (str[i] != '\0')
+/* FNV-1a of the lowercase name */
+uint32_t CommandHandler::HashName(const char* name, size_t length)
+{
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < length; i++)
   {
-    dest.push_back(str.substr(i));
+    hash ^= (unsigned char)tolower(name[i]);
+    hash *= 16777619U;
   }
+  return hash;
 }
 
-void CommandHandler::Handle(const IRCUser* source, const IRCUser* dest, const std::string& text)
+bool CommandHandler::RegisterGameCommand(const char* name, const Game* game)
 {
-  if ( text.length() < 2 || text[0] != '!' )
-    return;
+  size_t length = strlen(name);
+  if (length == 0 || strchr(name, ' ') || FindCore(name, length))
+    return false;
+
+  GameCommand command;
+  command.name.reserve(length);
+  for (size_t i = 0; i < length; i++)
+    command.name += tolower(name[i]);
+  command.hash = HashName(name, length);
+  command.game = game;
+  m_gameCommands.push_back(command);
+  return true;
+}
+
+void CommandHandler::ClearGameCommands()
+{
+  m_gameCommands.clear();
+  RebuildGameCommands();
+}
+
+void CommandHandler::InsertGameCommand(const GameCommand& command)
+{
+  size_t mask = m_gameTable.size() - 1;
+  size_t slot = command.hash & mask;
+  while (m_gameTable[slot].game)
+    slot = (slot + 1) & mask;
+  m_gameTable[slot] = command;
+}
+
+void CommandHandler::RebuildGameCommands()
+{
+  size_t size = GAME_TABLE_MIN;
+  while (size < m_gameCommands.size() * 2)
+    size *= 2;
+
+  GameCommand empty;
+  empty.hash = 0;
+  empty.game = 0;
+  m_gameTable.assign(size, empty);
+  for (std::vector<GameCommand>::const_iterator i = m_gameCommands.begin();
+       i != m_gameCommands.end();
+       i++)
+  {
+    InsertGameCommand(*i);
+  }
+}
 
-  std::vector<std::string> params;
-  Split(text.c_str() + 1, params);
+bool CommandHandler::IsGameCommand(const Game* game, const char* name, size_t length) const
+{
+  uint32_t hash = HashName(name, length);
+  size_t mask = m_gameTable.size() - 1;
 
-  if ( params.size() > 0 )
+  for (size_t slot = hash & mask; m_gameTable[slot].game; slot = (slot + 1) & mask)
   {
-    for (std::vector<Command>::iterator i = m_commands.begin();
-         i != m_commands.end();
-         i++)
+    const GameCommand& command = m_gameTable[slot];
+    if (command.hash == hash && command.game == game && command.name.length() == length &&
+        strncasecmp(command.name.data(), name, length) == 0)
     {
-      if (!strcasecmp((*i).name.c_str(), params[0].c_str()))
-      {
-        (*i).callback(GamesBot::Instance(), source, dest, params);
-        break;
-      }
+      return true;
     }
   }
+  return false;
+}
+
+bool CommandHandler::Handle(const char* source, const char* dest, const char* text)
+{
+  if ( text[0] != '!' || text[1] == '\0' )
+    return false;
+
+  const char* name = text + 1;
+  while (*name == ' ')
+    name++;
+  const Command* command = FindCore(name, strcspn(name, " "));
+  if (!command)
+    return false;
+
+  CommandLine params;
+  params.Parse(name);
+  command->callback(GamesBot::Instance(), source, dest, params);
+  return true;
 }
 
 #undef COMMAND
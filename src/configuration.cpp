@@ -22,6 +22,9 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include "configuration.h"
 
@@ -51,35 +54,132 @@ bool Configuration::Create(const char* filename)
     return false;
   }
 
- const char* v;
+  Networks.clear();
+  if (!LoadNetwork("ircserver", "bot"))
+    return false;
+
+  for (int i = 2; ; i++)
+  {
+    char serverSection[64];
+    char botSection[64];
+    snprintf(serverSection, sizeof(serverSection), "ircserver%d", i);
+    snprintf(botSection, sizeof(botSection), "bot%d", i);
+
+    if (m_parser.GetValue(serverSection, "address") == 0)
+      break;
+    if (!LoadNetwork(serverSection, botSection))
+      return false;
+  }
+
+  LoadRateLimit();
+  return true;
+}
+
+/* Costs are a list of command:cost, like "refresh:10,start:3" */
+void Configuration::LoadRateLimit()
+{
+  const char* v;
+
+  v = m_parser.GetValue("ratelimit", "window");
+  RateLimit.window = (v != 0 && *v != '\0' ? atoi(v) : 10000);
+  v = m_parser.GetValue("ratelimit", "userbudget");
+  RateLimit.userBudget = (v != 0 && *v != '\0' ? atoi(v) : 20);
+  v = m_parser.GetValue("ratelimit", "channelbudget");
+  RateLimit.channelBudget = (v != 0 && *v != '\0' ? atoi(v) : 200);
+  v = m_parser.GetValue("ratelimit", "answercost");
+  RateLimit.answerCost = (v != 0 && *v != '\0' ? atoi(v) : 1);
+  v = m_parser.GetValue("ratelimit", "commandcost");
+  RateLimit.commandCost = (v != 0 && *v != '\0' ? atoi(v) : 2);
+
+  v = m_parser.GetValue("ratelimit", "costs");
+  if (v == 0)
+    v = "refresh:10,start:3,stop:3";
+
+  RateLimit.costs.clear();
+  while (*v != '\0')
+  {
+    while (*v == ' ')
+      v++;
+    const char* end = v + strcspn(v, ",");
+    const char* colon = (const char *)memchr(v, ':', end - v);
+    if (colon && colon > v)
+    {
+      CommandCost cost;
+      cost.name.assign(v, colon - v);
+      cost.cost = atoi(colon + 1);
+      RateLimit.costs.push_back(cost);
+    }
+    v = (*end == ',' ? end + 1 : end);
+  }
+}
+
+bool Configuration::LoadNetwork(const std::string& serverSection, const std::string& botSection)
+{
+  NetworkConfig network;
+  const char* v;
 #define SAFE_LOAD(section, entry, dest) do { \
-  v = m_parser.GetValue(#section, #entry); \
+  v = m_parser.GetValue((section).c_str(), #entry); \
   if (v == 0) \
   { \
     m_errno = -1; \
-    m_error = "Unable to load entry '" #entry "' from section '" #section "'"; \
+    m_error = "Unable to load entry '" #entry "' from section '" + (section) + "'"; \
     return false; \
   } \
   (dest) = v; \
 } while ( false )
 
   /* ircserver */
-  SAFE_LOAD(ircserver, address, this->IRCServer.address);
-  SAFE_LOAD(ircserver, service, this->IRCServer.service);
-  SAFE_LOAD(ircserver, password, this->IRCServer.password);
-  SAFE_LOAD(ircserver, ssl, v);
-  this->IRCServer.useSSL = (!strcasecmp(v, "true") ? true : false);
-  SAFE_LOAD(ircserver, sslcert, v);
-  this->IRCServer.sslCert = (*v != '\0' ? v : 0);
+  SAFE_LOAD(serverSection, address, network.IRCServer.address);
+  SAFE_LOAD(serverSection, service, network.IRCServer.service);
+  SAFE_LOAD(serverSection, password, network.IRCServer.password);
+  SAFE_LOAD(serverSection, ssl, v);
+  network.IRCServer.useSSL = (!strcasecmp(v, "true") ? true : false);
+  SAFE_LOAD(serverSection, sslcert, v);
+  network.IRCServer.sslCert = (*v != '\0' ? v : 0);
+
+  /* Flood control is optional, defaults to a burst of 5 lines and then one
+   * line every 2 seconds, as most servers allow.
+   */
+  v = m_parser.GetValue(serverSection.c_str(), "floodburst");
+  network.IRCServer.floodBurst = (v != 0 && *v != '\0' ? atoi(v) : 5);
+  v = m_parser.GetValue(serverSection.c_str(), "floodinterval");
+  network.IRCServer.floodInterval = (v != 0 && *v != '\0' ? atoi(v) : 2000);
+  v = m_parser.GetValue(serverSection.c_str(), "floodpolicy");
+  network.IRCServer.floodStrict = (v != 0 && !strcasecmp(v, "strict"));
+
+  /* Load shedding thresholds are optional too */
+  v = m_parser.GetValue(serverSection.c_str(), "shedqueue");
+  network.IRCServer.shedQueue = (v != 0 && *v != '\0' ? atoi(v) : 20);
+  v = m_parser.GetValue(serverSection.c_str(), "sheddelay");
+  network.IRCServer.shedDelay = (v != 0 && *v != '\0' ? atoi(v) : 10000);
+
+  /* And so is the reconnection policy */
+  v = m_parser.GetValue(serverSection.c_str(), "connecttimeout");
+  network.IRCServer.connectTimeout = (v != 0 && *v != '\0' ? atoi(v) : 60000);
+  if (network.IRCServer.connectTimeout < 10 || network.IRCServer.connectTimeout > 0x7FFFFFFF)
+  {
+    m_errno = -1;
+    m_error = "Entry 'connecttimeout' from section '" + serverSection + "' must be at least 10 ms";
+    return false;
+  }
+  v = m_parser.GetValue(serverSection.c_str(), "reconnectdelay");
+  network.IRCServer.reconnectDelay = (v != 0 && *v != '\0' ? atoi(v) : 5000);
+  v = m_parser.GetValue(serverSection.c_str(), "reconnectmax");
+  network.IRCServer.reconnectMax = (v != 0 && *v != '\0' ? atoi(v) : 300000);
+
+  /* The network name is optional, defaults to the server address */
+  v = m_parser.GetValue(serverSection.c_str(), "name");
+  network.name = (v != 0 && *v != '\0' ? v : network.IRCServer.address);
 
   /* bot */
-  SAFE_LOAD(bot, nickname, this->Bot.nickname);
-  SAFE_LOAD(bot, username, this->Bot.username);
-  SAFE_LOAD(bot, fullname, this->Bot.fullname);
-  SAFE_LOAD(bot, password, this->Bot.password);
-  SAFE_LOAD(bot, channel, this->Bot.channel);
+  SAFE_LOAD(botSection, nickname, network.Bot.nickname);
+  SAFE_LOAD(botSection, username, network.Bot.username);
+  SAFE_LOAD(botSection, fullname, network.Bot.fullname);
+  SAFE_LOAD(botSection, password, network.Bot.password);
+  SAFE_LOAD(botSection, channel, network.Bot.channel);
 
 #undef SAFE_LOAD
+  Networks.push_back(network);
   return true;
 }
 
@@ -27,12 +27,13 @@
 #include <string.h>
 #include "database.h"
 
+static Database* s_instance = 0;
+
 Database* Database::Instance()
 {
-  static Database* instance = 0;
-  if (!instance)
-    instance = new Database();
-  return instance;
+  if (!s_instance)
+    s_instance = new Database();
+  return s_instance;
 }
 
 Database::Database()
@@ -44,6 +45,7 @@ Database::~Database()
 {
   if (m_handle)
     sqlite3_close(m_handle);
+  s_instance = 0;
 }
 
 Database::Database(const char* path)
@@ -102,26 +104,33 @@ int Database::SQLite_cbk(void* _res, int argc, char** argv, char** colNames)
   return 0;
 }
 
+/* A query that fails doesn't stop the next ones */
 DatabaseResult* Database::Query(const char* query, ...)
 {
-  if (!Ok()) return 0;
-
-  DatabaseResult* res = new DatabaseResult();
-  char* errMsg;
+  if (!m_handle) return 0;
 
   va_list vl;
-  char queryStr[4096];
   va_start(vl, query);
-  vsnprintf(queryStr, sizeof(queryStr), query, vl);
+  char* queryStr = sqlite3_vmprintf(query, vl);
   va_end(vl);
+  if (!queryStr)
+  {
+    m_errno = SQLITE_NOMEM;
+    m_error = "Out of memory";
+    return 0;
+  }
 
+  DatabaseResult* res = new DatabaseResult();
+  char* errMsg = 0;
   int rc = sqlite3_exec(m_handle, queryStr, Database::SQLite_cbk, res, &errMsg);
+  sqlite3_free(queryStr);
   if (rc != SQLITE_OK)
   {
     delete res;
-    res = 0;
     m_errno = sqlite3_errcode(m_handle);
-    m_error = errMsg;
+    m_error = (errMsg ? errMsg : sqlite3_errmsg(m_handle));
+    sqlite3_free(errMsg);
+    return 0;
   }
   res->m_curRow = res->m_firstRow;
 
@@ -194,10 +203,16 @@ DatabaseRow::DatabaseRow(unsigned long numCols, char** indices, char** values)
 
   for (unsigned long i = 0; i < numCols; i++)
   {
-    m_indices[i] = new char[strlen(indices[i])];
+    m_indices[i] = new char[strlen(indices[i]) + 1];
     strcpy(m_indices[i], indices[i]);
-    m_values[i] = new char[strlen(values[i])];
-    strcpy(m_values[i], values[i]);
+
+    /* NULL stays 0 */
+    m_values[i] = 0;
+    if (values[i])
+    {
+      m_values[i] = new char[strlen(values[i]) + 1];
+      strcpy(m_values[i], values[i]);
+    }
   }
 }
 
@@ -208,8 +223,8 @@ DatabaseRow::~DatabaseRow()
     delete [] m_values[(m_numCols - i - 1)];
     delete [] m_indices[(m_numCols - i - 1)];
   }
-  delete m_values;
-  delete m_indices;
+  delete [] m_values;
+  delete [] m_indices;
 }
 
 const char* DatabaseRow::operator[](const char* idx) const
@@ -224,7 +239,7 @@ const char* DatabaseRow::operator[](const char* idx) const
 
 const char* DatabaseRow::operator[](unsigned long idx) const
 {
-  if (idx > m_numCols)
+  if (idx >= m_numCols)
     return 0;
 
   return m_values[idx];
@@ -22,16 +22,21 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
 #include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <rsl/net/socket/ipv4.h>
 #include <rsl/net/socket/socketstream.h>
-#include <rsl/net/socket/select.h>
 #include <rsl/net/irc/message.h>
 #include <rsl/net/irc/user.h>
 #include "commands.h"
@@ -39,25 +44,36 @@
 #include "gamesbot.h"
 #include "highscore.h"
 #include "keys.h"
+#include "reactor.h"
 #include "timers.h"
+#include "workers.h"
 
 using namespace Rsl::Net::IRC;
 using namespace Rsl::Net::Socket;
 
+/* User handles: slot bits, miliseconds of silence before a user is
+ * forgotten, and how often they are looked for.
+ */
+#define USER_INDEX_MASK 0xFFFFF
+#define USER_IDLE (30 * 60 * 1000)
+#define USER_EVICT_PERIOD (60 * 1000)
+
 /**
  ** Callbacks
  **/
 static int do_numeric(IRCClient* irc, const IRCUser* source, const IRCMessage* _msg)
 {
   const IRCMessageNumeric* msg = dynamic_cast<const IRCMessageNumeric *>(_msg);
+  Network* network = GamesBot::Instance()->FindNetwork(irc);
 
-  if (msg)
+  if (msg && network)
   {
+    network->OnMessage();
     switch (msg->GetNumeric())
     {
       case 1:
       {
-        GamesBot::Instance()->OnConnect();
+        network->OnConnect();
         break;
       }
     }
@@ -70,9 +86,12 @@ static int do_ping(IRCClient* irc, const IRCUser* source, const IRCMessage* _msg
 {
   const IRCMessagePing* msg = dynamic_cast<const IRCMessagePing *>(_msg);
 
-  if (msg)
+  Network* network = GamesBot::Instance()->FindNetwork(irc);
+
+  if (msg && network)
   {
-    irc->Send(IRCMessagePong(msg->GetText()));
+    network->OnMessage();
+    GamesBot::Instance()->OnPing(network, msg->GetText().c_str());
   }
 
   return 0;
@@ -82,30 +101,172 @@ static int do_privmsg(IRCClient* irc, const IRCUser* source, const IRCMessage* _
 {
   const IRCMessagePrivmsg* msg = dynamic_cast<const IRCMessagePrivmsg *>(_msg);
 
-  if (msg)
-  {
-    GamesBot* bot = GamesBot::Instance();
+  GamesBot* bot = GamesBot::Instance();
+  Network* network = bot->FindNetwork(irc);
 
-    const std::string& text = msg->GetText().GetText();
-    if (text[0] == '!')
-      CommandHandler::Instance()->Handle(source, (const IRCUser *)&msg->GetDest(), text);
-    else if (*(bot->GetGame()) != '\0')
-      bot->SendToGame(source->GetName().c_str(), msg->GetDest().GetName().c_str(), text.c_str());
+  if (msg && network)
+  {
+    network->OnMessage();
+    bot->OnPrivmsg(source->GetName().c_str(), msg->GetDest().GetName().c_str(), msg->GetText().GetText().c_str());
   }
 
   return 0;
 }
 
+/* Every new client of a network, only used on SSL connections */
+static void SetupClient(IRCClient& client)
+{
+  client.RegisterNumericsCallback(                        do_numeric);
+  client.RegisterCallback(        new IRCMessagePrivmsg,  do_privmsg);
+  client.RegisterCallback(        new IRCMessagePing,     do_ping);
+}
+
+/* Keeps only what do_line handles: the welcome, a nickname in use, pings,
+ * commands anywhere, and whatever is said in a channel with a running
+ * session. The views aren't NUL terminated yet.
+ */
+static bool do_filter(Network* network, const IRCScan& scan)
+{
+  switch (scan.type)
+  {
+    case IRC_COMMAND_NUMERIC:
+      return scan.numeric == 1 || scan.numeric == 433;
+    case IRC_COMMAND_PING:
+    case IRC_COMMAND_QUIT:
+    case IRC_COMMAND_NICK:
+      return true;
+    case IRC_COMMAND_PRIVMSG:
+      if (!scan.text.Empty() && scan.text[0] == '!')
+        return true;
+      return GamesBot::Instance()->HasSession(network, scan.target);
+    default:
+      return false;
+  }
+}
+
+/* Lines parsed by the bot itself, every view is NUL terminated */
+static void do_line(Network* network, IRCLine& line)
+{
+  GamesBot* bot = GamesBot::Instance();
+
+  switch (line.type)
+  {
+    case IRC_COMMAND_NUMERIC:
+    {
+      if (line.numeric == 1)
+        network->OnConnect();
+      else if (line.numeric == 433)
+        network->OnNicknameInUse();
+      break;
+    }
+    case IRC_COMMAND_PING:
+    {
+      if (line.numParams > 0)
+        bot->OnPing(network, line.params[line.numParams - 1].GetData());
+      break;
+    }
+    case IRC_COMMAND_PRIVMSG:
+    {
+      if (line.numParams == 2 && !line.nick.Empty())
+        bot->OnPrivmsg(line.nick.GetData(), line.params[0].GetData(), line.params[1].GetData());
+      break;
+    }
+    case IRC_COMMAND_QUIT:
+    case IRC_COMMAND_NICK:
+    {
+      if (!line.nick.Empty())
+        bot->OnUserGone(network, line.nick.GetData());
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+
+/**
+ ** Reactor callbacks
+ **/
+static void do_network(int fd, unsigned int events, void* userData)
+{
+  Network* network = (Network *)userData;
+
+  /* A connect that fails may only report the error */
+  NetworkState state = network->GetState();
+  if (state == NETWORK_CONNECTING)
+  {
+    if (events & (REACTOR_WRITE | REACTOR_ERROR))
+      network->OnWritable();
+    return;
+  }
+
+  if (events & REACTOR_WRITE)
+    network->OnWritable();
+
+  /* Writing may have found the connection lost */
+  state = network->GetState();
+  if ((events & (REACTOR_READ | REACTOR_ERROR)) && (state == NETWORK_REGISTERING || state == NETWORK_CONNECTED))
+    GamesBot::Instance()->OnNetworkReadable(network);
+}
+
+static void do_network_data(int fd, const char* data, ssize_t length, void* userData)
+{
+  GamesBot::Instance()->OnNetworkReceived((Network *)userData, data, length);
+}
+
+static void do_timers(int fd, unsigned int events, void* userData)
+{
+  ((Timers *)userData)->Execute();
+}
+
+static void do_replies(int fd, unsigned int events, void* userData)
+{
+  ((Workers *)userData)->RunReplies();
+}
+
+static void do_signal(int fd, unsigned int events, void* userData)
+{
+  GamesBot* bot = (GamesBot *)userData;
+  signalfd_siginfo info;
+
+  while (read(fd, &info, sizeof(info)) == sizeof(info))
+  {
+    switch (info.ssi_signo)
+    {
+      case SIGINT:
+      {
+        bot->Quit("Got SIGINT! Closing...");
+        bot->Shutdown();
+        break;
+      }
+      case SIGTERM:
+      {
+        bot->Quit("Got SIGTERM! Closing...");
+        bot->Shutdown();
+        break;
+      }
+      case SIGUSR1:
+      {
+        /* The same stats printed on shutdown, while running */
+        bot->DumpNetworks();
+        Timers::Instance()->DumpLatencies();
+        break;
+      }
+    }
+  }
+}
+
 
 /**
  ** Singleton
  **/
+static GamesBot* s_instance = 0;
+
 GamesBot* GamesBot::Instance()
 {
-  static GamesBot* instance = 0;
-  if (instance == 0)
-    instance = new GamesBot();
-  return instance;
+  if (s_instance == 0)
+    s_instance = new GamesBot();
+  return s_instance;
 }
 
 
@@ -113,13 +274,31 @@ GamesBot* GamesBot::Instance()
  ** Bot source code
  **/
 GamesBot::GamesBot()
-  : m_errno(0), m_error(""), m_game(0), m_gamesPath("")
+  : m_errno(0), m_error(""), m_curNetwork(0), m_evictTimer(0), m_userTimer(0), m_gamesPath(""), m_running(false),
+    m_capture(0), m_replay(0), m_replayRecord(0), m_replayPending(false), m_replayFast(false),
+    m_replaySink(0), m_replayStart(0), m_replayEnd(0), m_replayLines(0)
 {
 }
 
 GamesBot::~GamesBot()
 {
+  /* The replies of the stopped sessions may point to the networks */
   UnloadGames();
+  Workers::Instance()->RunReplies();
+
+  for (std::vector<Network *>::iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
+  {
+    delete (*i);
+  }
+
+  delete m_capture;
+  delete m_replay;
+  delete m_replayRecord;
+  if (m_replaySink)
+    fclose(m_replaySink);
+  s_instance = 0;
 }
 
 bool GamesBot::Ok() const
@@ -142,6 +321,10 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
   char* configFile = 0;
   char* dbFile = 0;
   char* gamesPath = 0;
+  char* capturePath = 0;
+  char* replayPath = 0;
+  char* sinkPath = 0;
+  long numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
   bool daemonize = true;
 
   /* Read command-line options */
@@ -151,6 +334,11 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
     { "verbose",    false,  0,  'v' },
     { "dbpath",     true,   0,  'd' },
     { "gamespath" , true,   0,  'g' },
+    { "workers",    true,   0,  'w' },
+    { "capture",    true,   0,  'c' },
+    { "replay",     true,   0,  'r' },
+    { "fast",       false,  0,  'F' },
+    { "sink",       true,   0,  'o' },
     { 0,            0,      0,   0  },
   };
   int option_index = 0;
@@ -158,7 +346,7 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
 
   while (1)
   {
-    getopt_retval = getopt_long(argc, argv, "f:hvd:g:", long_options, &option_index);
+    getopt_retval = getopt_long(argc, argv, "f:hvd:g:w:c:r:Fo:", long_options, &option_index);
     if (getopt_retval == -1)
     {
       break;
@@ -195,6 +383,35 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
         gamesPath = strdup(optarg);
         break;
       }
+      case 'w':
+      {
+        numWorkers = atol(optarg);
+        break;
+      }
+      case 'c':
+      {
+        if (capturePath) free(capturePath);
+        capturePath = strdup(optarg);
+        break;
+      }
+      case 'r':
+      {
+        if (replayPath) free(replayPath);
+        replayPath = strdup(optarg);
+        daemonize = false;
+        break;
+      }
+      case 'F':
+      {
+        m_replayFast = true;
+        break;
+      }
+      case 'o':
+      {
+        if (sinkPath) free(sinkPath);
+        sinkPath = strdup(optarg);
+        break;
+      }
     }
   }
 
@@ -234,6 +451,9 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
   }
   free(configFile);
 
+  m_userLimits.Configure(m_config.RateLimit.window, m_config.RateLimit.userBudget);
+  m_channelLimits.Configure(m_config.RateLimit.window, m_config.RateLimit.channelBudget);
+
 
   /* Load the database */
   if (!dbFile)
@@ -265,6 +485,19 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
   /* Startup timers */
   Timers::Instance();
 
+  /* Start the threads for the game logic, none runs it in the main thread */
+  Workers* workers = Workers::Instance();
+  if (numWorkers < 0)
+    numWorkers = 0;
+  if (!workers->Start(numWorkers))
+  {
+    char errMsg[1024];
+    m_errno = workers->Errno();
+    snprintf(errMsg, sizeof(errMsg), "Cannot start the worker threads: %s", workers->Error());
+    m_error = errMsg;
+    return false;
+  }
+
 
   /* Load games */
   if (!gamesPath)
@@ -279,136 +512,740 @@ bool GamesBot::Initialize(int argc, char* argv[], char* envp[])
     return false;
 
 
-  /* Create the IRC bot */
-  IPV4Addr addr(m_config.IRCServer.address, m_config.IRCServer.service);
-  IPV4Addr bindAddr("0.0.0.0", "0");
-  char password[256];
-  if (strlen(m_config.IRCServer.password) > 0)
-    keysDecode(m_config.IRCServer.password, password);
-  else
-    *password = '\0';
-  m_client.Create(addr, bindAddr,
-                  m_config.Bot.nickname,
-                  m_config.Bot.username,
-                  m_config.Bot.fullname,
-                  password,
-                  m_config.IRCServer.useSSL,
-                  m_config.IRCServer.sslCert);
-  memset(password, 0, sizeof(password));
-
-  if (!m_client.Ok())
-  {
-    m_errno = m_client.Errno();
-    m_error = m_client.Error();
-    return false;
+  /* Create the IRC clients, one per network */
+  for (std::vector<Configuration::NetworkConfig>::const_iterator i = m_config.Networks.begin();
+       i != m_config.Networks.end();
+       i++)
+  {
+    Network* network = new Network(*i);
+    m_networks.push_back(network);
+
+    if (!network->Create(SetupClient))
+    {
+      char errMsg[1024];
+      m_errno = network->Errno();
+      snprintf(errMsg, sizeof(errMsg), "Cannot create the client for network '%s': %s", network->GetName(), network->Error());
+      m_error = errMsg;
+      return false;
+    }
   }
-  
-  m_client.RegisterNumericsCallback(                        do_numeric);
-  m_client.RegisterCallback(        new IRCMessagePrivmsg,  do_privmsg);
-  m_client.RegisterCallback(        new IRCMessagePing,     do_ping);
+
+
+  /* Traffic capture and replay */
+  if (capturePath)
+  {
+    m_capture = new CaptureWriter();
+    if (!m_capture->Create(capturePath))
+    {
+      char errMsg[1024];
+      m_errno = m_capture->Errno();
+      snprintf(errMsg, sizeof(errMsg), "Cannot create the capture file ('%s'): %s", capturePath, m_capture->Error());
+      m_error = errMsg;
+
+      free(capturePath);
+      return false;
+    }
+    free(capturePath);
+
+    for (unsigned int i = 0; i < m_networks.size(); i++)
+    {
+      if (m_config.Networks[i].IRCServer.useSSL)
+        printf("Network '%s' uses SSL, its traffic won't be captured\n", m_networks[i]->GetName());
+      else
+        m_networks[i]->SetCapture(m_capture, i);
+    }
+  }
+
+  if (replayPath)
+  {
+    m_replay = new CaptureReader();
+    if (!m_replay->Create(replayPath))
+    {
+      char errMsg[1024];
+      m_errno = m_replay->Errno();
+      snprintf(errMsg, sizeof(errMsg), "Cannot open the capture file ('%s'): %s", replayPath, m_replay->Error());
+      m_error = errMsg;
+
+      free(replayPath);
+      free(sinkPath);
+      return false;
+    }
+    free(replayPath);
+
+    const char* sinkName = (sinkPath ? sinkPath : "/dev/null");
+    m_replaySink = fopen(sinkName, "w");
+    if (!m_replaySink)
+    {
+      char errMsg[1024];
+      m_errno = errno;
+      snprintf(errMsg, sizeof(errMsg), "Cannot open the replay sink ('%s'): %s", sinkName, strerror(errno));
+      m_error = errMsg;
+
+      free(sinkPath);
+      return false;
+    }
+    m_replayRecord = new CaptureReader::Record;
+  }
+  free(sinkPath);
 
   return true;
 }
 
 bool GamesBot::Run()
 {
-  if (!m_client.Connect())
+  Reactor* reactor = Reactor::Instance();
+  if (!reactor->Ok())
   {
-    m_errno = m_client.Errno();
-    m_error = m_client.Error();
+    m_errno = reactor->Errno();
+    m_error = reactor->Error();
     return false;
   }
 
-  SocketSelect selector(1);
-  selector.Add(&m_client.GetSocket(), RSL_SELECT_EVENT_IN);
-
   Timers* timers = Timers::Instance();
-  selector.SetTimeout(timers->GetNextExecution());
+  int timerFd = timers->GetFd();
+  if (timerFd != -1 && !reactor->Add(timerFd, REACTOR_READ | REACTOR_EDGE, do_timers, timers))
+    timerFd = -1;
+
+  Workers* workers = Workers::Instance();
+  int replyFd = workers->GetFd();
+  reactor->Add(replyFd, REACTOR_READ | REACTOR_EDGE, do_replies, workers);
+
+  /* Already blocked by main(), without the signalfd they just terminate,
+   * except SIGUSR1 which stays blocked.
+   */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &signals, 0);
+  int signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signalFd == -1 || !reactor->Add(signalFd, REACTOR_READ | REACTOR_EDGE, do_signal, this))
+  {
+    sigdelset(&signals, SIGUSR1);
+    sigprocmask(SIG_UNBLOCK, &signals, 0);
+  }
 
-  SocketClient* socks[1];
-  int nsocks;
-  while ((nsocks = selector.Select(socks, 1)) > -1)
+  /* Networks connect and reconnect on their own while the loop runs. The
+   * IRC client doesn't tell if Loop() drained the socket, so it stays level
+   * triggered. The timers and signals fds are drained by their handlers.
+   */
+  for (std::vector<Network *>::iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
   {
-    if (nsocks > 0)
-      m_client.Loop();
+    if (m_replay)
+      (*i)->StartReplay(do_line, do_filter, m_replaySink);
+    else
+      (*i)->Start(do_network, do_network_data, do_line, do_filter);
+  }
 
-    timers->Execute();
-    selector.SetTimeout(timers->GetNextExecution());
+  /* Forget the users and channels that stopped talking, timers can't be shorter than 10 ms */
+  if (m_userLimits.Enabled() || m_channelLimits.Enabled())
+  {
+    unsigned int period = (m_config.RateLimit.window > 10 ? m_config.RateLimit.window : 10);
+    m_evictTimer = timers->Create(DoEvictLimits, -1, period, this, period / 2);
+    if (!m_evictTimer)
+      printf("Cannot create the rate limits timer, idle users and channels won't be forgotten\n");
   }
+  m_userTimer = timers->Create(DoEvictUsers, -1, USER_EVICT_PERIOD, this, USER_EVICT_PERIOD / 2);
+  if (!m_userTimer)
+    printf("Cannot create the users timer, idle users won't be forgotten\n");
+
+  /* Without the timerfd, wake up for the next timer */
+  m_running = true;
+  bool ok = true;
+  while (m_running)
+  {
+    int timeout = (timerFd == -1 ? timers->GetNextExecution() : -1);
+
+    /* A replay also wakes up for its next line, and stops after the last
+     * one once the games have answered it.
+     */
+    if (m_replay)
+    {
+      long wait = Replay();
+      if (wait == -1)
+      {
+        workers->Wait();
+        workers->RunReplies();
+        FlushNetworks();
+        m_replayEnd = Timers::CurrentTime();
+        break;
+      }
+      if (timeout == -1 || wait < timeout)
+        timeout = wait;
+    }
 
-  if (nsocks == -1)
+    if (reactor->Poll(timeout) == -1)
+    {
+      m_errno = reactor->Errno();
+      m_error = reactor->Error();
+      ok = false;
+      break;
+    }
+
+    if (timerFd == -1)
+      timers->Execute();
+
+    /* Everything queued in this iteration leaves in a single write */
+    FlushNetworks();
+  }
+
+  /* The sends of the last iteration, like the QUIT lines, still wait for a poll */
+  reactor->Flush();
+
+  for (std::vector<Network *>::iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
   {
-    m_errno = selector.Errno();
-    m_error = selector.Error();
-    return false;
+    (*i)->Stop();
+  }
+  Network::CloseAttempts();
+  if (m_evictTimer)
+    timers->Destroy(m_evictTimer);
+  if (m_userTimer)
+    timers->Destroy(m_userTimer);
+  if (timerFd != -1)
+    reactor->Remove(timerFd);
+  reactor->Remove(replyFd);
+  if (signalFd != -1)
+  {
+    reactor->Remove(signalFd);
+    close(signalFd);
   }
 
-  return true;
+  if (m_replay)
+  {
+    if (!m_replayEnd)
+      m_replayEnd = Timers::CurrentTime();
+    DumpReplay();
+    if (!m_replay->Ok())
+    {
+      m_errno = m_replay->Errno();
+      m_error = m_replay->Error();
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+/* Dispatches the lines that are due, and returns the miliseconds until the
+ * next one, or -1 after the last. Running as fast as possible, a batch is
+ * dispatched on every pass so that timers and replies keep running.
+ */
+#define REPLAY_BATCH 64
+
+long GamesBot::Replay()
+{
+  uint64_t now = Timers::CurrentTime();
+  if (!m_replayStart)
+    m_replayStart = now;
+
+  for (unsigned int n = 0; ; n++)
+  {
+    if (!m_replayPending)
+    {
+      if (!m_replay->Next(*m_replayRecord))
+        return -1;
+      m_replayPending = true;
+    }
+
+    uint64_t due = m_replayStart + m_replayRecord->time;
+    if (m_replayFast)
+    {
+      if (n == REPLAY_BATCH)
+        return 0;
+    }
+    else if (due > now)
+      return (long)((due - now + 999999) / 1000000);
+    else
+      m_replayLateness.Record(now - due);
+
+    if (m_replayRecord->network < m_networks.size())
+    {
+      uint64_t start = Timers::CurrentTime();
+      m_curNetwork = m_networks[m_replayRecord->network];
+      m_curNetwork->ReplayLine(m_replayRecord->line, m_replayRecord->length);
+      m_curNetwork = 0;
+      now = Timers::CurrentTime();
+      m_replayLatency.Record(now - start);
+    }
+    m_replayLines++;
+    m_replayPending = false;
+  }
+}
+
+void GamesBot::Shutdown()
+{
+  m_running = false;
+}
+
+void GamesBot::OnNetworkReadable(Network* network)
+{
+  m_curNetwork = network;
+  network->OnReadable();
+  m_curNetwork = 0;
+}
+
+void GamesBot::OnNetworkReceived(Network* network, const char* data, ssize_t length)
+{
+  m_curNetwork = network;
+  network->OnReceived(data, length);
+  m_curNetwork = 0;
+}
+
+void GamesBot::OnPing(Network* network, const char* text)
+{
+  network->SendLine(std::string("PONG :") + text, SEND_CRITICAL);
 }
 
-void GamesBot::OnConnect()
+void GamesBot::OnPrivmsg(const char* source, const char* dest, const char* text)
 {
-  char identifyMsg[256];
-  char password[256];
+  if (!AllowLine(source, dest, text))
+    return;
+
+  if (text[0] != '!')
+    SendToGame(source, dest, text);
+  else if (!CommandHandler::Instance()->Handle(source, dest, text))
+    SendCommandToGame(source, dest, text);
+}
 
-  if (strlen(m_config.Bot.password) > 0)
+void GamesBot::FlushNetworks()
+{
+  for (std::vector<Network *>::iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
   {
-    memset(password, 0, sizeof(password));
-    memset(identifyMsg, 0, sizeof(identifyMsg));
-    keysDecode(m_config.Bot.password, password);
-    snprintf(identifyMsg, sizeof(identifyMsg), "IDENTIFY %s", password);
-    m_client.Send(IRCMessagePrivmsg("NickServ", identifyMsg));
-    memset(password, 0, sizeof(password));
-    memset(identifyMsg, 0, sizeof(identifyMsg));
+    (*i)->Flush();
   }
+}
 
-//  m_client.Send(IRCMessageUmode(m_client.GetMe(), "+d"));
-  m_client.Send(IRCMessageJoin(m_config.Bot.channel));
+Network* GamesBot::FindNetwork(const IRCClient* client) const
+{
+  for (std::vector<Network *>::const_iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
+  {
+    if ((*i)->GetClient() == client)
+      return (*i);
+  }
+
+  return 0;
 }
 
-const IRCClient& GamesBot::GetClient() const
+Network* GamesBot::GetCurrentNetwork() const
 {
-  return m_client;
+  return m_curNetwork;
 }
 
-void GamesBot::Send(const IRCText& msg)
+void GamesBot::DumpNetworks() const
 {
-  if (m_client.Ok())
-    m_client.Send(IRCMessagePrivmsg(m_config.Bot.channel, msg));
+  unsigned long totalIn = 0;
+  unsigned long totalOut = 0;
+  long totalMemory = 0;
+  uint64_t now = Timers::CurrentTime();
+
+  for (std::vector<Network *>::const_iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
+  {
+    const Network::Stats& stats = (*i)->GetStats();
+    double uptime = (stats.connectedAt ? (now - stats.connectedAt) / 1e9 : 0);
+
+    printf("Network '%s': %ld KB, %lu messages in, %lu out, %lu connections in %lu attempts",
+           (*i)->GetName(), stats.memory / 1024, stats.messagesIn, stats.messagesOut, stats.connects, stats.attempts);
+    if (uptime > 0)
+      printf(" (%.2f in/s, %.2f out/s)", stats.messagesIn / uptime, stats.messagesOut / uptime);
+    printf("\n");
+    if (stats.filtered > 0)
+      printf("  Filtered: %lu lines skipped before parsing\n", stats.filtered);
+
+    const SendQueue::Stats& queue = (*i)->GetQueueStats();
+    printf("  Send queue: %lu lines waiting (max %lu), %lu sent in %lu writes (%lu partial), %lu throttled drains\n",
+           queue.depth, queue.highWater, queue.sent, queue.writes, queue.partialWrites, queue.throttled);
+    if (stats.shedEvents > 0)
+      printf("  Load shedding: %lu times, %.1f s, %lu lines dropped%s\n",
+             stats.shedEvents, stats.shedTime / 1e9, queue.dropped, (*i)->IsShedding() ? ", active now" : "");
+    for (int level = 0; level < SEND_PRIORITIES; level++)
+    {
+      static const char* names[SEND_PRIORITIES] = { "critical", "result", "interactive", "bulk" };
+      const SendQueue::LevelStats& levelStats = (*i)->GetQueueStats((SendPriority)level);
+      if (levelStats.queued == 0)
+        continue;
+      printf("    %-11s %lu waiting (max %lu), %lu sent, latency p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+             names[level], levelStats.depth, levelStats.highWater, levelStats.sent,
+             levelStats.latency.Percentile(50) / 1e6, levelStats.latency.Percentile(99) / 1e6,
+             levelStats.latency.Max() / 1e6);
+    }
+
+    totalIn += stats.messagesIn;
+    totalOut += stats.messagesOut;
+    totalMemory += stats.memory;
+  }
+
+  printf("Networks: %u, %ld KB, %lu messages in, %lu out\n",
+         (unsigned int)m_networks.size(), totalMemory / 1024, totalIn, totalOut);
+
+  if (m_userLimits.Enabled() || m_channelLimits.Enabled())
+  {
+    const RateLimiter::Stats& users = m_userLimits.GetStats();
+    const RateLimiter::Stats& channels = m_channelLimits.GetStats();
+    printf("Rate limits: %lu lines allowed, %lu limited by user and %lu by channel, "
+           "%u users and %u channels active, %lu forgotten\n",
+           (m_userLimits.Enabled() ? users.allowed : channels.allowed), users.limited, channels.limited,
+           (unsigned int)m_userLimits.GetSize(), (unsigned int)m_channelLimits.GetSize(),
+           users.evicted + channels.evicted);
+  }
+}
+
+/* The latency is what each line takes in the main thread: filtering,
+ * parsing and dispatching it to the command or the game. What games do in
+ * the workers isn't included.
+ */
+void GamesBot::DumpReplay() const
+{
+  double seconds = (m_replayEnd - m_replayStart) / 1e9;
+
+  printf("Replay: %lu lines in %.3f s", m_replayLines, seconds);
+  if (seconds > 0)
+    printf(", %.0f lines/s", m_replayLines / seconds);
+  printf("\n");
+  printf("  Dispatch: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+         m_replayLatency.Percentile(50) / 1e3, m_replayLatency.Percentile(90) / 1e3,
+         m_replayLatency.Percentile(99) / 1e3, m_replayLatency.Percentile(99.9) / 1e3,
+         m_replayLatency.Max() / 1e3);
+  if (!m_replayFast)
+    printf("  Behind the recorded pace: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+           m_replayLateness.Percentile(50) / 1e6, m_replayLateness.Percentile(99) / 1e6,
+           m_replayLateness.Max() / 1e6);
+}
+
+void GamesBot::Send(const char* target, const IRCText& msg, SendPriority priority)
+{
+  if (m_curNetwork)
+    m_curNetwork->Send(target, msg, priority);
+}
+
+void GamesBot::Send(const char* target, const ReplyPacker& reply, SendPriority priority)
+{
+  if (m_curNetwork)
+    m_curNetwork->Send(target, reply, priority);
 }
 
 void GamesBot::Quit(const IRCText& msg)
 {
-  if (m_client.Ok())
-    m_client.Send(IRCMessageQuit(msg));
+  for (std::vector<Network *>::iterator i = m_networks.begin();
+       i != m_networks.end();
+       i++)
+  {
+    (*i)->Quit(msg);
+  }
+}
+
+static inline void ChannelKey(std::string& key, const Network* network, const char* name)
+{
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "%p/", (const void *)network);
+
+  key.assign(prefix);
+  for (const char* p = name; *p != '\0'; p++)
+    key += tolower(*p);
+}
+
+static inline void ChannelKey(std::string& key, const Network* network, const TextView& name)
+{
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "%p/", (const void *)network);
+
+  key.assign(prefix);
+  for (size_t i = 0; i < name.GetLength(); i++)
+    key += tolower(name[i]);
+}
+
+static inline std::string ChannelKey(const Network* network, const char* name)
+{
+  std::string key;
+  ChannelKey(key, network, name);
+  return key;
+}
+
+unsigned int GamesBot::GetCommandCost(const char* text) const
+{
+  const char* name = text + 1;
+  while (*name == ' ')
+    name++;
+  size_t length = strcspn(name, " ");
+
+  const std::vector<Configuration::CommandCost>& costs = m_config.RateLimit.costs;
+  for (std::vector<Configuration::CommandCost>::const_iterator i = costs.begin();
+       i != costs.end();
+       i++)
+  {
+    if ((*i).name.length() == length && strncasecmp((*i).name.c_str(), name, length) == 0)
+      return (*i).cost;
+  }
+  return m_config.RateLimit.commandCost;
+}
+
+/* Commands and lines said where a game is running cost something to the
+ * user and to the channel, and are dropped without an answer when either
+ * is over its budget. Other lines cost nothing, the bot ignores them.
+ */
+bool GamesBot::AllowLine(const char* source, const char* dest, const char* text)
+{
+  if ((!m_userLimits.Enabled() && !m_channelLimits.Enabled()) || !m_curNetwork)
+    return true;
+
+  unsigned int cost;
+  if (text[0] == '!')
+    cost = GetCommandCost(text);
+  else if (FindChannel(m_curNetwork, dest))
+    cost = m_config.RateLimit.answerCost;
+  else
+    return true;
+  if (cost == 0)
+    return true;
+
+  /* Each limit applies on its own */
+  uint64_t now = Timers::CurrentTime();
+  RateLimiter::Entry* user = 0;
+  RateLimiter::Entry* channel = 0;
+  if (m_userLimits.Enabled())
+  {
+    ChannelKey(m_limitKey, m_curNetwork, source);
+    user = m_userLimits.Get(m_limitKey, now);
+  }
+  if (m_channelLimits.Enabled() && (*dest == '#' || *dest == '&'))
+  {
+    ChannelKey(m_limitKey, m_curNetwork, dest);
+    channel = m_channelLimits.Get(m_limitKey, now);
+  }
+
+  if (user && !m_userLimits.Fits(user, cost, now))
+  {
+    m_userLimits.Reject();
+    return false;
+  }
+  if (channel && !m_channelLimits.Fits(channel, cost, now))
+  {
+    m_channelLimits.Reject();
+    return false;
+  }
+
+  if (user)
+    m_userLimits.Charge(user, cost);
+  if (channel)
+    m_channelLimits.Charge(channel, cost);
+  return true;
+}
+
+void GamesBot::DoEvictLimits(void* userData)
+{
+  GamesBot* bot = (GamesBot *)userData;
+  uint64_t now = Timers::CurrentTime();
+  bot->m_userLimits.Evict(now);
+  bot->m_channelLimits.Evict(now);
+}
+
+/* Called for every message said in a channel, the key buffer is reused so
+ * that looking up doesn't allocate.
+ */
+Channel* GamesBot::FindChannel(const Network* network, const char* name) const
+{
+  if (m_channels.empty())
+    return 0;
+
+  ChannelKey(m_channelKey, network, name);
+  ChannelMap::const_iterator i = m_channels.find(m_channelKey);
+  if (i == m_channels.end())
+    return 0;
+  return (*i).second;
+}
+
+bool GamesBot::HasSession(const Network* network, const TextView& name) const
+{
+  if (m_channels.empty() || name.Empty() || (name[0] != '#' && name[0] != '&'))
+    return false;
+
+  ChannelKey(m_channelKey, network, name);
+  return m_channels.find(m_channelKey) != m_channels.end();
 }
 
 void GamesBot::SendToGame(const char* source, const char* dest, const char* text)
 {
-  if (m_game)
-    m_game->ParseText(source, dest, text);
+  if (!m_curNetwork)
+    return;
+
+  Channel* channel = FindChannel(m_curNetwork, dest);
+  if (channel)
+    DeliverToGame(channel, source, dest, TextView(), text);
 }
 
-void GamesBot::UnloadGames()
+/* Only to the session of the channel, and only if its game registered the command */
+void GamesBot::SendCommandToGame(const char* source, const char* dest, const char* text)
+{
+  if (!m_curNetwork || *dest != '#')
+    return;
+
+  Channel* channel = FindChannel(m_curNetwork, dest);
+  if (!channel)
+    return;
+
+  const char* name = text + 1;
+  while (*name == ' ')
+    name++;
+  size_t length = strcspn(name, " ");
+  if (length == 0 || !CommandHandler::Instance()->IsGameCommand(channel->GetGame(), name, length))
+    return;
+
+  const char* args = name + length;
+  while (*args == ' ')
+    args++;
+  DeliverToGame(channel, source, dest, TextView(name, length), args);
+}
+
+/* Everything a game would look up for each line is resolved here, once */
+void GamesBot::DeliverToGame(Channel* channel, const char* source, const char* dest,
+                             const TextView& command, const char* text)
 {
-  if (m_game)
+  GameMessage msg;
+  msg.size = sizeof(GameMessage);
+  msg.channel = channel;
+  msg.kind = (*dest == '#' ? GAME_CHANNEL_NETWORK : *dest == '&' ? GAME_CHANNEL_LOCAL : GAME_CHANNEL_OTHER);
+  msg.user = ResolveUser(source);
+  msg.received = m_curNetwork->GetReceivedAt();
+  msg.source = TextView(source);
+  msg.dest = TextView(dest);
+  msg.command = command;
+  msg.text = TextView(text);
+  channel->Deliver(msg);
+}
+
+/* A nickname keeps its handle while it talks. Quitting, changing the nick
+ * or being silent for a while frees the slot, and the next handle given from
+ * it has a new generation, so the old one never matches anybody again until
+ * the generation wraps. 0 is returned when every slot is in use.
+ */
+GameUser GamesBot::ResolveUser(const char* nickname)
+{
+  uint64_t now = Timers::CurrentTime();
+  ChannelKey(m_limitKey, m_curNetwork, nickname);
+  UserMap::const_iterator i = m_users.find(m_limitKey);
+  if (i != m_users.end())
   {
-    m_game->Stop();
-    m_game = 0;
+    UserSlot& slot = m_userSlots[(*i).second];
+    slot.lastSeen = now;
+    return slot.handle;
   }
+
+  uint32_t index;
+  if (m_freeUsers.size() > 0)
+  {
+    index = m_freeUsers.back();
+    m_freeUsers.pop_back();
+  }
+  else if (m_userSlots.size() < USER_INDEX_MASK)
+  {
+    index = m_userSlots.size();
+    m_userSlots.push_back(UserSlot());
+    m_userSlots[index].handle = index + 1;
+  }
+  else
+    return 0;
+
+  UserSlot& slot = m_userSlots[index];
+  slot.lastSeen = now;
+  slot.key = m_limitKey;
+  m_users[m_limitKey] = index;
+  return slot.handle;
+}
+
+void GamesBot::ReleaseUser(uint32_t index)
+{
+  UserSlot& slot = m_userSlots[index];
+  m_users.erase(slot.key);
+  slot.key.clear();
+  slot.handle += USER_INDEX_MASK + 1;
+  m_freeUsers.push_back(index);
+}
+
+void GamesBot::OnUserGone(Network* network, const char* nickname)
+{
+  ChannelKey(m_limitKey, network, nickname);
+  UserMap::const_iterator i = m_users.find(m_limitKey);
+  if (i != m_users.end())
+    ReleaseUser((*i).second);
+}
+
+void GamesBot::DoEvictUsers(void* userData)
+{
+  GamesBot* bot = (GamesBot *)userData;
+  uint64_t now = Timers::CurrentTime();
+  for (uint32_t i = 0; i < bot->m_userSlots.size(); i++)
+  {
+    const UserSlot& slot = bot->m_userSlots[i];
+    if (!slot.key.empty() && now - slot.lastSeen > USER_IDLE * 1000000ULL)
+      bot->ReleaseUser(i);
+  }
+}
+
+/* Sessions get a timer group inside the group of their module */
+Channel* GamesBot::StartSession(Network* network, const char* name, Game* game)
+{
+  TimerGroup timers;
+  {
+    TimerGroupScope scope(GetGameGroup(game));
+    timers = Timers::Instance()->CreateGroup();
+  }
+
+  Channel* channel = new Channel(network, name, game, GetGameVersion(game), timers);
+  m_channels[ChannelKey(network, name)] = channel;
+  channel->Start();
+  return channel;
+}
+
+void GamesBot::StopSession(Channel* channel)
+{
+  m_channels.erase(ChannelKey(channel->GetNetwork(), channel->GetName()));
+  channel->Close();
+}
+
+void GamesBot::UnloadGames()
+{
+  /* Sessions are stopped in the worker threads, wait for them before unloading their code */
+  while (m_channels.size() > 0)
+    StopSession((*m_channels.begin()).second);
+  Workers::Instance()->Wait();
   m_games.erase(m_games.begin(), m_games.end());
-  for (std::vector<MODULEHANDLE>::iterator i = m_gameModules.begin();
-       i != m_gameModules.end();
-       i++)
+  CommandHandler::Instance()->ClearGameCommands();
+
+  /* Cancel every timer of the module before unloading its code */
+  Timers* timers = Timers::Instance();
+  for (unsigned int i = 0; i < m_gameModules.size(); i++)
   {
-    gameCleanup_t cleanupf = (gameCleanup_t)dlsym((*i), "cleanup");
+    gameCleanup_t cleanupf = (gameCleanup_t)dlsym(m_gameModules[i], "cleanup");
     if (cleanupf)
+    {
+      TimerGroupScope scope(m_gameGroups[i]);
       cleanupf();
-    dlclose((*i));
+    }
+    timers->DestroyGroup(m_gameGroups[i]);
+    dlclose(m_gameModules[i]);
   }
   m_gameModules.erase(m_gameModules.begin(), m_gameModules.end());
+  m_gameGroups.erase(m_gameGroups.begin(), m_gameGroups.end());
+  m_gameVersions.erase(m_gameVersions.begin(), m_gameVersions.end());
 }
 
+struct SavedSession
+{
+  Network* network;
+  std::string channel;
+  std::string game;
+};
+
 bool GamesBot::ReloadGames()
 {
   DIR* gamesDir = opendir(m_gamesPath.c_str());
@@ -423,10 +1260,18 @@ bool GamesBot::ReloadGames()
     return false;
   }
 
-  /* Save the current game name and unload all games */
-  std::string curGameName("");
-  if (m_game)
-    curGameName = m_game->GetName();
+  /* Save the running sessions and unload all games */
+  std::vector<SavedSession> sessions;
+  for (ChannelMap::const_iterator i = m_channels.begin();
+       i != m_channels.end();
+       i++)
+  {
+    SavedSession session;
+    session.network = (*i).second->GetNetwork();
+    session.channel = (*i).second->GetName();
+    session.game = (*i).second->GetGame()->GetName();
+    sessions.push_back(session);
+  }
   UnloadGames();
 
   /* Reload games */
@@ -442,11 +1287,25 @@ bool GamesBot::ReloadGames()
       if (gameModule)
       {
         gameStartup_t startupf = (gameStartup_t)dlsym(gameModule, "startup");
-        if (startupf)
+        gameApiVersion_t versionf = (gameApiVersion_t)dlsym(gameModule, "apiversion");
+        int version = (versionf ? versionf() : 1);
+        if (version > GAME_API_VERSION)
+        {
+          printf("Game '%s' needs version %d of the games interface, this bot has %d\n",
+                 path, version, GAME_API_VERSION);
+          dlclose(gameModule);
+        }
+        else if (startupf)
         {
+          /* Every timer created by the game code belongs to the module group */
+          TimerGroup group = Timers::Instance()->CreateGroup();
+          TimerGroupScope scope(group);
           Game* newGame = startupf();
+          Timers::Instance()->SetGroupLabel(group, newGame->GetName());
           m_games.push_back(newGame);
           m_gameModules.push_back(gameModule);
+          m_gameGroups.push_back(group);
+          m_gameVersions.push_back(version);
         }
         else
         {
@@ -471,25 +1330,40 @@ bool GamesBot::ReloadGames()
     return false;
   }
 
-  /* Restart the current game if it's still available */
-  if (curGameName != "")
+  /* Commands of the games, the core ones can't be taken */
+  CommandHandler* commands = CommandHandler::Instance();
+  for (std::vector<Game *>::const_iterator i = m_games.begin();
+       i != m_games.end();
+       i++)
   {
-    Game* cur = FindGame(curGameName.c_str());
-    if (cur)
+    const char* const* names = (*i)->GetCommands();
+    for (unsigned int n = 0; names && names[n]; n++)
     {
-      m_game = cur;
-      cur->Start();
+      if (!commands->RegisterGameCommand(names[n], *i))
+        printf("Game '%s' can't register the command '%s'\n", (*i)->GetName(), names[n]);
     }
   }
+  commands->RebuildGameCommands();
+
+  /* Restart the sessions whose game is still available */
+  for (std::vector<SavedSession>::const_iterator i = sessions.begin();
+       i != sessions.end();
+       i++)
+  {
+    Game* game = FindGame((*i).game.c_str());
+    if (game)
+      StartSession((*i).network, (*i).channel.c_str(), game);
+  }
 
   closedir(gamesDir);
   return true;
 }
 
-const char* GamesBot::GetGame() const
+const char* GamesBot::GetGame(const char* name) const
 {
-  if (m_game)
-    return m_game->GetName();
+  Channel* channel = (m_curNetwork ? FindChannel(m_curNetwork, name) : 0);
+  if (channel)
+    return channel->GetGame()->GetName();
   else
     return "";
 }
@@ -508,6 +1382,28 @@ Game* GamesBot::FindGame(const char* name) const
   return 0;
 }
 
+TimerGroup GamesBot::GetGameGroup(const Game* game) const
+{
+  for (unsigned int i = 0; i < m_games.size(); i++)
+  {
+    if (m_games[i] == game)
+      return m_gameGroups[i];
+  }
+
+  return 0;
+}
+
+int GamesBot::GetGameVersion(const Game* game) const
+{
+  for (unsigned int i = 0; i < m_games.size(); i++)
+  {
+    if (m_games[i] == game)
+      return m_gameVersions[i];
+  }
+
+  return 1;
+}
+
 const std::vector<std::string> GamesBot::ListGames() const
 {
   std::vector<std::string> gameList;
@@ -522,28 +1418,27 @@ const std::vector<std::string> GamesBot::ListGames() const
   return gameList;
 }
 
-bool GamesBot::StartGame(const char* name)
+bool GamesBot::StartGame(const char* channel, const char* name)
 {
-  if (m_game)
+  if (!m_curNetwork || *channel != '#' || FindChannel(m_curNetwork, channel))
     return false;
 
   Game* game = FindGame(name);
   if (!game)
     return false;
-  m_game = game;
-  m_game->Start();
+  StartSession(m_curNetwork, channel, game);
 
   //m_client.Send(IRCMessageUmode(m_client.GetMe(), "-d"));
 
   return true;
 }
 
-void GamesBot::StopGame()
+void GamesBot::StopGame(const char* name)
 {
-  if (m_game)
+  Channel* channel = (m_curNetwork ? FindChannel(m_curNetwork, name) : 0);
+  if (channel)
   {
-    m_game->Stop();
-    m_game = 0;
+    StopSession(channel);
     //m_client.Send(IRCMessageUmode(m_client.GetMe(), "+d"));
   }
 }
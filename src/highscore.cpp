@@ -25,12 +25,13 @@
 #include <stdlib.h>
 #include "highscore.h"
 
+static HighScore* s_instance = 0;
+
 HighScore* HighScore::Instance()
 {
-  static HighScore* instance = 0;
-  if (!instance)
-    instance = new HighScore();
-  return instance;
+  if (!s_instance)
+    s_instance = new HighScore();
+  return s_instance;
 }
 
 HighScore::HighScore()
@@ -43,13 +44,15 @@ HighScore::HighScore()
 
 HighScore::~HighScore()
 {
+  s_instance = 0;
 }
 
 int HighScore::GetScore(const char* nickname, const char* game)
 {
   int score = 0;
+  MutexLock lock(m_mutex);
   Database* db = Database::Instance();
-  DatabaseResult* res = db->Query("SELECT score FROM highscore WHERE nickname LIKE '%s' AND game LIKE '%s'",
+  DatabaseResult* res = db->Query("SELECT score FROM highscore WHERE nickname = '%q' COLLATE NOCASE AND game = '%q'",
                                   nickname, game);
   if (res)
   {
@@ -64,25 +67,27 @@ int HighScore::GetScore(const char* nickname, const char* game)
 
 void HighScore::SetScore(const char* nickname, const char* game, int score)
 {
+  MutexLock lock(m_mutex);
   Database* db = Database::Instance();
-  delete db->Query("UPDATE highscore SET score='%d' WHERE nickname LIKE '%s' AND game LIKE '%s'",
+  delete db->Query("UPDATE highscore SET score='%d' WHERE nickname = '%q' COLLATE NOCASE AND game = '%q'",
                    score, nickname, game);
   if (db->ChangedRows() == 0)
   {
-    delete db->Query("INSERT INTO highscore(nickname, game, score) VALUES ('%s', '%s', '%d')",
+    delete db->Query("INSERT INTO highscore(nickname, game, score) VALUES ('%q', '%q', '%d')",
                      nickname, game, score);
   }
 }
 
 void HighScore::GetGameTop(const char* game, std::vector<std::string>& nicknames, std::vector<int>& scores, int limit)
 {
+  MutexLock lock(m_mutex);
   Database* db = Database::Instance();
   DatabaseResult* res;
  
   if (limit == -1)
-    res = db->Query("SELECT nickname,score FROM highscore WHERE game LIKE '%s' ORDER BY score DESC", game);
+    res = db->Query("SELECT nickname,score FROM highscore WHERE game = '%q' ORDER BY score DESC", game);
   else
-    res = db->Query("SELECT nickname,score FROM highscore WHERE game LIKE '%s' ORDER BY score DESC LIMIT %d", game, limit);
+    res = db->Query("SELECT nickname,score FROM highscore WHERE game = '%q' ORDER BY score DESC LIMIT %d", game, limit);
 
   if (res)
   {
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+Histogram::Histogram()
+{
+  Reset();
+}
+
+void Histogram::Reset()
+{
+  memset(m_buckets, 0, sizeof(m_buckets));
+  m_count = 0;
+  m_sum = 0;
+  m_max = 0;
+}
+
+void Histogram::Merge(const Histogram& other)
+{
+  for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    m_buckets[i] += other.m_buckets[i];
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+  if (other.m_max > m_max)
+    m_max = other.m_max;
+}
+
+uint64_t Histogram::Count() const
+{
+  return m_count;
+}
+
+uint64_t Histogram::Max() const
+{
+  return m_max;
+}
+
+uint64_t Histogram::Mean() const
+{
+  if (m_count == 0)
+    return 0;
+  return m_sum / m_count;
+}
+
+uint64_t Histogram::BucketUpperBound(unsigned int bucket)
+{
+  if (bucket < 2 * HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+
+  unsigned int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t top = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+  return ((top + 1) << shift) - 1;
+}
+
+uint64_t Histogram::Percentile(double percentile) const
+{
+  if (m_count == 0)
+    return 0;
+
+  uint64_t wanted = (uint64_t)(m_count * percentile / 100.0);
+  if (wanted == 0)
+    wanted = 1;
+
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    seen += m_buckets[i];
+    if (seen >= wanted)
+    {
+      uint64_t bound = BucketUpperBound(i);
+      return (bound < m_max ? bound : m_max);
+    }
+  }
+
+  return m_max;
+}
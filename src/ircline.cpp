@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ircline.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define COMMAND_IS(str) (memcmp(command, str, sizeof(str) - 1) == 0)
+
+IRCCommand ircClassify(const char* command, size_t length, int& numeric)
+{
+  switch (length)
+  {
+    case 3:
+      if (IS_DIGIT(command[0]) && IS_DIGIT(command[1]) && IS_DIGIT(command[2]))
+      {
+        numeric = (command[0] - '0') * 100 + (command[1] - '0') * 10 + (command[2] - '0');
+        return IRC_COMMAND_NUMERIC;
+      }
+      break;
+    case 4:
+      if (COMMAND_IS("PING")) return IRC_COMMAND_PING;
+      if (COMMAND_IS("PONG")) return IRC_COMMAND_PONG;
+      if (COMMAND_IS("JOIN")) return IRC_COMMAND_JOIN;
+      if (COMMAND_IS("PART")) return IRC_COMMAND_PART;
+      if (COMMAND_IS("QUIT")) return IRC_COMMAND_QUIT;
+      if (COMMAND_IS("KICK")) return IRC_COMMAND_KICK;
+      if (COMMAND_IS("MODE")) return IRC_COMMAND_MODE;
+      if (COMMAND_IS("NICK")) return IRC_COMMAND_NICK;
+      break;
+    case 5:
+      if (COMMAND_IS("TOPIC")) return IRC_COMMAND_TOPIC;
+      if (COMMAND_IS("ERROR")) return IRC_COMMAND_ERROR;
+      break;
+    case 6:
+      if (COMMAND_IS("NOTICE")) return IRC_COMMAND_NOTICE;
+      if (COMMAND_IS("INVITE")) return IRC_COMMAND_INVITE;
+      break;
+    case 7:
+      if (COMMAND_IS("PRIVMSG")) return IRC_COMMAND_PRIVMSG;
+      break;
+  }
+
+  return IRC_COMMAND_UNKNOWN;
+}
+
+bool ircParseLine(char* line, size_t length, IRCLine& out)
+{
+  char* p = line;
+  char* end = line + length;
+  *end = '\0';
+
+  out.prefix = TextView();
+  out.nick = TextView();
+  out.numeric = 0;
+  out.numParams = 0;
+  out.trailing = false;
+
+  /* :nick!user@host */
+  if (*p == ':')
+  {
+    char* start = ++p;
+    char* nickEnd = 0;
+    while (p < end && *p != ' ')
+    {
+      if (!nickEnd && (*p == '!' || *p == '@'))
+        nickEnd = p;
+      p++;
+    }
+    out.prefix = TextView(start, p - start);
+    if (!nickEnd)
+      nickEnd = p;
+    out.nick = TextView(start, nickEnd - start);
+
+    *p = '\0';
+    *nickEnd = '\0';
+    while (p < end && (*p == ' ' || *p == '\0'))
+      p++;
+  }
+
+  char* command = p;
+  while (p < end && *p != ' ')
+    p++;
+  if (p == command)
+    return false;
+  out.command = TextView(command, p - command);
+  out.type = ircClassify(command, p - command, out.numeric);
+  *p = '\0';
+
+  while (out.numParams < IRC_MAX_PARAMS)
+  {
+    while (p < end && (*p == ' ' || *p == '\0'))
+      p++;
+    if (p == end)
+      break;
+
+    /* The trailing param, and the last one that fits, take the rest of the line */
+    if (*p == ':' || out.numParams == IRC_MAX_PARAMS - 1)
+    {
+      if (*p == ':')
+      {
+        out.trailing = true;
+        p++;
+      }
+      out.params[out.numParams++] = TextView(p, end - p);
+      break;
+    }
+
+    char* param = p;
+    while (p < end && *p != ' ')
+      p++;
+    out.params[out.numParams++] = TextView(param, p - param);
+    *p = '\0';
+  }
+
+  return true;
+}
+
+/* The prefix, the command and the target are separated by the first three
+ * spaces of a line, or the first two if it has no prefix.
+ */
+#define SCAN_SPACES 3
+
+static bool BuildScan(const char* line, const char* lineEnd, const char** spaces,
+                      unsigned int numSpaces, IRCScan& out)
+{
+  unsigned int next = 0;
+  const char* p = line;
+
+  if (*p == ':')
+  {
+    if (numSpaces == 0)
+      return false;
+    p = spaces[next++] + 1;
+  }
+
+  const char* command = p;
+  const char* commandEnd = (next < numSpaces ? spaces[next++] : lineEnd);
+  if (commandEnd == command)
+    return false;
+  out.type = ircClassify(command, commandEnd - command, out.numeric);
+  out.target = TextView();
+  out.text = TextView();
+  if (commandEnd == lineEnd)
+    return true;
+
+  p = commandEnd + 1;
+  if (p < lineEnd && *p == ':')
+  {
+    out.target = TextView(p + 1, lineEnd - p - 1);
+    return true;
+  }
+
+  const char* targetEnd = (next < numSpaces ? spaces[next] : lineEnd);
+  if (targetEnd == p)
+    return false;
+  out.target = TextView(p, targetEnd - p);
+  if (targetEnd + 1 < lineEnd && targetEnd[1] == ':')
+    out.text = TextView(targetEnd + 2, lineEnd - targetEnd - 2);
+
+  return true;
+}
+
+bool ircScanLineScalar(const char* line, const char* lineEnd, IRCScan& out)
+{
+  const char* spaces[SCAN_SPACES];
+  unsigned int numSpaces = 0;
+
+  for (const char* p = line; p < lineEnd && numSpaces < SCAN_SPACES; p++)
+  {
+    if (*p == ' ')
+      spaces[numSpaces++] = p;
+  }
+
+  return BuildScan(line, lineEnd, spaces, numSpaces, out);
+}
+
+#ifdef __SSE2__
+bool ircScanLine(const char* line, const char* lineEnd, const char* limit, IRCScan& out)
+{
+  const char* spaces[SCAN_SPACES];
+  unsigned int numSpaces = 0;
+  const __m128i blank = _mm_set1_epi8(' ');
+  const char* p = line;
+
+  /* Sixteen bytes at a time, reading past the end of the line is fine as
+   * long as it stays inside the buffer. The tail goes byte by byte.
+   */
+  while (p + 16 <= limit && p < lineEnd)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, blank));
+
+    while (mask)
+    {
+      const char* space = p + __builtin_ctz(mask);
+      if (space >= lineEnd)
+        return BuildScan(line, lineEnd, spaces, numSpaces, out);
+      spaces[numSpaces++] = space;
+      if (numSpaces == SCAN_SPACES)
+        return BuildScan(line, lineEnd, spaces, numSpaces, out);
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+
+  for (; p < lineEnd && numSpaces < SCAN_SPACES; p++)
+  {
+    if (*p == ' ')
+      spaces[numSpaces++] = p;
+  }
+
+  return BuildScan(line, lineEnd, spaces, numSpaces, out);
+}
+#else
+bool ircScanLine(const char* line, const char* lineEnd, const char* limit, IRCScan& out)
+{
+  return ircScanLineScalar(line, lineEnd, out);
+}
+#endif
+
+size_t ircParseLines(char* buffer, size_t length, IRCLineCbk_t cbk, void* userData, IRCFilterCbk_t filter)
+{
+  IRCLine line;
+  IRCScan scan;
+  char* start = buffer;
+  char* end = buffer + length;
+
+  while (start < end)
+  {
+    char* newline = (char *)memchr(start, '\n', end - start);
+    if (!newline)
+      break;
+
+    char* lineEnd = newline;
+    if (lineEnd > start && lineEnd[-1] == '\r')
+      lineEnd--;
+
+    if (lineEnd > start &&
+        (!filter || !ircScanLine(start, lineEnd, end, scan) || filter(scan, userData)) &&
+        ircParseLine(start, lineEnd - start, line))
+    {
+      cbk(line, userData);
+    }
+    start = newline + 1;
+  }
+
+  return start - buffer;
+}
@@ -0,0 +1,720 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Load test of the whole bot over the loopback. A minimal IRC server
+ * registers the bot, starts the numbers game in every channel it joins, and
+ * has thousands of simulated players answering the rounds, some of them
+ * with invalid expressions. It reports the time from each answer to the
+ * reply of the bot, and the CPU and memory the bot uses.
+ *
+ * The bot must be configured to connect to the loopback, with flood and rate limits
+ * that don't throttle it, for example:
+ *
+ *   [ircserver]
+ *   address=127.0.0.1
+ *   service=6667
+ *   floodburst=100000
+ *   floodinterval=1
+ *
+ *   [ratelimit]
+ *   window=0
+ *
+ * Either give the pid of a running bot with -b, or the command line to run
+ * it after --, in which case it is started and stopped with the test:
+ *
+ *   gamesbot_loadtest -p 5000 -r 2000 -- ./gamesbot -v -f loadtest.conf
+ *
+ * Answers are matched with the replies of the same player in order. The
+ * bot doesn't echo every answer while it sheds load, nor answers that
+ * arrive between rounds, and those are counted as unanswered at the end.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "histogram.h"
+#include "ircline.h"
+#include "reactor.h"
+
+#define SERVER_NAME "loopback"
+#define PLAYER_PREFIX "player"
+#define TICK_MS 10
+#define REPORT_INTERVAL 1000000000ULL
+#define MAX_OUTPUT (4 * 1024 * 1024) /* Stop answering while the bot doesn't read */
+
+struct Player
+{
+  std::deque<uint64_t> pending; /* When each answer still waiting for a reply was sent */
+};
+
+struct Channel
+{
+  std::string name;
+  bool playing;               /* A round is running */
+  std::vector<int> numbers;
+  int target;
+};
+
+struct Totals
+{
+  unsigned long answers;      /* Expected to get a reply */
+  unsigned long garbage;      /* Not even an expression, the bot ignores them */
+  unsigned long replies;      /* Matched with an answer */
+  unsigned long linesIn;      /* Lines received from the bot */
+  unsigned long rounds;
+  Histogram latency;          /* Nanoseconds from answer to reply */
+};
+
+struct Server
+{
+  Reactor* reactor;
+  int listenFd;
+  int fd;                     /* The bot */
+  char input[16384];
+  size_t inputLength;
+  std::string output;
+  bool wantWrite;
+
+  std::string nick;
+  bool gotUser;
+  bool registered;
+  uint64_t registeredAt;
+
+  std::vector<Player> players;
+  std::vector<Channel> channels;
+  unsigned int invalidPercent;
+  unsigned int seed;
+
+  Totals totals;
+  Totals interval;
+};
+
+static inline uint64_t Now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ ** Talking to the bot
+ **/
+static void do_bot(int fd, unsigned int events, void* userData);
+
+static void Flush(Server* server)
+{
+  while (!server->output.empty())
+  {
+    ssize_t written = send(server->fd, server->output.data(), server->output.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    server->output.erase(0, written);
+  }
+
+  bool want = !server->output.empty();
+  if (want != server->wantWrite)
+  {
+    server->reactor->Modify(server->fd, REACTOR_READ | (want ? REACTOR_WRITE : 0));
+    server->wantWrite = want;
+  }
+}
+
+static void SendLine(Server* server, const std::string& line)
+{
+  server->output.append(line).append("\r\n");
+}
+
+static void CloseBot(Server* server)
+{
+  if (server->fd == -1)
+    return;
+  printf("The bot disconnected\n");
+  server->reactor->Remove(server->fd);
+  close(server->fd);
+  server->fd = -1;
+}
+
+/* Colours, bold and the rest of formatting codes are removed in place */
+static void StripCodes(std::string& text)
+{
+  std::string::size_type out = 0;
+  for (std::string::size_type i = 0; i < text.length(); i++)
+  {
+    char c = text[i];
+    if (c == '\003')
+    {
+      for (int digits = 0; digits < 2 && i + 1 < text.length() && isdigit(text[i + 1]); digits++)
+        i++;
+      if (i + 2 < text.length() && text[i + 1] == ',' && isdigit(text[i + 2]))
+      {
+        i += 2;
+        if (i + 1 < text.length() && isdigit(text[i + 1]))
+          i++;
+      }
+    }
+    else if (c != '\002' && c != '\017' && c != '\026' && c != '\037')
+      text[out++] = c;
+  }
+  text.resize(out);
+}
+
+static Channel* FindChannel(Server* server, const TextView& name)
+{
+  for (std::vector<Channel>::iterator i = server->channels.begin(); i != server->channels.end(); i++)
+  {
+    if (name.EqualsNoCase(TextView((*i).name.data(), (*i).name.length())))
+      return &(*i);
+  }
+  return 0;
+}
+
+/* "Use the numbers 1, 2, 25, 75, 3, 9 to get the target 345", the reminders
+ * give them too.
+ */
+static bool ParseRound(const std::string& text, Channel* channel)
+{
+  std::string::size_type numbers = text.find("numbers ");
+  std::string::size_type target = text.find("target ");
+  if (numbers == std::string::npos || target == std::string::npos || target < numbers)
+    return false;
+
+  channel->numbers.clear();
+  const char* p = text.c_str() + numbers + 8;
+  const char* end = text.c_str() + target;
+  while (p < end)
+  {
+    char* next;
+    long value = strtol(p, &next, 10);
+    if (next == p)
+      break;
+    channel->numbers.push_back((int)value);
+    p = next;
+    while (p < end && (*p == ',' || *p == ' '))
+      p++;
+  }
+  channel->target = atoi(text.c_str() + target + 7);
+  return !channel->numbers.empty();
+}
+
+static void OnBotMessage(Server* server, const TextView& target, std::string text)
+{
+  uint64_t now = Now();
+  StripCodes(text);
+
+  Channel* channel = FindChannel(server, target);
+  if (channel)
+  {
+    if (text.find("Time is over") != std::string::npos || text.find("calculated the exact value") != std::string::npos)
+    {
+      channel->playing = false;
+      return;
+    }
+    if (ParseRound(text, channel))
+    {
+      if (!channel->playing)
+      {
+        server->totals.rounds++;
+        server->interval.rounds++;
+      }
+      channel->playing = true;
+      return;
+    }
+  }
+
+  /* "player123: 345" or "player123: Invalid number '999'" */
+  if (text.compare(0, sizeof(PLAYER_PREFIX) - 1, PLAYER_PREFIX) != 0)
+    return;
+  char* end;
+  unsigned long index = strtoul(text.c_str() + sizeof(PLAYER_PREFIX) - 1, &end, 10);
+  if (*end != ':' || index >= server->players.size())
+    return;
+
+  Player& player = server->players[index];
+  if (player.pending.empty())
+    return;
+  uint64_t latency = now - player.pending.front();
+  player.pending.pop_front();
+  server->totals.replies++;
+  server->totals.latency.Record(latency);
+  server->interval.replies++;
+  server->interval.latency.Record(latency);
+}
+
+static void OnBotLine(IRCLine& line, void* userData)
+{
+  Server* server = (Server *)userData;
+  server->totals.linesIn++;
+  server->interval.linesIn++;
+
+  switch (line.type)
+  {
+    case IRC_COMMAND_NICK:
+    case IRC_COMMAND_UNKNOWN:
+    {
+      if (line.type == IRC_COMMAND_NICK && line.numParams > 0)
+        server->nick = line.params[0].ToString();
+      else if (line.command.EqualsNoCase("USER"))
+        server->gotUser = true;
+      else
+        break;
+
+      if (!server->registered && server->gotUser && !server->nick.empty())
+      {
+        SendLine(server, ":" SERVER_NAME " 001 " + server->nick + " :Welcome to the load test " + server->nick);
+        SendLine(server, ":" SERVER_NAME " 376 " + server->nick + " :End of /MOTD command.");
+        server->registered = true;
+        server->registeredAt = Now();
+        printf("The bot registered as %s\n", server->nick.c_str());
+      }
+      break;
+    }
+    case IRC_COMMAND_PING:
+    {
+      std::string token = (line.numParams > 0 ? line.params[line.numParams - 1].ToString() : SERVER_NAME);
+      SendLine(server, ":" SERVER_NAME " PONG " SERVER_NAME " :" + token);
+      break;
+    }
+    case IRC_COMMAND_JOIN:
+    {
+      if (line.numParams == 0)
+        break;
+
+      /* Every channel gets a game, started by somebody else */
+      std::string list = line.params[0].ToString();
+      std::string::size_type start = 0;
+      while (start < list.length())
+      {
+        std::string::size_type comma = list.find(',', start);
+        if (comma == std::string::npos)
+          comma = list.length();
+        std::string name = list.substr(start, comma - start);
+        start = comma + 1;
+        if (name.empty() || FindChannel(server, TextView(name.data(), name.length())))
+          continue;
+
+        Channel channel;
+        channel.name = name;
+        channel.playing = false;
+        channel.target = 0;
+        server->channels.push_back(channel);
+        SendLine(server, ":" + server->nick + "!bot@" SERVER_NAME " JOIN " + name);
+        SendLine(server, ":admin!admin@" SERVER_NAME " PRIVMSG " + name + " :!start numbers");
+      }
+      break;
+    }
+    case IRC_COMMAND_PRIVMSG:
+    {
+      if (line.numParams == 2)
+        OnBotMessage(server, line.params[0], line.params[1].ToString());
+      break;
+    }
+    case IRC_COMMAND_QUIT:
+    {
+      CloseBot(server);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static void do_bot(int fd, unsigned int events, void* userData)
+{
+  Server* server = (Server *)userData;
+
+  if (events & REACTOR_WRITE)
+    Flush(server);
+  if (!(events & (REACTOR_READ | REACTOR_ERROR)) || server->fd == -1)
+    return;
+
+  ssize_t bytes = recv(fd, server->input + server->inputLength, sizeof(server->input) - 1 - server->inputLength, MSG_DONTWAIT);
+  if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (bytes <= 0)
+  {
+    CloseBot(server);
+    return;
+  }
+
+  server->inputLength += bytes;
+  size_t consumed = ircParseLines(server->input, server->inputLength, OnBotLine, server);
+  if (server->fd == -1)
+    return;
+  memmove(server->input, server->input + consumed, server->inputLength - consumed);
+  server->inputLength -= consumed;
+  if (server->inputLength == sizeof(server->input) - 1)
+    server->inputLength = 0;
+  Flush(server);
+}
+
+static void do_accept(int fd, unsigned int events, void* userData)
+{
+  Server* server = (Server *)userData;
+
+  int botFd = accept(fd, 0, 0);
+  if (botFd == -1)
+    return;
+  if (server->fd != -1)
+  {
+    close(botFd);
+    return;
+  }
+
+  fcntl(botFd, F_SETFL, fcntl(botFd, F_GETFL) | O_NONBLOCK);
+  server->fd = botFd;
+  server->inputLength = 0;
+  server->output.clear();
+  server->wantWrite = false;
+  server->nick.clear();
+  server->gotUser = false;
+  server->registered = false;
+  server->channels.clear();
+  server->reactor->Add(botFd, REACTOR_READ, do_bot, server);
+  printf("The bot connected\n");
+}
+
+
+/**
+ ** Players
+ **/
+static std::string MakeAnswer(Server* server, const Channel& channel, bool& expectReply)
+{
+  unsigned int kind = rand_r(&server->seed) % 100;
+  std::vector<int> numbers = channel.numbers;
+  std::string answer;
+  char tmp[32];
+
+  /* Half of the invalid ones use a number that isn't in the round, the
+   * other half aren't expressions at all.
+   */
+  expectReply = true;
+  if (kind < server->invalidPercent / 2)
+  {
+    expectReply = false;
+    return "is it 42?";
+  }
+
+  unsigned int count = 2 + rand_r(&server->seed) % (numbers.size() > 3 ? 3 : numbers.size() - 1);
+  for (unsigned int i = 0; i < count && !numbers.empty(); i++)
+  {
+    unsigned int pick = rand_r(&server->seed) % numbers.size();
+    if (i > 0)
+      answer += "+-*"[rand_r(&server->seed) % 3];
+    snprintf(tmp, sizeof(tmp), "%d", numbers[pick]);
+    answer += tmp;
+    numbers.erase(numbers.begin() + pick);
+  }
+
+  if (kind < server->invalidPercent)
+    answer += "+999";
+  return answer;
+}
+
+static void Answer(Server* server, unsigned int count)
+{
+  std::vector<Channel*> playing;
+  for (std::vector<Channel>::iterator i = server->channels.begin(); i != server->channels.end(); i++)
+  {
+    if ((*i).playing && (*i).numbers.size() >= 2)
+      playing.push_back(&(*i));
+  }
+  if (playing.empty())
+    return;
+
+  uint64_t now = Now();
+  char prefix[64];
+  for (unsigned int i = 0; i < count; i++)
+  {
+    unsigned int index = rand_r(&server->seed) % server->players.size();
+    Channel* channel = playing[rand_r(&server->seed) % playing.size()];
+    bool expectReply;
+    std::string answer = MakeAnswer(server, *channel, expectReply);
+
+    snprintf(prefix, sizeof(prefix), ":" PLAYER_PREFIX "%u!p@" SERVER_NAME " PRIVMSG ", index);
+    SendLine(server, prefix + channel->name + " :" + answer);
+    if (expectReply)
+    {
+      server->players[index].pending.push_back(now);
+      server->totals.answers++;
+      server->interval.answers++;
+    }
+    else
+    {
+      server->totals.garbage++;
+      server->interval.garbage++;
+    }
+  }
+}
+
+
+/**
+ ** Measuring the bot
+ **/
+struct Usage
+{
+  uint64_t cpuTicks;
+  long rssKB;
+};
+
+static bool GetUsage(pid_t pid, Usage& usage)
+{
+  char path[64];
+  char buffer[1024];
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE* fp = fopen(path, "r");
+  if (!fp)
+    return false;
+  size_t length = fread(buffer, 1, sizeof(buffer) - 1, fp);
+  fclose(fp);
+  buffer[length] = '\0';
+
+  /* The name may have spaces, the fields start after its parenthesis:
+   * state is the third field, utime the 14th and stime the 15th.
+   */
+  const char* p = strrchr(buffer, ')');
+  if (!p)
+    return false;
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return false;
+  usage.cpuTicks = utime + stime;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  fp = fopen(path, "r");
+  if (!fp)
+    return false;
+  usage.rssKB = 0;
+  while (fgets(buffer, sizeof(buffer), fp))
+  {
+    if (strncmp(buffer, "VmRSS:", 6) == 0)
+      usage.rssKB = atol(buffer + 6);
+  }
+  fclose(fp);
+  return true;
+}
+
+static void Report(const char* name, const Totals& totals, double seconds, double cpu, long rssKB)
+{
+  printf("%s %.1f s: %.0f answers/s, %.0f replies/s, %lu rounds, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+         name, seconds, totals.answers / seconds, totals.replies / seconds, totals.rounds,
+         totals.latency.Percentile(50) / 1e6, totals.latency.Percentile(99) / 1e6, totals.latency.Max() / 1e6);
+  if (cpu >= 0)
+    printf(", bot CPU %.1f%%, RSS %ld KB", cpu, rssKB);
+  printf("\n");
+}
+
+
+static bool interrupted = false;
+
+static void sighandler(int signum)
+{
+  interrupted = true;
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned int port = 6667;
+  unsigned int numPlayers = 1000;
+  unsigned int rate = 500;
+  unsigned int duration = 60;
+  pid_t botPid = 0;
+  bool child = false;
+  Server server;
+  int opt;
+
+  server.invalidPercent = 20;
+  while ((opt = getopt(argc, argv, "P:p:r:i:d:b:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'P': port = atoi(optarg); break;
+      case 'p': numPlayers = atoi(optarg); break;
+      case 'r': rate = atoi(optarg); break;
+      case 'i': server.invalidPercent = atoi(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'b': botPid = atoi(optarg); break;
+      default:
+        printf("Usage: %s [-P port] [-p players] [-r answers per second] [-i percent invalid] "
+               "[-d seconds] [-b bot pid | -- bot command line]\n", argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (numPlayers == 0)
+    numPlayers = 1;
+
+  server.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  setsockopt(server.listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(server.listenFd, (sockaddr *)&addr, sizeof(addr)) == -1 || listen(server.listenFd, 4) == -1)
+  {
+    printf("Cannot listen on port %u: %s\n", port, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  server.reactor = new Reactor(REACTOR_EPOLL);
+  if (!server.reactor->Ok())
+  {
+    printf("Cannot create the reactor: %s\n", server.reactor->Error());
+    return EXIT_FAILURE;
+  }
+  server.fd = -1;
+  server.inputLength = 0;
+  server.wantWrite = false;
+  server.gotUser = false;
+  server.registered = false;
+  server.registeredAt = 0;
+  server.players.resize(numPlayers);
+  server.seed = 1;
+  server.totals = Totals();
+  server.interval = Totals();
+  server.reactor->Add(server.listenFd, REACTOR_READ, do_accept, &server);
+
+  if (optind < argc)
+  {
+    botPid = fork();
+    if (botPid == 0)
+    {
+      execvp(argv[optind], argv + optind);
+      perror(argv[optind]);
+      _exit(EXIT_FAILURE);
+    }
+    child = true;
+  }
+
+  signal(SIGINT, sighandler);
+  signal(SIGTERM, sighandler);
+  printf("Listening on 127.0.0.1:%u, %u players, %u answers/s, %u%% invalid, %u s\n",
+         port, numPlayers, rate, server.invalidPercent, duration);
+
+  Usage startUsage;
+  Usage lastUsage;
+  bool haveUsage = (botPid > 0 && GetUsage(botPid, startUsage));
+  lastUsage = startUsage;
+  long clockTicks = sysconf(_SC_CLK_TCK);
+
+  uint64_t lastTick = Now();
+  uint64_t lastReport = lastTick;
+  double owed = 0;
+  while (!interrupted)
+  {
+    if (server.reactor->Poll(TICK_MS) == -1 && errno != EINTR)
+      break;
+
+    uint64_t now = Now();
+    if (child && waitpid(botPid, 0, WNOHANG) == botPid)
+    {
+      printf("The bot exited\n");
+      child = false;
+      botPid = 0;
+      haveUsage = false;
+      break;
+    }
+    if (server.registered && now - server.registeredAt >= duration * 1000000000ULL)
+      break;
+
+    /* Answers at the requested rate, unless the bot stopped reading */
+    if (server.fd != -1 && server.registered && server.output.length() < MAX_OUTPUT)
+    {
+      owed += rate * (now - lastTick) / 1e9;
+      Answer(&server, (unsigned int)owed);
+      owed -= (unsigned int)owed;
+      Flush(&server);
+    }
+    lastTick = now;
+
+    if (!server.registered)
+      lastReport = now;
+    else if (now - lastReport >= REPORT_INTERVAL)
+    {
+      double seconds = (now - lastReport) / 1e9;
+      double cpu = -1;
+      Usage usage;
+      usage.rssKB = 0;
+      if (haveUsage && GetUsage(botPid, usage))
+      {
+        cpu = 100.0 * (usage.cpuTicks - lastUsage.cpuTicks) / clockTicks / seconds;
+        lastUsage = usage;
+      }
+      Report("  ", server.interval, seconds, cpu, usage.rssKB);
+      server.interval = Totals();
+      lastReport = now;
+    }
+  }
+
+  /* Unanswered are the ones that never got a reply */
+  unsigned long unanswered = 0;
+  for (std::vector<Player>::iterator i = server.players.begin(); i != server.players.end(); i++)
+    unanswered += (*i).pending.size();
+
+  double seconds = (server.registeredAt ? (Now() - server.registeredAt) / 1e9 : 0);
+  if (seconds > 0)
+  {
+    double cpu = -1;
+    Usage usage;
+    usage.rssKB = 0;
+    if (haveUsage && GetUsage(botPid, usage))
+      cpu = 100.0 * (usage.cpuTicks - startUsage.cpuTicks) / clockTicks / seconds;
+    Report("Total", server.totals, seconds, cpu, usage.rssKB);
+    printf("%lu answers, %lu replied, %lu unanswered, %lu not expressions, %lu lines from the bot\n",
+           server.totals.answers, server.totals.replies, unanswered, server.totals.garbage, server.totals.linesIn);
+  }
+
+  if (child)
+  {
+    kill(botPid, SIGINT);
+    waitpid(botPid, 0, 0);
+  }
+  if (server.fd != -1)
+    close(server.fd);
+  close(server.listenFd);
+  delete server.reactor;
+
+  return EXIT_SUCCESS;
+}
@@ -27,7 +27,9 @@
 #include "database.h"
 #include "gamesbot.h"
 #include "highscore.h"
+#include "reactor.h"
 #include "timers.h"
+#include "workers.h"
 
 void ShowHelp(int argc, char* argv[], char* envp[])
 {
@@ -39,6 +41,11 @@ void ShowHelp(int argc, char* argv[], char* envp[])
   printf("\t-f, --conffile\tSpecify the configuration file location\n");
   printf("\t-d, --dbpath\tSpecify the location for the database file\n");
   printf("\t-g, --gamespath\tSpecify the location for the games to load\n");
+  printf("\t-w, --workers\tNumber of threads for the games, defaults to the number of CPUs\n");
+  printf("\t-c, --capture\tRecord the inbound traffic to a file\n");
+  printf("\t-r, --replay\tFeed a recorded file to the bot instead of connecting\n");
+  printf("\t-F, --fast\tReplay as fast as possible instead of at the recorded pace\n");
+  printf("\t-o, --sink\tWhere the replay writes what the bot sends, defaults to /dev/null\n");
   printf("\n");
   printf("Report bugs to: <%s>\n", PACKAGE_BUGREPORT);
 }
@@ -50,33 +57,51 @@ const char* GetPackageName()
 
 static inline void DeleteInstances()
 {
+  GamesBot::Instance()->DumpNetworks();
   GamesBot::Instance()->UnloadGames();
+
+  const Workers::Stats workerStats = Workers::Instance()->GetStats();
+  printf("Workers: %lu tasks in %lu threads, %lu steals, %lu replies\n",
+         workerStats.tasks, workerStats.threads, workerStats.steals, workerStats.replies);
+
+  const Timers::Stats stats = Timers::Instance()->GetStats();
+  printf("Timers: %lu expirations in %lu wakeups, %lu wakeups saved by coalescing\n",
+         stats.expirations, stats.wakeups, stats.savedWakeups);
+  printf("Timers pool: %lu of %lu slots in use, %lu at most\n",
+         stats.poolUsed, stats.poolSize, stats.poolHighWater);
+  Timers::Instance()->DumpLatencies();
+
+  const Reactor::Stats& reactorStats = Reactor::Instance()->GetStats();
+  printf("Reactor (%s): %lu events in %lu polls, %lu syscalls\n",
+         (Reactor::Instance()->GetBackend() == REACTOR_IO_URING ? "io_uring" : "epoll"),
+         reactorStats.events, reactorStats.polls, reactorStats.syscalls);
+
+  /* The bot still uses the workers and the timers while going away, which
+   * are deleted in the reverse order they were created.
+   */
+  delete GamesBot::Instance();
+  delete Reactor::Instance();
+  delete Workers::Instance();
   delete Timers::Instance();
   delete HighScore::Instance();
   delete Database::Instance();
-  delete GamesBot::Instance();
-}
-
-static void sighandler(int signum)
-{
-  switch (signum)
-  {
-    case SIGINT:
-    {
-      GamesBot* bot = GamesBot::Instance();
-      bot->Quit("Got SIGINT! Closing...");
-      DeleteInstances();
-      exit(EXIT_SUCCESS);
-      break;
-    }
-  }
 }
 
 int main(int argc, char* argv[], char* envp[])
 {
-  GamesBot* bot = GamesBot::Instance();
+  /* The main loop reads SIGINT, SIGTERM and SIGUSR1 from a signalfd. They
+   * are blocked before any thread starts, so that every thread inherits the
+   * mask and a signal received while initializing waits for the loop.
+   * SIGUSR1 prints the stats, the same ones printed on shutdown.
+   */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &signals, 0);
 
-  signal(SIGINT, sighandler);
+  GamesBot* bot = GamesBot::Instance();
 
   puts("Initializing bot ...");
   if (!bot->Initialize(argc, argv, envp))
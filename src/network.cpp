@@ -0,0 +1,969 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <rsl/net/irc/message.h>
+#include <rsl/net/socket/ipv4.h>
+#include "keys.h"
+#include "mutex.h"
+#include "network.h"
+#include "reactor.h"
+
+using namespace Rsl::Net::IRC;
+using namespace Rsl::Net::Socket;
+
+/* Resident set size of the process, in bytes */
+static long ResidentMemory()
+{
+  long size = 0;
+  long resident = 0;
+  FILE* fd = fopen("/proc/self/statm", "r");
+
+  if (fd)
+  {
+    if (fscanf(fd, "%ld %ld", &size, &resident) != 2)
+      resident = 0;
+    fclose(fd);
+  }
+
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Only the IRC client can connect with SSL, and it blocks, so it does in
+ * a thread of its own. A network never has two of them: an attempt that
+ * times out is left running, and the next one waits for it to end, or uses
+ * it if it connects after all.
+ */
+struct ConnectAttempt
+{
+  Network* network;   /* 0 once the network is stopped */
+  IRCClient* client;
+  bool abandoned;     /* Timed out, and nobody waits for it */
+  bool ok;
+  int errnum;
+  std::string error;
+  long memory;
+};
+
+static Mutex s_attemptsLock;
+static bool s_attemptsClosed = false;
+
+Network::Network(const Configuration::NetworkConfig& config)
+  : m_errno(0), m_error(""), m_config(config), m_client(0), m_clientCbk(0), m_nextAddress(0),
+    m_state(NETWORK_STOPPED), m_reactorCbk(0), m_recvCbk(0), m_lineCbk(0), m_filterCbk(0), m_fd(-1), m_attempt(0), m_stateTimer(0), m_failures(0),
+    m_recvLength(0), m_receivedAt(0),
+    m_sendQueue(config.IRCServer.floodBurst, config.IRCServer.floodInterval,
+                config.IRCServer.floodStrict ? SendQueue::SENDQUEUE_STRICT : SendQueue::SENDQUEUE_WEIGHTED),
+    m_flushTimer(0), m_wantWrite(false), m_shedding(false), m_shedStart(0),
+    m_capture(0), m_captureIndex(0), m_sink(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_seed = (unsigned int)time(0) ^ (unsigned int)getpid() ^ (unsigned int)(uintptr_t)this;
+}
+
+Network::~Network()
+{
+  if (m_attempt)
+    m_attempt->network = 0;
+  if (m_fd != -1 && !m_config.IRCServer.useSSL)
+    close(m_fd);
+  delete m_client;
+}
+
+IRCClient* Network::NewClient()
+{
+  IPV4Addr addr(m_config.IRCServer.address, m_config.IRCServer.service);
+  IPV4Addr bindAddr("0.0.0.0", "0");
+  char password[256];
+  if (strlen(m_config.IRCServer.password) > 0)
+    keysDecode(m_config.IRCServer.password, password);
+  else
+    *password = '\0';
+
+  IRCClient* client = new IRCClient();
+  client->Create(addr, bindAddr,
+                 m_config.Bot.nickname,
+                 m_config.Bot.username,
+                 m_config.Bot.fullname,
+                 password,
+                 m_config.IRCServer.useSSL,
+                 m_config.IRCServer.sslCert);
+  memset(password, 0, sizeof(password));
+
+  if (!client->Ok())
+  {
+    m_errno = client->Errno();
+    m_error = client->Error();
+    delete client;
+    return 0;
+  }
+
+  if (m_clientCbk)
+    m_clientCbk(*client);
+  return client;
+}
+
+/* Plain connections are made by the network itself, to addresses resolved
+ * here once, so that reconnecting never waits for the resolver.
+ */
+bool Network::Create(NetworkClientCbk_t clientCbk)
+{
+  m_clientCbk = clientCbk;
+  if (!m_config.IRCServer.useSSL)
+  {
+    addrinfo hints;
+    addrinfo* servers;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(m_config.IRCServer.address, m_config.IRCServer.service, &hints, &servers);
+    if (rc != 0)
+    {
+      m_errno = rc;
+      m_error = gai_strerror(rc);
+      return false;
+    }
+
+    for (addrinfo* server = servers; server; server = server->ai_next)
+    {
+      Address address;
+      memcpy(&address.addr, server->ai_addr, server->ai_addrlen);
+      address.length = server->ai_addrlen;
+      m_addresses.push_back(address);
+    }
+    freeaddrinfo(servers);
+    return true;
+  }
+
+  long memoryBefore = ResidentMemory();
+  m_client = NewClient();
+  if (!m_client)
+    return false;
+
+  m_stats.memory = ResidentMemory() - memoryBefore;
+  return true;
+}
+
+void Network::Start(ReactorCbk_t cbk, ReactorRecvCbk_t recvCbk, NetworkLineCbk_t lineCbk, NetworkFilterCbk_t filterCbk)
+{
+  m_reactorCbk = cbk;
+  m_recvCbk = recvCbk;
+  m_lineCbk = lineCbk;
+  m_filterCbk = filterCbk;
+  Connect();
+}
+
+void Network::Stop()
+{
+  Timers* timers = Timers::Instance();
+
+  CloseSocket();
+  timers->Destroy(m_stateTimer);
+  timers->Destroy(m_flushTimer);
+
+  if (m_attempt)
+  {
+    m_attempt->network = 0;
+    m_attempt = 0;
+  }
+  m_sink = 0;
+  m_state = NETWORK_STOPPED;
+}
+
+void Network::SetCapture(CaptureWriter* capture, unsigned int index)
+{
+  m_capture = capture;
+  m_captureIndex = index;
+}
+
+void Network::StartReplay(NetworkLineCbk_t lineCbk, NetworkFilterCbk_t filterCbk, FILE* sink)
+{
+  m_lineCbk = lineCbk;
+  m_filterCbk = filterCbk;
+  m_sink = sink;
+  m_state = NETWORK_CONNECTED;
+  m_stats.connectedAt = Timers::CurrentTime();
+}
+
+/* Goes through the same filter and parser as the lines read from the socket */
+void Network::ReplayLine(const char* line, size_t length)
+{
+  if (!m_sink || length + 2 > NETWORK_RECV_BUFFER)
+    return;
+
+  m_receivedAt = Timers::CurrentTime();
+  memcpy(m_recvBuffer, line, length);
+  m_recvBuffer[length] = '\r';
+  m_recvBuffer[length + 1] = '\n';
+  ircParseLines(m_recvBuffer, length + 2, Network::DoLine, this, m_filterCbk ? Network::DoFilter : 0);
+}
+
+void Network::CloseAttempts()
+{
+  MutexLock lock(s_attemptsLock);
+  s_attemptsClosed = true;
+}
+
+/* Plain connections connect without blocking, to each address of the
+ * server in turn, and the reactor tells when it is done.
+ */
+void Network::Connect()
+{
+  m_state = NETWORK_CONNECTING;
+  m_stats.attempts++;
+
+  if (m_config.IRCServer.useSSL)
+  {
+    ConnectClient();
+    return;
+  }
+
+  const Address& address = m_addresses[m_nextAddress++ % m_addresses.size()];
+  int fd = socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1 || (connect(fd, (const sockaddr *)&address.addr, address.length) == -1 && errno != EINPROGRESS))
+  {
+    printf("Cannot connect to network '%s': %s\n", GetName(), strerror(errno));
+    if (fd != -1)
+      close(fd);
+    ScheduleReconnect();
+    return;
+  }
+
+  m_fd = fd;
+  Reactor::Instance()->Add(m_fd, REACTOR_WRITE, m_reactorCbk, this);
+
+  TimerGroupScope scope(0);
+  m_stateTimer = Timers::Instance()->Create(DoTimeout, 1, m_config.IRCServer.connectTimeout, this);
+}
+
+/* The socket became writable while connecting */
+void Network::OnConnected()
+{
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+    error = errno;
+  if (error != 0)
+  {
+    printf("Cannot connect to network '%s': %s\n", GetName(), strerror(error));
+    CloseSocket();
+    Timers::Instance()->Destroy(m_stateTimer);
+    ScheduleReconnect();
+    return;
+  }
+
+  Timers::Instance()->Destroy(m_stateTimer);
+  Register();
+
+  /* The IRC client does this on SSL connections */
+  char password[256];
+  if (strlen(m_config.IRCServer.password) > 0)
+  {
+    keysDecode(m_config.IRCServer.password, password);
+    SendLine(std::string("PASS ") + password, SEND_CRITICAL);
+    memset(password, 0, sizeof(password));
+  }
+  m_nickname = m_config.Bot.nickname;
+  SendLine("NICK " + m_nickname, SEND_CRITICAL);
+  SendLine(std::string("USER ") + m_config.Bot.username + " 0 * :" + m_config.Bot.fullname, SEND_CRITICAL);
+}
+
+/* Connected, the server welcomes us before the timeout or we try again */
+void Network::Register()
+{
+  m_stats.connectedAt = Timers::CurrentTime();
+  m_recvLength = 0;
+  m_state = NETWORK_REGISTERING;
+
+  Reactor* reactor = Reactor::Instance();
+  if (m_config.IRCServer.useSSL)
+    reactor->Add(m_fd, REACTOR_READ, m_reactorCbk, this);
+  else
+  {
+    reactor->Modify(m_fd, REACTOR_READ);
+    reactor->SetReceiver(m_fd, m_recvCbk);
+  }
+
+  TimerGroupScope scope(0);
+  m_stateTimer = Timers::Instance()->Create(DoTimeout, 1, m_config.IRCServer.connectTimeout, this);
+}
+
+/* While registering, the server refused our nickname */
+void Network::OnNicknameInUse()
+{
+  if (m_state != NETWORK_REGISTERING || m_config.IRCServer.useSSL || m_nickname.length() >= 30)
+    return;
+
+  m_nickname += '_';
+  SendLine("NICK " + m_nickname, SEND_CRITICAL);
+}
+
+/* The client of a connection that was lost is replaced, one that failed to
+ * connect is tried again.
+ */
+void Network::ConnectClient()
+{
+  /* One that timed out is still running, wait for it again */
+  if (m_attempt)
+  {
+    m_attempt->abandoned = false;
+    TimerGroupScope scope(0);
+    m_stateTimer = Timers::Instance()->Create(DoTimeout, 1, m_config.IRCServer.connectTimeout, this);
+    return;
+  }
+
+  if (!m_client && (m_client = NewClient()) == 0)
+  {
+    printf("Cannot create the client for network '%s': %s\n", GetName(), Error());
+    ScheduleReconnect();
+    return;
+  }
+
+  ConnectAttempt* attempt = new ConnectAttempt();
+  attempt->network = this;
+  attempt->client = m_client;
+  attempt->abandoned = false;
+  attempt->ok = false;
+  attempt->errnum = 0;
+  attempt->memory = 0;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int rc = pthread_create(&thread, &attr, ConnectMain, attempt);
+  pthread_attr_destroy(&attr);
+  if (rc != 0)
+  {
+    printf("Cannot start connecting to network '%s': %s\n", GetName(), strerror(rc));
+    delete attempt;
+    ScheduleReconnect();
+    return;
+  }
+
+  m_attempt = attempt;
+  m_client = 0;
+
+  TimerGroupScope scope(0);
+  m_stateTimer = Timers::Instance()->Create(DoTimeout, 1, m_config.IRCServer.connectTimeout, this);
+}
+
+void* Network::ConnectMain(void* userData)
+{
+  ConnectAttempt* attempt = (ConnectAttempt *)userData;
+  long memoryBefore = ResidentMemory();
+
+  attempt->ok = attempt->client->Connect();
+  if (!attempt->ok)
+  {
+    attempt->errnum = attempt->client->Errno();
+    attempt->error = attempt->client->Error();
+  }
+  attempt->memory = ResidentMemory() - memoryBefore;
+
+  /* After the shutdown nobody reads the replies, the process is ending */
+  MutexLock lock(s_attemptsLock);
+  if (!s_attemptsClosed)
+    Workers::Instance()->Reply(ConnectDone, attempt);
+  return 0;
+}
+
+void Network::ConnectDone(void* userData)
+{
+  ConnectAttempt* attempt = (ConnectAttempt *)userData;
+  Network* network = attempt->network;
+  if (!network)
+  {
+    delete attempt->client;
+    delete attempt;
+    return;
+  }
+
+  /* Waiting for the next try, which starts with a new client */
+  network->m_attempt = 0;
+  if (attempt->abandoned)
+  {
+    delete attempt->client;
+    delete attempt;
+    return;
+  }
+
+  network->m_client = attempt->client;
+  bool ok = attempt->ok;
+  network->m_errno = attempt->errnum;
+  network->m_error = attempt->error;
+  if (ok && network->m_stats.connects == 0)
+    network->m_stats.memory += attempt->memory;
+  delete attempt;
+
+  Timers::Instance()->Destroy(network->m_stateTimer);
+
+  if (!ok)
+  {
+    printf("Cannot connect to network '%s': %s\n", network->GetName(), network->Error());
+    network->ScheduleReconnect();
+    return;
+  }
+
+  network->m_fd = network->m_client->GetSocket().GetFD();
+  if (network->m_fd == -1)
+  {
+    printf("Cannot get the socket of network '%s'\n", network->GetName());
+    delete network->m_client;
+    network->m_client = 0;
+    network->ScheduleReconnect();
+    return;
+  }
+  network->Register();
+}
+
+void Network::DoReconnect(void* network)
+{
+  ((Network *)network)->Connect();
+}
+
+/* A plain socket still connecting is closed. A blocking connect of the
+ * IRC client can't be cancelled, so it is abandoned until the next try.
+ */
+void Network::DoTimeout(void* userData)
+{
+  Network* network = (Network *)userData;
+
+  if (network->m_state == NETWORK_REGISTERING)
+    network->Disconnect("Registration timed out");
+  else if (network->m_state == NETWORK_CONNECTING)
+  {
+    printf("Cannot connect to network '%s': no answer after %u ms\n",
+           network->GetName(), network->m_config.IRCServer.connectTimeout);
+    if (network->m_attempt)
+      network->m_attempt->abandoned = true;
+    network->CloseSocket();
+    network->ScheduleReconnect();
+  }
+}
+
+void Network::DeleteClient(void* client)
+{
+  delete (IRCClient *)client;
+}
+
+/* Plain sockets are ours to close. The IRC client closes its own, it is
+ * only shut down here.
+ */
+void Network::CloseSocket()
+{
+  if (m_fd == -1)
+    return;
+
+  Reactor::Instance()->Remove(m_fd);
+  if (m_config.IRCServer.useSSL)
+    shutdown(m_fd, SHUT_RDWR);
+  else
+    close(m_fd);
+  m_fd = -1;
+}
+
+/* The client, that could be running the callbacks that got here, is
+ * deleted from the main loop.
+ */
+void Network::Disconnect(const char* reason)
+{
+  printf("Disconnected from network '%s': %s\n", GetName(), reason);
+
+  Timers* timers = Timers::Instance();
+  CloseSocket();
+  if (m_client)
+  {
+    Workers::Instance()->Reply(DeleteClient, m_client);
+    m_client = 0;
+  }
+  timers->Destroy(m_stateTimer);
+  timers->Destroy(m_flushTimer);
+
+  /* Whatever was waiting is stale by the time we are back */
+  m_wantWrite = false;
+  m_sendQueue.Clear();
+  UpdateLoad();
+  m_stats.connectedAt = 0;
+
+  ScheduleReconnect();
+}
+
+/* Exponential backoff with equal jitter: between half and all of the
+ * delay, so that the networks dropped by the same netsplit don't retry in
+ * lockstep. Timers can't be shorter than 10 ms.
+ */
+void Network::ScheduleReconnect()
+{
+  const Configuration::IRCServerConfig& config = m_config.IRCServer;
+  uint64_t delay = (config.reconnectDelay > 0 ? config.reconnectDelay : 1);
+
+  for (unsigned int i = 0; i < m_failures && delay < config.reconnectMax; i++)
+    delay *= 2;
+  if (delay > config.reconnectMax)
+    delay = config.reconnectMax;
+  m_failures++;
+
+  delay = delay / 2 + rand_r(&m_seed) % (delay / 2 + 1);
+  if (delay < 10)
+    delay = 10;
+  printf("Reconnecting to network '%s' in %.1f seconds\n", GetName(), delay / 1e3);
+
+  m_state = NETWORK_WAITING;
+  TimerGroupScope scope(0);
+  m_stateTimer = Timers::Instance()->Create(DoReconnect, 1, (unsigned int)delay, this);
+}
+
+bool Network::Ok() const
+{
+  return !m_errno;
+}
+
+int Network::Errno() const
+{
+  return m_errno;
+}
+
+const char* Network::Error() const
+{
+  return m_error.c_str();
+}
+
+const char* Network::GetName() const
+{
+  return m_config.name;
+}
+
+const char* Network::GetChannel() const
+{
+  return m_config.Bot.channel;
+}
+
+int Network::GetFd() const
+{
+  return m_fd;
+}
+
+IRCClient* Network::GetClient()
+{
+  return m_client;
+}
+
+const Network::Stats& Network::GetStats() const
+{
+  return m_stats;
+}
+
+NetworkState Network::GetState() const
+{
+  return m_state;
+}
+
+const SendQueue::Stats& Network::GetQueueStats() const
+{
+  return m_sendQueue.GetStats();
+}
+
+const SendQueue::LevelStats& Network::GetQueueStats(SendPriority priority) const
+{
+  return m_sendQueue.GetLevelStats(priority);
+}
+
+void Network::OnConnect()
+{
+  char identifyMsg[256];
+  char password[256];
+
+  Timers::Instance()->Destroy(m_stateTimer);
+  m_state = NETWORK_CONNECTED;
+  m_failures = 0;
+  if (m_stats.connects++ > 0)
+    printf("Reconnected to network '%s', joining %s again\n", GetName(), m_config.Bot.channel);
+
+  if (strlen(m_config.Bot.password) > 0)
+  {
+    memset(password, 0, sizeof(password));
+    memset(identifyMsg, 0, sizeof(identifyMsg));
+    keysDecode(m_config.Bot.password, password);
+    snprintf(identifyMsg, sizeof(identifyMsg), "IDENTIFY %s", password);
+    SendLine(std::string("PRIVMSG NickServ :") + identifyMsg, SEND_CRITICAL);
+    memset(password, 0, sizeof(password));
+    memset(identifyMsg, 0, sizeof(identifyMsg));
+  }
+
+//  Send(IRCMessageUmode(m_client.GetMe(), "+d"));
+  SendLine(std::string("JOIN ") + m_config.Bot.channel, SEND_CRITICAL);
+}
+
+/* Only for SSL, the reactor reads the plain connections */
+void Network::OnReadable()
+{
+  m_stats.readEvents++;
+
+  IRCClient* client = m_client;
+  client->Loop();
+  if (client == m_client && !client->Ok())
+    Disconnect(client->Error());
+}
+
+void Network::OnReceived(const char* data, ssize_t length)
+{
+  m_stats.readEvents++;
+
+  if (length == 0)
+  {
+    Disconnect("Connection closed by the server");
+    return;
+  }
+  if (length < 0)
+  {
+    Disconnect(strerror(-length));
+    return;
+  }
+
+  m_receivedAt = Timers::CurrentTime();
+  while (length > 0)
+  {
+    size_t chunk = NETWORK_RECV_BUFFER - m_recvLength;
+    if (chunk > (size_t)length)
+      chunk = length;
+    memcpy(m_recvBuffer + m_recvLength, data, chunk);
+    m_recvLength += chunk;
+    data += chunk;
+    length -= chunk;
+
+    if (m_capture)
+      m_capture->Write(m_receivedAt, m_captureIndex, m_recvBuffer, m_recvLength);
+
+    /* Handlers may disconnect, which resets the buffer */
+    size_t consumed = ircParseLines(m_recvBuffer, m_recvLength, Network::DoLine, this,
+                                    m_filterCbk ? Network::DoFilter : 0);
+    if (m_fd == -1)
+      return;
+
+    if (consumed < m_recvLength)
+      memmove(m_recvBuffer, m_recvBuffer + consumed, m_recvLength - consumed);
+    m_recvLength -= consumed;
+
+    /* A line that fills the whole buffer is not IRC */
+    if (m_recvLength == NETWORK_RECV_BUFFER)
+    {
+      printf("Network '%s': dropping a line longer than %d bytes\n", GetName(), NETWORK_RECV_BUFFER);
+      m_recvLength = 0;
+    }
+  }
+}
+
+void Network::DoLine(IRCLine& line, void* userData)
+{
+  Network* network = (Network *)userData;
+
+  /* Ignore what is left in the buffer after a disconnection */
+  if (network->m_fd == -1 && !network->m_sink)
+    return;
+
+  network->m_stats.messagesIn++;
+  network->m_lineCbk(network, line);
+}
+
+bool Network::DoFilter(const IRCScan& scan, void* userData)
+{
+  Network* network = (Network *)userData;
+
+  if ((network->m_fd == -1 && !network->m_sink) || network->m_filterCbk(network, scan))
+    return true;
+  network->m_stats.filtered++;
+  return false;
+}
+
+uint64_t Network::GetReceivedAt() const
+{
+  return m_receivedAt;
+}
+
+void Network::OnMessage()
+{
+  m_stats.messagesIn++;
+}
+
+void Network::OnWritable()
+{
+  if (m_state == NETWORK_CONNECTING)
+  {
+    OnConnected();
+    return;
+  }
+
+  WantWrite(false);
+  Drain(false);
+}
+
+void Network::Send(const IRCText& msg, SendPriority priority)
+{
+  Send(m_config.Bot.channel, msg, priority);
+}
+
+void Network::Send(const char* target, const IRCText& msg, SendPriority priority)
+{
+  const std::string& text = msg.GetText();
+
+  if (text.length() <= GetMaxText(target))
+    SendLine(std::string("PRIVMSG ") + target + " :" + text, priority);
+  else
+  {
+    ReplyPacker reply;
+    reply.Add(msg);
+    Send(target, reply, priority);
+  }
+}
+
+void Network::Send(const char* target, const ReplyPacker& reply, SendPriority priority)
+{
+  size_t maxText = GetMaxText(target);
+  if (maxText == 0)
+  {
+    printf("Network '%s': no room left for a message to '%s'\n", GetName(), target);
+    return;
+  }
+
+  std::vector<std::string> lines;
+  reply.Pack(maxText, lines);
+
+  for (std::vector<std::string>::const_iterator i = lines.begin();
+       i != lines.end();
+       i++)
+  {
+    SendLine(std::string("PRIVMSG ") + target + " :" + (*i), priority);
+  }
+}
+
+/* Until the server welcomes us only the protocol traffic goes through, and
+ * nothing while disconnected.
+ */
+void Network::SendLine(const std::string& line, SendPriority priority)
+{
+  if (m_sink)
+  {
+    fprintf(m_sink, "%s %d %s\n", GetName(), (int)priority, line.c_str());
+    m_stats.messagesOut++;
+    return;
+  }
+
+  if (m_state == NETWORK_CONNECTED || (m_state == NETWORK_REGISTERING && priority == SEND_CRITICAL))
+  {
+    /* While shedding, a periodic line replaces the ones still waiting for the same target */
+    if (priority == SEND_BULK && m_shedding && line.compare(0, 8, "PRIVMSG ") == 0)
+    {
+      std::string::size_type end = line.find(" :");
+      if (end != std::string::npos)
+        m_sendQueue.Drop(SEND_BULK, line.substr(0, end + 2));
+    }
+
+    m_sendQueue.Push(line, priority, Timers::CurrentTime());
+    m_stats.messagesOut++;
+    UpdateLoad();
+  }
+}
+
+void Network::Flush()
+{
+  if (!m_wantWrite && !Timers::Instance()->IsValid(m_flushTimer))
+    Drain(false);
+}
+
+void Network::Quit(const IRCText& msg)
+{
+  if (m_state != NETWORK_CONNECTED && m_state != NETWORK_REGISTERING)
+    return;
+
+  SendLine("QUIT :" + msg.GetText(), SEND_CRITICAL);
+  Drain(true);
+}
+
+void Network::DoFlush(void* network)
+{
+  ((Network *)network)->Drain(false);
+}
+
+/* Only the IRC client can encrypt, so on SSL connections the lines go
+ * back to messages. These are the commands that SendLine() gets.
+ */
+bool Network::SendMessage(const char* line, size_t length)
+{
+  std::string text(line, length);
+  std::string::size_type space = text.find(' ');
+  std::string command = text.substr(0, space);
+  std::string args = (space == std::string::npos ? "" : text.substr(space + 1));
+  std::string::size_type colon = args.find(" :");
+  std::string trailing = (args.compare(0, 1, ":") == 0 ? args.substr(1) : "");
+
+  if (!m_client)
+    return false;
+
+  if (command == "PRIVMSG" && colon != std::string::npos)
+    m_client->Send(IRCMessagePrivmsg(args.substr(0, colon).c_str(), IRCText(args.substr(colon + 2))));
+  else if (command == "JOIN")
+    m_client->Send(IRCMessageJoin(args.c_str()));
+  else if (command == "QUIT")
+    m_client->Send(IRCMessageQuit(IRCText(trailing)));
+  else if (command == "PONG")
+    m_client->Send(IRCMessagePong(trailing));
+  else
+    printf("Network '%s': cannot send '%s' through the IRC client\n", GetName(), text.c_str());
+
+  return m_client->Ok();
+}
+
+/* Plain sockets are written by the reactor, SSL ones a whole line at a time */
+ssize_t Network::DoWrite(const iovec* iov, int count, void* userData)
+{
+  Network* network = (Network *)userData;
+  if (!network->m_config.IRCServer.useSSL)
+    return Reactor::Instance()->Send(network->m_fd, iov, count);
+
+  ssize_t written = 0;
+  for (int i = 0; i < count; i++)
+  {
+    const char* line = (const char *)iov[i].iov_base;
+    size_t length = iov[i].iov_len;
+    if (length >= 2 && line[length - 2] == '\r')
+      length -= 2;
+
+    if (!network->SendMessage(line, length))
+    {
+      if (written > 0)
+        break;
+      errno = EIO;
+      return -1;
+    }
+    written += iov[i].iov_len;
+  }
+  return written;
+}
+
+void Network::Drain(bool force)
+{
+  if (m_sendQueue.Empty() || (m_state != NETWORK_CONNECTED && m_state != NETWORK_REGISTERING))
+    return;
+
+  /* A drain writes at most SENDQUEUE_MAX_IOV lines */
+  int result;
+  do
+  {
+    result = m_sendQueue.Drain(Network::DoWrite, this, Timers::CurrentTime(), force);
+  } while (result > 0 && !m_sendQueue.Empty());
+
+  UpdateLoad();
+
+  switch (result)
+  {
+    case SendQueue::SENDQUEUE_ERROR:
+    {
+      Disconnect(strerror(errno));
+      break;
+    }
+    case SendQueue::SENDQUEUE_BLOCKED:
+    {
+      WantWrite(true);
+      break;
+    }
+    case SendQueue::SENDQUEUE_THROTTLED:
+    {
+      Timers* timers = Timers::Instance();
+      if (!timers->IsValid(m_flushTimer))
+      {
+        uint64_t now = Timers::CurrentTime();
+        uint64_t next = m_sendQueue.GetNextToken();
+        unsigned int ms = (next > now ? (unsigned int)((next - now + 999999) / 1000000) : 1);
+        TimerGroupScope scope(0);
+        m_flushTimer = timers->Create(DoFlush, 1, ms, this);
+      }
+      break;
+    }
+  }
+}
+
+/* Lines are relayed as ":nick!~user@host PRIVMSG target :text\r\n", and
+ * must fit in 512 bytes. Hostnames take up to 63 bytes.
+ */
+size_t Network::GetMaxText(const char* target) const
+{
+  size_t prefix = 1 + strlen(m_config.Bot.nickname) + 2 + strlen(m_config.Bot.username) + 1 + 63 + 1;
+  size_t command = strlen("PRIVMSG ") + strlen(target) + strlen(" :") + strlen("\r\n");
+  return (prefix + command < 512 ? 512 - prefix - command : 0);
+}
+
+bool Network::IsShedding() const
+{
+  return __atomic_load_n(&m_shedding, __ATOMIC_RELAXED);
+}
+
+/* Shedding starts when a threshold is crossed, and stops once the queue is
+ * back under half of both, so that it doesn't flap.
+ */
+void Network::UpdateLoad()
+{
+  const Configuration::IRCServerConfig& config = m_config.IRCServer;
+  uint64_t now = Timers::CurrentTime();
+  uint64_t oldest = m_sendQueue.GetOldest();
+  unsigned long depth = m_sendQueue.GetStats().depth;
+  uint64_t delay = (oldest ? (now - oldest) / 1000000 : 0);
+  bool overQueue = (config.shedQueue > 0 && depth >= config.shedQueue);
+  bool overDelay = (config.shedDelay > 0 && delay >= config.shedDelay);
+
+  if (!m_shedding && (overQueue || overDelay))
+  {
+    __atomic_store_n(&m_shedding, true, __ATOMIC_RELAXED);
+    m_shedStart = now;
+    m_stats.shedEvents++;
+    printf("Network '%s': load shedding started, %lu lines waiting, the oldest for %llu ms\n",
+           GetName(), depth, (unsigned long long)delay);
+  }
+  else if (m_shedding &&
+           (config.shedQueue == 0 || depth <= config.shedQueue / 2) &&
+           (config.shedDelay == 0 || delay <= config.shedDelay / 2))
+  {
+    __atomic_store_n(&m_shedding, false, __ATOMIC_RELAXED);
+    m_stats.shedTime += now - m_shedStart;
+    printf("Network '%s': load shedding stopped after %.1f s, %lu lines dropped so far\n",
+           GetName(), (now - m_shedStart) / 1e9, m_sendQueue.GetStats().dropped);
+  }
+}
+
+void Network::WantWrite(bool want)
+{
+  if (want != m_wantWrite)
+  {
+    m_wantWrite = want;
+    Reactor::Instance()->Modify(m_fd, REACTOR_READ | (want ? REACTOR_WRITE : 0));
+  }
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Measures how fast inbound lines are parsed: in place into IRCLine views,
+ * as the bot does, against copying every token into strings, as the IRC
+ * client messages do. The traffic is a mix of what a busy channel sees.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <string>
+#include <vector>
+#include "ircline.h"
+
+static const char* trafficMix[] =
+{
+  ":player!user@host.example.com PRIVMSG #numbers :(25+7)*3-100/4",
+  ":someone!~someone@192.168.1.20 PRIVMSG #games :hello everybody, who wants to play?",
+  ":other!other@users.example.org PRIVMSG #numbers :!start numbers",
+  ":joiner!join@client.example.net JOIN #games",
+  ":leaver!leave@client.example.net PART #games :see you",
+  ":quitter!quit@client.example.net QUIT :Ping timeout: 240 seconds",
+  ":ChanServ!services@services.example.com MODE #games +o player",
+  ":irc.example.com 372 GamesBot :- Welcome to the message of the day",
+  "PING :irc.example.com",
+  ":player!user@host.example.com NOTICE GamesBot :VERSION mIRC v7.71"
+};
+#define TRAFFIC_LINES (sizeof(trafficMix) / sizeof(trafficMix[0]))
+
+/* Counts the allocations of each pass */
+static unsigned long allocations = 0;
+
+void* operator new(size_t size)
+{
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+static inline uint64_t Now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Totals
+{
+  unsigned long lines;
+  unsigned long privmsgs;
+  unsigned long textBytes;
+};
+
+static void CountLine(IRCLine& line, void* userData)
+{
+  Totals* totals = (Totals *)userData;
+  totals->lines++;
+  if (line.type == IRC_COMMAND_PRIVMSG && line.numParams == 2)
+  {
+    totals->privmsgs++;
+    totals->textBytes += line.params[1].GetLength();
+  }
+}
+
+/* What a message object costs: every token becomes a string */
+static void ParseCopying(const char* buffer, size_t length, Totals& totals)
+{
+  const char* start = buffer;
+  const char* end = buffer + length;
+
+  while (start < end)
+  {
+    const char* newline = (const char *)memchr(start, '\n', end - start);
+    if (!newline)
+      break;
+    std::string line(start, newline - start - 1);
+    start = newline + 1;
+
+    std::string prefix;
+    std::vector<std::string> params;
+    size_t pos = 0;
+    if (line[0] == ':')
+    {
+      pos = line.find(' ');
+      prefix = line.substr(1, pos - 1);
+      pos++;
+    }
+    size_t space = line.find(' ', pos);
+    std::string command = line.substr(pos, space - pos);
+    pos = space;
+    while (pos != std::string::npos && pos < line.length())
+    {
+      pos++;
+      if (line[pos] == ':')
+      {
+        params.push_back(line.substr(pos + 1));
+        break;
+      }
+      space = line.find(' ', pos);
+      params.push_back(line.substr(pos, space - pos));
+      pos = space;
+    }
+
+    totals.lines++;
+    if (command == "PRIVMSG" && params.size() == 2)
+    {
+      totals.privmsgs++;
+      totals.textBytes += params[1].length();
+    }
+  }
+}
+
+static void Report(const char* name, const Totals& totals, uint64_t elapsed, unsigned long allocs, size_t bytes)
+{
+  double seconds = elapsed / 1e9;
+  printf("%-8s %lu lines in %.3f s, %.2f M lines/s, %.1f ns/line, %.0f MB/s, %.2f allocations/line\n",
+         name, totals.lines, seconds, totals.lines / seconds / 1e6, elapsed / (double)totals.lines,
+         bytes / seconds / 1e6, allocs / (double)totals.lines);
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned int numLines = 100000;
+  unsigned int rounds = 50;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:r:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l': numLines = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        printf("Usage: %s [-l lines per round] [-r rounds]\n", argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  /* Chat dominates the traffic, one of every two lines is a PRIVMSG */
+  std::string traffic;
+  srand(1);
+  for (unsigned int i = 0; i < numLines; i++)
+  {
+    unsigned int kind = (i % 2 == 0 ? rand() % 3 : rand() % TRAFFIC_LINES);
+    traffic.append(trafficMix[kind]).append("\r\n");
+  }
+
+  std::vector<char> buffer(traffic.length() + 1);
+  Totals totals;
+  printf("%u lines per round, %.1f KB, %u rounds\n", numLines, traffic.length() / 1024.0, rounds);
+
+  /* Parsing in place destroys the buffer, restoring it is part of the cost
+   * just like receiving it would be.
+   */
+  memset(&totals, 0, sizeof(totals));
+  allocations = 0;
+  uint64_t start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    memcpy(&buffer[0], traffic.data(), traffic.length());
+    ircParseLines(&buffer[0], traffic.length(), CountLine, &totals);
+  }
+  Report("inplace", totals, Now() - start, allocations, traffic.length() * rounds);
+
+  memset(&totals, 0, sizeof(totals));
+  allocations = 0;
+  start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    memcpy(&buffer[0], traffic.data(), traffic.length());
+    ParseCopying(&buffer[0], traffic.length(), totals);
+  }
+  Report("copying", totals, Now() - start, allocations, traffic.length() * rounds);
+
+  return EXIT_SUCCESS;
+}
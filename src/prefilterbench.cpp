@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Measures the prefilter that skips inbound lines nobody is interested in:
+ * the scan alone, sixteen bytes at a time and byte by byte, and parsing
+ * every line against scanning first and parsing only what the filter keeps.
+ * The traffic is a mix of a server where the bot sits in many channels but
+ * runs a session in few of them, or a capture of real traffic given with -f,
+ * one raw line per line.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "ircline.h"
+
+static const char* trafficMix[] =
+{
+  ":player!user@host.example.com PRIVMSG #numbers :(25+7)*3-100/4",
+  ":someone!~someone@192.168.1.20 PRIVMSG #games :hello everybody, who wants to play?",
+  ":chatter!chat@users.example.org PRIVMSG #lobby :did anyone watch the match yesterday? it was amazing",
+  ":helper!help@staff.example.net PRIVMSG #help :try /msg NickServ HELP for the list of commands",
+  ":other!other@users.example.org PRIVMSG #games :!start numbers",
+  ":joiner!join@client.example.net JOIN #lobby",
+  ":leaver!leave@client.example.net PART #games :see you",
+  ":quitter!quit@client.example.net QUIT :Ping timeout: 240 seconds",
+  ":ChanServ!services@services.example.com MODE #lobby +o chatter",
+  ":irc.example.com 372 GamesBot :- Welcome to the message of the day",
+  "PING :irc.example.com",
+  ":player!user@host.example.com NOTICE GamesBot :VERSION mIRC v7.71"
+};
+#define TRAFFIC_LINES (sizeof(trafficMix) / sizeof(trafficMix[0]))
+#define CHAT_LINES 4
+
+static inline uint64_t Now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct Totals
+{
+  unsigned long lines;
+  unsigned long kept;
+  unsigned long textBytes;
+};
+
+/* Channels with a running session */
+static std::vector<std::string> sessions;
+
+static bool Keep(const IRCScan& scan, void* userData)
+{
+  switch (scan.type)
+  {
+    case IRC_COMMAND_NUMERIC:
+      return scan.numeric == 1;
+    case IRC_COMMAND_PING:
+      return true;
+    case IRC_COMMAND_PRIVMSG:
+      if (!scan.text.Empty() && scan.text[0] == '!')
+        return true;
+      for (size_t i = 0; i < sessions.size(); i++)
+      {
+        if (scan.target.EqualsNoCase(TextView(sessions[i].data(), sessions[i].length())))
+          return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+static void CountLine(IRCLine& line, void* userData)
+{
+  Totals* totals = (Totals *)userData;
+  totals->lines++;
+  if (line.type == IRC_COMMAND_PRIVMSG && line.numParams == 2)
+    totals->textBytes += line.params[1].GetLength();
+}
+
+/* Scans every line without parsing, keeping count of what the filter keeps */
+static void Scan(const char* buffer, size_t length, bool scalar, Totals& totals)
+{
+  const char* start = buffer;
+  const char* end = buffer + length;
+  IRCScan scan;
+
+  while (start < end)
+  {
+    const char* newline = (const char *)memchr(start, '\n', end - start);
+    if (!newline)
+      break;
+    const char* lineEnd = (newline > start && newline[-1] == '\r' ? newline - 1 : newline);
+
+    bool ok = (scalar ? ircScanLineScalar(start, lineEnd, scan) : ircScanLine(start, lineEnd, end, scan));
+    totals.lines++;
+    if (!ok || Keep(scan, 0))
+      totals.kept++;
+    start = newline + 1;
+  }
+}
+
+/* Both scans must agree on every line */
+static bool Verify(const char* buffer, size_t length)
+{
+  const char* start = buffer;
+  const char* end = buffer + length;
+  IRCScan a;
+  IRCScan b;
+
+  while (start < end)
+  {
+    const char* newline = (const char *)memchr(start, '\n', end - start);
+    if (!newline)
+      break;
+    const char* lineEnd = (newline > start && newline[-1] == '\r' ? newline - 1 : newline);
+
+    bool okA = ircScanLineScalar(start, lineEnd, a);
+    bool okB = ircScanLine(start, lineEnd, end, b);
+    if (okA != okB || (okA && (a.type != b.type || !a.target.Equals(b.target) || !a.text.Equals(b.text))))
+    {
+      printf("The scans differ on: %.*s\n", (int)(lineEnd - start), start);
+      return false;
+    }
+    start = newline + 1;
+  }
+
+  return true;
+}
+
+static void Report(const char* name, unsigned long lines, unsigned long kept, uint64_t elapsed, size_t bytes)
+{
+  double seconds = elapsed / 1e9;
+  printf("%-8s %lu lines in %.3f s, %.0f MB/s, %.1f ns/line, %lu kept\n",
+         name, lines, seconds, bytes / seconds / 1e6, elapsed / (double)lines, kept);
+}
+
+static bool LoadCapture(const char* path, std::string& traffic)
+{
+  FILE* fp = fopen(path, "r");
+  if (!fp)
+  {
+    perror(path);
+    return false;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), fp))
+  {
+    size_t length = strcspn(line, "\r\n");
+    if (length > 0)
+      traffic.append(line, length).append("\r\n");
+  }
+  fclose(fp);
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned int numLines = 100000;
+  unsigned int rounds = 50;
+  const char* capture = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:r:f:c:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l': numLines = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      case 'f': capture = optarg; break;
+      case 'c': sessions.push_back(optarg); break;
+      default:
+        printf("Usage: %s [-l lines per round] [-r rounds] [-f capture] [-c session channel]...\n", argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (sessions.empty())
+    sessions.push_back("#numbers");
+
+  /* Chat dominates the traffic, two of every three lines are a PRIVMSG */
+  std::string traffic;
+  if (capture)
+  {
+    if (!LoadCapture(capture, traffic))
+      return EXIT_FAILURE;
+  }
+  else
+  {
+    srand(1);
+    for (unsigned int i = 0; i < numLines; i++)
+    {
+      unsigned int kind = (i % 3 != 0 ? rand() % CHAT_LINES : rand() % TRAFFIC_LINES);
+      traffic.append(trafficMix[kind]).append("\r\n");
+    }
+  }
+
+  std::vector<char> buffer(traffic.length() + 1);
+  memcpy(&buffer[0], traffic.data(), traffic.length());
+  if (!Verify(&buffer[0], traffic.length()))
+    return EXIT_FAILURE;
+
+  Totals totals;
+  size_t bytes = traffic.length() * rounds;
+  printf("%.1f KB per round, %u rounds, %u session channels\n",
+         traffic.length() / 1024.0, rounds, (unsigned int)sessions.size());
+
+  memset(&totals, 0, sizeof(totals));
+  uint64_t start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+    Scan(&buffer[0], traffic.length(), true, totals);
+  Report("scalar", totals.lines, totals.kept, Now() - start, bytes);
+  unsigned long lines = totals.lines;
+
+  memset(&totals, 0, sizeof(totals));
+  start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+    Scan(&buffer[0], traffic.length(), false, totals);
+#ifdef __SSE2__
+  Report("sse2", totals.lines, totals.kept, Now() - start, bytes);
+#else
+  Report("scan", totals.lines, totals.kept, Now() - start, bytes);
+#endif
+
+  /* Parsing in place destroys the buffer, restoring it is part of the cost
+   * just like receiving it would be.
+   */
+  memset(&totals, 0, sizeof(totals));
+  start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    memcpy(&buffer[0], traffic.data(), traffic.length());
+    ircParseLines(&buffer[0], traffic.length(), CountLine, &totals);
+  }
+  Report("parse", lines, totals.lines, Now() - start, bytes);
+
+  memset(&totals, 0, sizeof(totals));
+  start = Now();
+  for (unsigned int r = 0; r < rounds; r++)
+  {
+    memcpy(&buffer[0], traffic.data(), traffic.length());
+    ircParseLines(&buffer[0], traffic.length(), CountLine, &totals, Keep);
+  }
+  Report("filtered", lines, totals.lines, Now() - start, bytes);
+
+  return EXIT_SUCCESS;
+}
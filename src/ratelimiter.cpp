@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "ratelimiter.h"
+
+#define NSEC_PER_MSEC 1000000ULL
+
+RateLimiter::RateLimiter()
+  : m_window(0), m_budget(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void RateLimiter::Configure(unsigned int window, unsigned int budget)
+{
+  m_window = (budget > 0 ? window * NSEC_PER_MSEC : 0);
+  m_budget = budget;
+  m_entries.clear();
+}
+
+bool RateLimiter::Enabled() const
+{
+  return m_window > 0;
+}
+
+RateLimiter::Entry* RateLimiter::Get(const std::string& key, uint64_t now)
+{
+  EntryMap::iterator i = m_entries.find(key);
+  if (i == m_entries.end())
+  {
+    Entry entry;
+    entry.windowStart = now;
+    entry.current = 0;
+    entry.previous = 0;
+    return &m_entries.insert(EntryMap::value_type(key, entry)).first->second;
+  }
+
+  /* Move to the window that contains now */
+  Entry* entry = &i->second;
+  if (now >= entry->windowStart + m_window)
+  {
+    uint64_t windows = (now - entry->windowStart) / m_window;
+    entry->previous = (windows == 1 ? entry->current : 0);
+    entry->current = 0;
+    entry->windowStart += windows * m_window;
+  }
+  return entry;
+}
+
+bool RateLimiter::Fits(const Entry* entry, unsigned int cost, uint64_t now) const
+{
+  uint64_t elapsed = now - entry->windowStart;
+  uint64_t previous = (elapsed < m_window ? entry->previous * (m_window - elapsed) / m_window : 0);
+  return previous + entry->current + cost <= m_budget;
+}
+
+void RateLimiter::Charge(Entry* entry, unsigned int cost)
+{
+  entry->current += cost;
+  m_stats.allowed++;
+}
+
+void RateLimiter::Reject()
+{
+  m_stats.limited++;
+}
+
+size_t RateLimiter::Evict(uint64_t now)
+{
+  size_t evicted = 0;
+
+  for (EntryMap::iterator i = m_entries.begin(); i != m_entries.end(); )
+  {
+    if (now >= i->second.windowStart + 2 * m_window)
+    {
+      m_entries.erase(i++);
+      evicted++;
+    }
+    else
+      i++;
+  }
+
+  m_stats.evicted += evicted;
+  return evicted;
+}
+
+size_t RateLimiter::GetSize() const
+{
+  return m_entries.size();
+}
+
+const RateLimiter::Stats& RateLimiter::GetStats() const
+{
+  return m_stats;
+}
@@ -0,0 +1,969 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include "config.h"
+#include "reactor.h"
+
+#ifdef USE_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Polls are submitted one shot, so every event rearms its fd. That keeps
+ * level triggered semantics, and the rearms go to the kernel in the same
+ * io_uring_enter that waits for the next events. So do the reads of the
+ * receivers and the sends, which makes a busy loop iteration a single
+ * system call whatever the number of connections.
+ */
+#define RING_ENTRIES 256
+#define RING_IGNORE (~0ULL) /* user_data of requests whose completion doesn't matter */
+
+/* Buffers provided to the kernel, which picks one for each read */
+#define RING_RECV_GROUP 1
+#define RING_RECV_BUFFERS 128
+
+/* A send is copied to a slot, that stays busy until it completes */
+#define RING_SEND_SLOTS 64
+#define RING_SEND_SIZE 16384
+
+/* Kind of request, stored in the user_data above the fd or slot */
+#define RING_POLL 0U
+#define RING_RECV 1U
+#define RING_SEND 2U
+
+struct RingSend
+{
+  int fd;
+  uint32_t instance;
+  char* data;      /* RING_SEND_SIZE bytes, allocated on first use */
+  size_t length;
+  size_t offset;   /* Already sent */
+  bool busy;
+  bool queued;     /* Waiting for a free submission entry if not */
+};
+
+struct Reactor::Ring
+{
+  int fd;
+
+  unsigned int* sqHead;
+  unsigned int* sqTail;
+  unsigned int sqMask;
+  unsigned int sqEntries;
+  unsigned int* sqArray;
+  io_uring_sqe* sqes;
+  unsigned int pending; /* Queued and not submitted yet */
+
+  unsigned int* cqHead;
+  unsigned int* cqTail;
+  unsigned int cqMask;
+  io_uring_cqe* cqes;
+
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+
+  char* recvBuffers;
+  uint16_t returned[RING_RECV_BUFFERS]; /* Read, to be provided again */
+  unsigned int returnedCount;
+  RingSend sends[RING_SEND_SLOTS];
+};
+
+static inline uint32_t ToPoll(unsigned int events)
+{
+  uint32_t ev = 0;
+  if (events & REACTOR_READ)
+    ev |= POLLIN | POLLRDHUP;
+  if (events & REACTOR_WRITE)
+    ev |= POLLOUT;
+  return ev;
+}
+
+static inline unsigned int FromPoll(uint32_t ev)
+{
+  unsigned int events = 0;
+  if (ev & (POLLIN | POLLRDHUP | POLLPRI))
+    events |= REACTOR_READ;
+  if (ev & POLLOUT)
+    events |= REACTOR_WRITE;
+  if (ev & (POLLERR | POLLHUP))
+    events |= REACTOR_ERROR | REACTOR_READ;
+  return events;
+}
+#endif /* #ifdef USE_IO_URING */
+
+static inline uint32_t ToEpoll(unsigned int events)
+{
+  uint32_t ev = 0;
+  if (events & REACTOR_READ)
+    ev |= EPOLLIN | EPOLLRDHUP;
+  if (events & REACTOR_WRITE)
+    ev |= EPOLLOUT;
+  if (events & REACTOR_EDGE)
+    ev |= EPOLLET;
+  return ev;
+}
+
+static inline unsigned int FromEpoll(uint32_t ev)
+{
+  unsigned int events = 0;
+  if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLPRI))
+    events |= REACTOR_READ;
+  if (ev & EPOLLOUT)
+    events |= REACTOR_WRITE;
+  if (ev & (EPOLLERR | EPOLLHUP))
+    events |= REACTOR_ERROR | REACTOR_READ;
+  return events;
+}
+
+static inline uint64_t ToUserData(int fd, uint32_t generation)
+{
+  return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+#ifdef USE_IO_URING
+static inline uint64_t ToRingData(unsigned int kind, uint32_t index, uint32_t generation)
+{
+  return ((uint64_t)generation << 32) | (kind << 30) | index;
+}
+#endif
+
+static Reactor* s_instance = 0;
+
+Reactor* Reactor::Instance()
+{
+  if (!s_instance)
+    s_instance = new Reactor(REACTOR_IO_URING);
+  return s_instance;
+}
+
+Reactor::Reactor(ReactorBackend backend)
+  : m_ring(0), m_errno(0), m_error(""), m_backend(REACTOR_EPOLL), m_epollFd(-1), m_events(0), m_buffer(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+
+#ifdef USE_IO_URING
+  if (backend == REACTOR_IO_URING && CreateRing())
+  {
+    m_backend = REACTOR_IO_URING;
+    return;
+  }
+#else
+  (void)backend;
+#endif
+
+  CreateEpoll();
+}
+
+Reactor::~Reactor()
+{
+#ifdef USE_IO_URING
+  DestroyRing();
+#endif
+  if (m_epollFd != -1)
+    close(m_epollFd);
+  delete [] m_events;
+  delete [] m_buffer;
+  s_instance = 0;
+}
+
+bool Reactor::CreateEpoll()
+{
+  m_events = new epoll_event[REACTOR_MAX_EVENTS];
+  m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epollFd == -1)
+  {
+    m_errno = errno;
+    m_error = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool Reactor::Ok() const
+{
+  return !m_errno;
+}
+
+int Reactor::Errno() const
+{
+  return m_errno;
+}
+
+const char* Reactor::Error() const
+{
+  return m_error.c_str();
+}
+
+ReactorBackend Reactor::GetBackend() const
+{
+  return m_backend;
+}
+
+const Reactor::Stats& Reactor::GetStats() const
+{
+  return m_stats;
+}
+
+bool Reactor::Add(int fd, unsigned int events, ReactorCbk_t cbk, void* userData)
+{
+  if (fd < 0 || !Ok())
+    return false;
+
+  if ((unsigned int)fd >= m_handlers.size())
+  {
+    Handler empty;
+    memset(&empty, 0, sizeof(empty));
+    m_handlers.resize(fd + 1, empty);
+  }
+
+  Handler& handler = m_handlers[fd];
+  if (handler.cbk)
+    return false;
+
+  handler.cbk = cbk;
+  handler.recvCbk = 0;
+  handler.userData = userData;
+  handler.events = events;
+  handler.generation++;
+  handler.instance++;
+  handler.sendError = 0;
+
+#ifdef USE_IO_URING
+  if (m_ring)
+  {
+    /* With the submission queue full, Poll() arms it */
+    Arm(fd);
+    return true;
+  }
+#endif
+
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ToEpoll(events);
+  ev.data.u64 = ToUserData(fd, handler.generation);
+  m_stats.syscalls++;
+  if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+  {
+    handler.cbk = 0;
+    return false;
+  }
+
+  return true;
+}
+
+bool Reactor::Modify(int fd, unsigned int events)
+{
+  if (fd < 0 || (unsigned int)fd >= m_handlers.size() || !m_handlers[fd].cbk)
+    return false;
+
+  Handler& handler = m_handlers[fd];
+  if (handler.events == events)
+    return true;
+  handler.events = events;
+
+#ifdef USE_IO_URING
+  if (m_ring)
+  {
+    /* The old poll may still complete, a new generation tells it apart */
+    if (handler.armed)
+      Disarm(ToRingData(RING_POLL, fd, handler.generation));
+    handler.armed = false;
+    handler.generation++;
+    Arm(fd);
+    return true;
+  }
+#endif
+
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ToEpoll(events);
+  ev.data.u64 = ToUserData(fd, handler.generation);
+  m_stats.syscalls++;
+  return epoll_ctl(m_epollFd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Reactor::Remove(int fd)
+{
+  if (fd < 0 || (unsigned int)fd >= m_handlers.size() || !m_handlers[fd].cbk)
+    return;
+
+  Handler& handler = m_handlers[fd];
+
+#ifdef USE_IO_URING
+  if (m_ring)
+  {
+    /* A send in flight keeps its slot until it completes */
+    if (handler.armed)
+      Disarm(ToRingData(RING_POLL, fd, handler.generation));
+    if (handler.receiving)
+      Disarm(ToRingData(RING_RECV, fd, handler.instance));
+    handler.armed = false;
+    handler.receiving = false;
+    handler.send = 0;
+  }
+  else
+#endif
+  {
+    m_stats.syscalls++;
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, 0);
+  }
+
+  handler.cbk = 0;
+  handler.recvCbk = 0;
+  handler.userData = 0;
+  handler.generation++;
+  handler.instance++;
+}
+
+bool Reactor::SetReceiver(int fd, ReactorRecvCbk_t cbk)
+{
+  if (fd < 0 || (unsigned int)fd >= m_handlers.size() || !m_handlers[fd].cbk || (m_handlers[fd].events & REACTOR_EDGE))
+    return false;
+
+  Handler& handler = m_handlers[fd];
+  handler.recvCbk = cbk;
+
+#ifdef USE_IO_URING
+  if (m_ring)
+  {
+    /* The read replaces the poll, unless it also waits for REACTOR_WRITE */
+    if (handler.armed)
+      Disarm(ToRingData(RING_POLL, fd, handler.generation));
+    handler.armed = false;
+    handler.generation++;
+    Arm(fd);
+    return true;
+  }
+#endif
+
+  if (!m_buffer)
+    m_buffer = new char[REACTOR_RECV_SIZE];
+  return true;
+}
+
+ssize_t Reactor::Send(int fd, const iovec* iov, int count)
+{
+  if (fd < 0 || (unsigned int)fd >= m_handlers.size() || !m_handlers[fd].cbk)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+#ifdef USE_IO_URING
+  if (m_ring)
+  {
+    ssize_t sent = SendRing(fd, iov, count);
+    if (sent != -1 || errno != ENOBUFS)
+      return sent;
+    /* Every slot is busy, send it right away */
+  }
+#endif
+
+  /* Doesn't block nor raise SIGPIPE, without touching the flags of a
+   * socket that the IRC client also uses.
+   */
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (iovec *)iov;
+  msg.msg_iovlen = count;
+
+  ssize_t sent;
+  do
+  {
+    m_stats.syscalls++;
+    sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while (sent == -1 && errno == EINTR);
+  return sent;
+}
+
+void Reactor::Flush()
+{
+#ifdef USE_IO_URING
+  if (m_ring && m_ring->pending > 0)
+    Submit(0, 0);
+#endif
+}
+
+int Reactor::Poll(int timeout)
+{
+  m_stats.polls++;
+#ifdef USE_IO_URING
+  if (m_ring)
+    return PollRing(timeout);
+#endif
+  return PollEpoll(timeout);
+}
+
+int Reactor::PollEpoll(int timeout)
+{
+  m_stats.syscalls++;
+  int nevents = epoll_wait(m_epollFd, m_events, REACTOR_MAX_EVENTS, timeout);
+  if (nevents == -1)
+  {
+    if (errno == EINTR)
+      return 0;
+    m_errno = errno;
+    m_error = strerror(errno);
+    return -1;
+  }
+
+  for (int i = 0; i < nevents; i++)
+  {
+    uint32_t fd = (uint32_t)(m_events[i].data.u64 & 0xFFFFFFFF);
+    uint32_t generation = (uint32_t)(m_events[i].data.u64 >> 32);
+
+    /* A previous handler could have removed this fd */
+    if (fd >= m_handlers.size())
+      continue;
+    Handler& handler = m_handlers[fd];
+    if (!handler.cbk || handler.generation != generation)
+      continue;
+
+    m_stats.events++;
+    unsigned int events = FromEpoll(m_events[i].events);
+    if (!handler.recvCbk)
+    {
+      handler.cbk(fd, events, handler.userData);
+      continue;
+    }
+
+    if (events & REACTOR_READ)
+    {
+      ReceiveEpoll(fd);
+      if (!m_handlers[fd].cbk || m_handlers[fd].generation != generation)
+        continue;
+    }
+    if ((events & REACTOR_WRITE) && (m_handlers[fd].events & REACTOR_WRITE))
+      m_handlers[fd].cbk(fd, REACTOR_WRITE, m_handlers[fd].userData);
+  }
+
+  return nevents;
+}
+
+/* Once per event, like the io_uring reads */
+void Reactor::ReceiveEpoll(int fd)
+{
+  ssize_t length;
+  do
+  {
+    m_stats.syscalls++;
+    length = recv(fd, m_buffer, REACTOR_RECV_SIZE, MSG_DONTWAIT);
+  } while (length == -1 && errno == EINTR);
+
+  if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  Handler& handler = m_handlers[fd];
+  handler.recvCbk(fd, m_buffer, (length == -1 ? -errno : length), handler.userData);
+}
+
+#ifdef USE_IO_URING
+bool Reactor::CreateRing()
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (fd == -1)
+    return false;
+
+  /* Waiting with a timeout needs IORING_ENTER_EXT_ARG, from Linux 5.11 */
+  if (!(params.features & IORING_FEAT_EXT_ARG))
+  {
+    close(fd);
+    return false;
+  }
+
+  Ring* ring = new Ring();
+  memset(ring, 0, sizeof(Ring));
+  ring->fd = fd;
+  ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cqRingSize > ring->sqRingSize)
+      ring->sqRingSize = ring->cqRingSize;
+    ring->cqRingSize = ring->sqRingSize;
+  }
+  ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+  ring->sqRing = mmap(0, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cqRing = ring->sqRing;
+  else
+    ring->cqRing = mmap(0, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes = (io_uring_sqe *)mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+  if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    m_ring = ring;
+    DestroyRing();
+    return false;
+  }
+
+  char* sq = (char *)ring->sqRing;
+  ring->sqHead = (unsigned int *)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned int *)(sq + params.sq_off.tail);
+  ring->sqMask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+  ring->sqEntries = *(unsigned int *)(sq + params.sq_off.ring_entries);
+  ring->sqArray = (unsigned int *)(sq + params.sq_off.array);
+
+  char* cq = (char *)ring->cqRing;
+  ring->cqHead = (unsigned int *)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned int *)(cq + params.cq_off.tail);
+  ring->cqMask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  m_ring = ring;
+
+  /* They go to the kernel with the first submission */
+  ring->recvBuffers = new char[RING_RECV_BUFFERS * REACTOR_RECV_SIZE];
+  for (unsigned int i = 0; i < RING_RECV_BUFFERS; i++)
+    ring->returned[i] = RING_RECV_BUFFERS - 1 - i;
+  ring->returnedCount = RING_RECV_BUFFERS;
+  ProvideBuffers();
+  return true;
+}
+
+void Reactor::DestroyRing()
+{
+  if (!m_ring)
+    return;
+
+  if (m_ring->sqes && m_ring->sqes != MAP_FAILED)
+    munmap(m_ring->sqes, m_ring->sqesSize);
+  if (m_ring->cqRing && m_ring->cqRing != MAP_FAILED && m_ring->cqRing != m_ring->sqRing)
+    munmap(m_ring->cqRing, m_ring->cqRingSize);
+  if (m_ring->sqRing && m_ring->sqRing != MAP_FAILED)
+    munmap(m_ring->sqRing, m_ring->sqRingSize);
+  close(m_ring->fd);
+
+  delete [] m_ring->recvBuffers;
+  for (unsigned int i = 0; i < RING_SEND_SLOTS; i++)
+    delete [] m_ring->sends[i].data;
+  delete m_ring;
+  m_ring = 0;
+}
+
+/* Hands the queued requests to the kernel and, with minComplete, waits
+ * for completions up to timeout miliseconds.
+ */
+bool Reactor::Submit(unsigned int minComplete, int timeout)
+{
+  __kernel_timespec ts;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout >= 0)
+  {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000LL;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+
+  unsigned int flags = IORING_ENTER_EXT_ARG;
+  if (minComplete > 0)
+    flags |= IORING_ENTER_GETEVENTS;
+
+  m_stats.syscalls++;
+  int rc = syscall(__NR_io_uring_enter, m_ring->fd, m_ring->pending, minComplete, flags, &arg, sizeof(arg));
+  if (rc == -1)
+  {
+    if (errno == EINTR || errno == ETIME || errno == EBUSY)
+      return true;
+    m_errno = errno;
+    m_error = strerror(errno);
+    return false;
+  }
+
+  m_ring->pending -= rc;
+  return true;
+}
+
+io_uring_sqe* Reactor::GetSqe()
+{
+  Ring* ring = m_ring;
+  unsigned int tail = *ring->sqTail;
+  unsigned int head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (tail - head >= ring->sqEntries)
+    return 0;
+
+  unsigned int index = tail & ring->sqMask;
+  io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(io_uring_sqe));
+  ring->sqArray[index] = index;
+  return sqe;
+}
+
+/* When the queue is full, submits what it has to make room */
+io_uring_sqe* Reactor::NextSqe()
+{
+  io_uring_sqe* sqe = GetSqe();
+  if (!sqe && Submit(0, 0))
+    sqe = GetSqe();
+  return sqe;
+}
+
+void Reactor::PushSqe()
+{
+  __atomic_store_n(m_ring->sqTail, *m_ring->sqTail + 1, __ATOMIC_RELEASE);
+  m_ring->pending++;
+}
+
+/* Queues whatever the fd is missing: a poll for the events that its read
+ * and send don't report, the read, and the send. If submitting doesn't
+ * make room, the fd waits in m_unarmed for the next Poll.
+ */
+bool Reactor::Arm(int fd)
+{
+  Handler& handler = m_handlers[fd];
+  unsigned int events = handler.events;
+  if (handler.recvCbk)
+    events &= ~REACTOR_READ;
+  if (handler.send)
+    events &= ~REACTOR_WRITE;
+
+  bool ok = true;
+  if (!handler.armed && (!handler.recvCbk || (events & REACTOR_WRITE)))
+  {
+    io_uring_sqe* sqe = NextSqe();
+    if (sqe)
+    {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = ToPoll(events);
+      sqe->user_data = ToRingData(RING_POLL, fd, handler.generation);
+      PushSqe();
+      handler.armed = true;
+    }
+    else
+      ok = false;
+  }
+
+  if (ok && handler.recvCbk && !handler.receiving)
+  {
+    io_uring_sqe* sqe = NextSqe();
+    if (sqe)
+    {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = fd;
+      sqe->len = REACTOR_RECV_SIZE;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = RING_RECV_GROUP;
+      sqe->user_data = ToRingData(RING_RECV, fd, handler.instance);
+      PushSqe();
+      handler.receiving = true;
+    }
+    else
+      ok = false;
+  }
+
+  if (ok && handler.send && !m_ring->sends[handler.send - 1].queued)
+  {
+    RingSend& send = m_ring->sends[handler.send - 1];
+    io_uring_sqe* sqe = NextSqe();
+    if (sqe)
+    {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t)(send.data + send.offset);
+      sqe->len = send.length - send.offset;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = ToRingData(RING_SEND, handler.send - 1, 0);
+      PushSqe();
+      send.queued = true;
+    }
+    else
+      ok = false;
+  }
+
+  if (!ok && std::find(m_unarmed.begin(), m_unarmed.end(), fd) == m_unarmed.end())
+  {
+    printf("Reactor: the io_uring submission queue is full, fd %d waits for the next poll\n", fd);
+    m_unarmed.push_back(fd);
+  }
+  return ok;
+}
+
+/* Without room the request is left alone, and ignored when it completes */
+void Reactor::Disarm(uint64_t userData)
+{
+  io_uring_sqe* sqe = NextSqe();
+  if (!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = userData;
+  sqe->user_data = RING_IGNORE;
+  PushSqe();
+}
+
+ssize_t Reactor::SendRing(int fd, const iovec* iov, int count)
+{
+  Handler& handler = m_handlers[fd];
+  if (handler.sendError)
+  {
+    errno = handler.sendError;
+    handler.sendError = 0;
+    return -1;
+  }
+  if (handler.send)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  unsigned int slot = 0;
+  while (slot < RING_SEND_SLOTS && m_ring->sends[slot].busy)
+    slot++;
+  if (slot == RING_SEND_SLOTS)
+  {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  RingSend& send = m_ring->sends[slot];
+  if (!send.data)
+    send.data = new char[RING_SEND_SIZE];
+
+  size_t length = 0;
+  for (int i = 0; i < count && length < RING_SEND_SIZE; i++)
+  {
+    size_t chunk = std::min(iov[i].iov_len, (size_t)RING_SEND_SIZE - length);
+    memcpy(send.data + length, iov[i].iov_base, chunk);
+    length += chunk;
+  }
+  if (length == 0)
+    return 0;
+
+  send.fd = fd;
+  send.instance = handler.instance;
+  send.length = length;
+  send.offset = 0;
+  send.busy = true;
+  send.queued = false;
+  handler.send = slot + 1;
+  Arm(fd);
+  return length;
+}
+
+/* Gives back the buffers already read, consecutive ones in one request */
+void Reactor::ProvideBuffers()
+{
+  Ring* ring = m_ring;
+  while (ring->returnedCount > 0)
+  {
+    unsigned int last = ring->returnedCount - 1;
+    unsigned int first = ring->returned[last];
+    unsigned int count = 1;
+    while (count <= last && ring->returned[last - count] == first + count)
+      count++;
+
+    io_uring_sqe* sqe = NextSqe();
+    if (!sqe)
+      return;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(uintptr_t)(ring->recvBuffers + first * REACTOR_RECV_SIZE);
+    sqe->len = REACTOR_RECV_SIZE;
+    sqe->off = first;
+    sqe->buf_group = RING_RECV_GROUP;
+    sqe->user_data = RING_IGNORE;
+    PushSqe();
+    ring->returnedCount -= count;
+  }
+}
+
+void Reactor::CompleteRecv(uint32_t fd, uint32_t instance, int32_t res, uint32_t flags)
+{
+  const char* data = 0;
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    unsigned int id = flags >> IORING_CQE_BUFFER_SHIFT;
+    data = m_ring->recvBuffers + id * REACTOR_RECV_SIZE;
+    m_ring->returned[m_ring->returnedCount++] = id;
+  }
+
+  bool current = (fd < m_handlers.size() && m_handlers[fd].recvCbk && m_handlers[fd].instance == instance);
+  if (current)
+  {
+    Handler& handler = m_handlers[fd];
+    handler.receiving = false;
+
+    /* Out of buffers or interrupted, it just reads again */
+    if (res != -ENOBUFS && res != -ECANCELED && res != -EINTR && res != -EAGAIN)
+    {
+      m_stats.events++;
+      handler.recvCbk(fd, data, res, handler.userData);
+    }
+  }
+
+  /* Before the next read, that could need it */
+  ProvideBuffers();
+
+  if (current)
+  {
+    Handler& handler = m_handlers[fd];
+    if (handler.recvCbk && handler.instance == instance && !handler.receiving)
+      Arm(fd);
+  }
+}
+
+void Reactor::CompleteSend(uint32_t slot, int32_t res)
+{
+  if (slot >= RING_SEND_SLOTS)
+    return;
+
+  RingSend& send = m_ring->sends[slot];
+  send.queued = false;
+
+  /* The fd could have been removed meanwhile */
+  int fd = send.fd;
+  uint32_t instance = send.instance;
+  if ((unsigned int)fd >= m_handlers.size() || !m_handlers[fd].cbk ||
+      m_handlers[fd].instance != instance || m_handlers[fd].send != slot + 1)
+  {
+    send.busy = false;
+    return;
+  }
+
+  /* A short send goes on with the rest */
+  if (res > 0)
+    send.offset += res;
+  if ((res > 0 && send.offset < send.length) || res == -EINTR || res == -EAGAIN)
+  {
+    Arm(fd);
+    return;
+  }
+
+  Handler& handler = m_handlers[fd];
+  send.busy = false;
+  handler.send = 0;
+  if (res < 0)
+    handler.sendError = -res;
+
+  if (handler.events & REACTOR_WRITE)
+  {
+    m_stats.events++;
+    handler.cbk(fd, REACTOR_WRITE, handler.userData);
+  }
+}
+
+int Reactor::PollRing(int timeout)
+{
+  /* What didn't fit in the submission queue the last time */
+  if (!m_unarmed.empty())
+  {
+    std::vector<int> unarmed;
+    unarmed.swap(m_unarmed);
+    for (std::vector<int>::iterator i = unarmed.begin(); i != unarmed.end(); i++)
+    {
+      if (m_handlers[*i].cbk)
+        Arm(*i);
+    }
+  }
+  ProvideBuffers();
+
+  /* Don't wait if there are completions left from the last time */
+  unsigned int head = *m_ring->cqHead;
+  bool ready = (head != __atomic_load_n(m_ring->cqTail, __ATOMIC_ACQUIRE));
+  if ((m_ring->pending > 0 || !ready) && !Submit(ready ? 0 : 1, timeout))
+    return -1;
+
+  int nevents = 0;
+  unsigned int tail = __atomic_load_n(m_ring->cqTail, __ATOMIC_ACQUIRE);
+  for (head = *m_ring->cqHead; head != tail; head++)
+  {
+    io_uring_cqe* cqe = &m_ring->cqes[head & m_ring->cqMask];
+    uint64_t userData = cqe->user_data;
+    int32_t res = cqe->res;
+    uint32_t flags = cqe->flags;
+
+    /* Give back the slot before the handler queues new requests */
+    __atomic_store_n(m_ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    if (userData == RING_IGNORE)
+      continue;
+
+    unsigned int kind = (unsigned int)(userData >> 30) & 3;
+    uint32_t fd = (uint32_t)(userData & 0x3FFFFFFF);
+    uint32_t generation = (uint32_t)(userData >> 32);
+    nevents++;
+    if (kind == RING_RECV)
+    {
+      CompleteRecv(fd, generation, res, flags);
+      continue;
+    }
+    if (kind == RING_SEND)
+    {
+      CompleteSend(fd, res);
+      continue;
+    }
+
+    if (fd >= m_handlers.size())
+      continue;
+    Handler& handler = m_handlers[fd];
+    if (!handler.cbk || handler.generation != generation)
+      continue;
+
+    handler.armed = false;
+    if (res == -ECANCELED)
+    {
+      Arm(fd);
+      continue;
+    }
+
+    /* The read of a receiver reports the rest, and its errors */
+    unsigned int events = (res < 0 ? REACTOR_ERROR | REACTOR_READ : FromPoll(res));
+    if (handler.recvCbk)
+    {
+      events &= REACTOR_WRITE;
+      if (!events)
+        continue;
+    }
+
+    m_stats.events++;
+    handler.cbk(fd, events, handler.userData);
+
+    /* The handler could have added fds, or removed or modified this one */
+    Handler& current = m_handlers[fd];
+    if (current.cbk && current.generation == generation && !current.armed)
+      Arm(fd);
+  }
+
+  return nevents;
+}
+#endif /* #ifdef USE_IO_URING */
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Compares the ways of waiting for IRC traffic: select, as the IRC client
+ * loop does, and the epoll and io_uring backends of the reactor. A server
+ * thread on the loopback stands in for the IRC server, and floods every
+ * connection with channel messages. The client answers each read with a
+ * short line, the reactor reads and sends itself as it does for the bot.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "reactor.h"
+
+static const char benchLine[] = ":player!user@host.example.com PRIVMSG #numbers :(25+7)*3-100/4\r\n";
+static const char answerLine[] = "PRIVMSG #numbers :29\r\n";
+#define LINE_LENGTH (sizeof(benchLine) - 1)
+#define BURST 32
+
+struct Server
+{
+  int listenFd;
+  unsigned int connections;
+  unsigned int messages; /* Per connection */
+};
+
+struct Client
+{
+  std::vector<int> fds;
+  unsigned int open;
+  unsigned long bytes;
+  unsigned long reads;
+  unsigned long sends;
+  Reactor* reactor;
+};
+
+static inline uint64_t Now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* ServerMain(void* arg)
+{
+  Server* server = (Server *)arg;
+  std::vector<int> fds;
+
+  for (unsigned int i = 0; i < server->connections; i++)
+  {
+    int fd = accept(server->listenFd, 0, 0);
+    if (fd == -1)
+      break;
+    fds.push_back(fd);
+  }
+
+  char burst[LINE_LENGTH * BURST];
+  for (unsigned int i = 0; i < BURST; i++)
+    memcpy(burst + i * LINE_LENGTH, benchLine, LINE_LENGTH);
+
+  /* Round robin bursts, so all the connections are busy at once */
+  for (unsigned int sent = 0; sent < server->messages; sent += BURST)
+  {
+    unsigned int count = (server->messages - sent < BURST ? server->messages - sent : BURST);
+    for (std::vector<int>::iterator i = fds.begin(); i != fds.end(); i++)
+    {
+      size_t length = count * LINE_LENGTH;
+      const char* p = burst;
+      while (length > 0)
+      {
+        ssize_t written = write(*i, p, length);
+        if (written <= 0)
+          break;
+        p += written;
+        length -= written;
+      }
+    }
+  }
+
+  /* Closing with the answers unread would reset the connections */
+  for (std::vector<int>::iterator i = fds.begin(); i != fds.end(); i++)
+  {
+    char buffer[4096];
+    shutdown(*i, SHUT_WR);
+    while (read(*i, buffer, sizeof(buffer)) > 0)
+      ;
+    close(*i);
+  }
+  return 0;
+}
+
+/* Reads once per readiness notification, like the IRC client does */
+static bool ReadOnce(Client* client, int fd)
+{
+  char buffer[4096];
+  client->reads++;
+  ssize_t length = read(fd, buffer, sizeof(buffer));
+  if (length > 0)
+  {
+    client->bytes += length;
+    client->sends++;
+    if (write(fd, answerLine, sizeof(answerLine) - 1) == -1 && errno != EAGAIN)
+      return false;
+    return true;
+  }
+  if (length == -1 && errno == EAGAIN)
+    return true;
+  return false;
+}
+
+static void do_write(int fd, unsigned int events, void* userData)
+{
+}
+
+static void do_receive(int fd, const char* data, ssize_t length, void* userData)
+{
+  Client* client = (Client *)userData;
+  client->reads++;
+  if (length > 0)
+  {
+    iovec iov;
+    iov.iov_base = (void *)answerLine;
+    iov.iov_len = sizeof(answerLine) - 1;
+    client->bytes += length;
+    if (client->reactor->Send(fd, &iov, 1) != -1)
+    {
+      client->sends++;
+      return;
+    }
+    if (errno == EAGAIN)
+      return;
+  }
+
+  client->reactor->Remove(fd);
+  close(fd);
+  client->open--;
+}
+
+static unsigned long RunSelect(Client* client)
+{
+  unsigned long waits = 0;
+  std::vector<bool> closed(client->fds.size(), false);
+
+  while (client->open > 0)
+  {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    int maxfd = -1;
+    for (unsigned int i = 0; i < client->fds.size(); i++)
+    {
+      if (closed[i])
+        continue;
+      FD_SET(client->fds[i], &readfds);
+      if (client->fds[i] > maxfd)
+        maxfd = client->fds[i];
+    }
+
+    waits++;
+    if (select(maxfd + 1, &readfds, 0, 0, 0) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (unsigned int i = 0; i < client->fds.size(); i++)
+    {
+      if (!closed[i] && FD_ISSET(client->fds[i], &readfds) && !ReadOnce(client, client->fds[i]))
+      {
+        close(client->fds[i]);
+        closed[i] = true;
+        client->open--;
+      }
+    }
+  }
+
+  return waits;
+}
+
+static unsigned long RunReactor(Client* client)
+{
+  Reactor* reactor = client->reactor;
+  for (unsigned int i = 0; i < client->fds.size(); i++)
+  {
+    reactor->Add(client->fds[i], REACTOR_READ, do_write, client);
+    reactor->SetReceiver(client->fds[i], do_receive);
+  }
+
+  while (client->open > 0)
+  {
+    if (reactor->Poll(-1) == -1)
+      break;
+  }
+
+  return reactor->GetStats().syscalls;
+}
+
+static bool Run(const char* name, int backend, unsigned int connections, unsigned int messages)
+{
+  Server server;
+  server.connections = connections;
+  server.messages = messages;
+  server.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrLength = sizeof(addr);
+  if (bind(server.listenFd, (sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(server.listenFd, connections) == -1 ||
+      getsockname(server.listenFd, (sockaddr *)&addr, &addrLength) == -1)
+  {
+    printf("%s: cannot listen on the loopback: %s\n", name, strerror(errno));
+    close(server.listenFd);
+    return false;
+  }
+
+  Client client;
+  client.open = 0;
+  client.bytes = 0;
+  client.reads = 0;
+  client.sends = 0;
+  client.reactor = 0;
+
+  if (backend != -1)
+  {
+    client.reactor = new Reactor((ReactorBackend)backend);
+    if (!client.reactor->Ok() || client.reactor->GetBackend() != (ReactorBackend)backend)
+    {
+      printf("%s: not available\n", name);
+      delete client.reactor;
+      close(server.listenFd);
+      return false;
+    }
+  }
+
+  pthread_t thread;
+  pthread_create(&thread, 0, ServerMain, &server);
+  for (unsigned int i = 0; i < connections; i++)
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+      close(fd);
+      break;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    client.fds.push_back(fd);
+    client.open++;
+  }
+
+  uint64_t start = Now();
+  unsigned long syscalls;
+  if (backend == -1)
+    syscalls = RunSelect(&client) + client.reads + client.sends;
+  else
+    syscalls = RunReactor(&client);
+  uint64_t elapsed = Now() - start;
+
+  pthread_join(thread, 0);
+  close(server.listenFd);
+  delete client.reactor;
+
+  double seconds = elapsed / 1e9;
+  unsigned long received = client.bytes / LINE_LENGTH;
+  printf("%-8s %lu messages in %.3f s, %.0f msg/s, %lu reads, %lu answers, %lu syscalls, %.1f per 1000 messages\n",
+         name, received, seconds, received / seconds, client.reads, client.sends, syscalls,
+         syscalls * 1000.0 / (received > 0 ? received : 1));
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned int connections = 64;
+  unsigned int messages = 20000;
+  const char* only = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:b:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': connections = atoi(optarg); break;
+      case 'n': messages = atoi(optarg); break;
+      case 'b': only = optarg; break;
+      default:
+        printf("Usage: %s [-c connections] [-n messages per connection] [-b select|epoll|io_uring]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  /* select can't watch descriptors past FD_SETSIZE */
+  if (connections > FD_SETSIZE - 16)
+    connections = FD_SETSIZE - 16;
+
+  printf("%u connections, %u messages each\n", connections, messages);
+  if (!only || !strcmp(only, "select"))
+    Run("select", -1, connections, messages);
+  if (!only || !strcmp(only, "epoll"))
+    Run("epoll", REACTOR_EPOLL, connections, messages);
+  if (!only || !strcmp(only, "io_uring"))
+    Run("io_uring", REACTOR_IO_URING, connections, messages);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "replypacker.h"
+
+using namespace Rsl::Net::IRC;
+
+#define IRC_BOLD 0x02
+#define IRC_COLOR 0x03
+#define IRC_RESET 0x0F
+#define IRC_REVERSE 0x16
+#define IRC_ITALIC 0x1D
+#define IRC_UNDERLINE 0x1F
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_UTF8_CONTINUATION(c) (((unsigned char)(c) & 0xC0) == 0x80)
+
+ReplyPacker::ReplyPacker(const char* separator)
+  : m_separator(separator), m_break(false)
+{
+}
+
+void ReplyPacker::AddHeader(const IRCText& header)
+{
+  Add(header);
+  m_items.back().flags |= ITEM_HEADER;
+}
+
+void ReplyPacker::Add(const IRCText& item)
+{
+  m_items.push_back(Item());
+  m_items.back().text = item.GetText();
+  m_items.back().flags = (m_break ? ITEM_BREAK : 0);
+  m_break = false;
+}
+
+void ReplyPacker::Break()
+{
+  m_break = true;
+}
+
+bool ReplyPacker::Empty() const
+{
+  return m_items.empty();
+}
+
+/* Length of the colour code at pos: ^C, up to two digits for the foreground
+ * and optionally a comma and up to two digits for the background.
+ */
+static size_t ColorLength(const std::string& text, size_t pos)
+{
+  size_t end = pos + 1;
+  for (int i = 0; i < 2 && end < text.length() && IS_DIGIT(text[end]); i++)
+    end++;
+  if (end > pos + 1 && end + 1 < text.length() && text[end] == ',' && IS_DIGIT(text[end + 1]))
+  {
+    end += 2;
+    if (end < text.length() && IS_DIGIT(text[end]))
+      end++;
+  }
+  return end - pos;
+}
+
+/* The codes that restore, at the start of another line, the formatting
+ * active at end. Colours are written with two digits, so that a digit
+ * starting the line isn't taken as part of the code.
+ */
+static std::string ActiveCodes(const std::string& text, size_t end)
+{
+  bool bold = false;
+  bool italic = false;
+  bool underline = false;
+  bool reverse = false;
+  int foreground = -1;
+  int background = -1;
+
+  for (size_t pos = 0; pos < end; pos++)
+  {
+    switch (text[pos])
+    {
+      case IRC_BOLD: bold = !bold; break;
+      case IRC_ITALIC: italic = !italic; break;
+      case IRC_UNDERLINE: underline = !underline; break;
+      case IRC_REVERSE: reverse = !reverse; break;
+      case IRC_RESET:
+      {
+        bold = italic = underline = reverse = false;
+        foreground = background = -1;
+        break;
+      }
+      case IRC_COLOR:
+      {
+        size_t length = ColorLength(text, pos);
+        if (length == 1)
+          foreground = background = -1;
+        else
+        {
+          size_t comma = text.find(',', pos);
+          foreground = atoi(text.c_str() + pos + 1);
+          if (comma < pos + length)
+            background = atoi(text.c_str() + comma + 1);
+        }
+        pos += length - 1;
+        break;
+      }
+    }
+  }
+
+  std::string codes;
+  if (bold)
+    codes += (char)IRC_BOLD;
+  if (italic)
+    codes += (char)IRC_ITALIC;
+  if (underline)
+    codes += (char)IRC_UNDERLINE;
+  if (reverse)
+    codes += (char)IRC_REVERSE;
+  if (foreground != -1)
+  {
+    char color[8];
+    if (background != -1)
+      snprintf(color, sizeof(color), "%c%02d,%02d", IRC_COLOR, foreground, background);
+    else
+      snprintf(color, sizeof(color), "%c%02d", IRC_COLOR, foreground);
+    codes += color;
+  }
+  return codes;
+}
+
+/* Where to end the piece of text that starts at start, preferably after a
+ * space in the second half of the line.
+ */
+size_t ReplyPacker::SplitPoint(const std::string& text, size_t start, size_t maxBytes)
+{
+  size_t end = start + maxBytes;
+  if (end >= text.length())
+    return text.length();
+
+  size_t space = text.rfind(' ', end - 1);
+  if (space != std::string::npos && space > start + maxBytes / 2)
+    return space + 1;
+
+  /* A colour code takes at most 6 bytes. One that doesn't fit goes to the
+   * next piece, unless it starts this one: then it takes more than maxBytes
+   * rather than being cut.
+   */
+  for (size_t pos = (end - start > 6 ? end - 6 : start); pos < end; pos++)
+  {
+    if (text[pos] == IRC_COLOR && pos + ColorLength(text, pos) > end)
+    {
+      if (pos == start)
+        return pos + ColorLength(text, pos);
+      end = pos;
+      break;
+    }
+  }
+
+  while (end > start && IS_UTF8_CONTINUATION(text[end]))
+    end--;
+
+  /* Only an invalid sequence gets here, cut it anyway */
+  if (end == start)
+    end = start + (maxBytes > 0 ? maxBytes : 1);
+  return end;
+}
+
+void ReplyPacker::Pack(size_t maxBytes, std::vector<std::string>& lines) const
+{
+  if (maxBytes == 0)
+    return;
+
+  std::string line;
+  bool header = false;
+
+  for (std::vector<Item>::const_iterator i = m_items.begin();
+       i != m_items.end();
+       i++)
+  {
+    const std::string& text = (*i).text;
+    const std::string& separator = (header ? std::string(" ") : m_separator);
+
+    if (((*i).flags & ITEM_BREAK) && !line.empty())
+    {
+      lines.push_back(line);
+      line.clear();
+    }
+
+    if (!line.empty() && line.length() + separator.length() + text.length() <= maxBytes)
+    {
+      line.append(separator).append(text);
+    }
+    else
+    {
+      if (!line.empty())
+        lines.push_back(line);
+
+      /* Continuation lines start with the formatting left active, unless
+       * it would take half of the line.
+       */
+      size_t start = 0;
+      std::string codes;
+      while (codes.length() + text.length() - start > maxBytes)
+      {
+        size_t end = SplitPoint(text, start, maxBytes - codes.length());
+        lines.push_back(codes + text.substr(start, end - start));
+        start = end;
+        codes = ActiveCodes(text, start);
+        if (codes.length() > maxBytes / 2)
+          codes.clear();
+      }
+      line = codes + text.substr(start);
+    }
+
+    header = (((*i).flags & ITEM_HEADER) != 0);
+  }
+
+  if (!line.empty())
+    lines.push_back(line);
+}
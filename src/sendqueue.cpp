@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "sendqueue.h"
+
+/* Lines each priority can send in a weighted round */
+static const unsigned int weights[SEND_PRIORITIES] = { 0, 4, 2, 1 };
+
+SendQueue::SendQueue(unsigned int burst, unsigned int interval, Policy policy)
+  : m_partial(-1), m_offset(0), m_policy(policy), m_tokens(0), m_lastRefill(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  memcpy(m_credits, weights, sizeof(m_credits));
+  for (int i = 0; i < SEND_PRIORITIES; i++)
+  {
+    m_levels[i].depth = 0;
+    m_levels[i].highWater = 0;
+    m_levels[i].queued = 0;
+    m_levels[i].sent = 0;
+  }
+  SetRate(burst, interval);
+}
+
+void SendQueue::SetRate(unsigned int burst, unsigned int interval)
+{
+  m_burst = (burst > 0 ? burst : 1);
+  m_interval = (uint64_t)interval * 1000000ULL;
+  m_tokens = m_burst;
+  m_lastRefill = 0;
+}
+
+void SendQueue::SetPolicy(Policy policy)
+{
+  m_policy = policy;
+}
+
+void SendQueue::Push(const std::string& line, SendPriority priority, uint64_t now)
+{
+  std::deque<Line>& lines = m_lines[priority];
+  lines.push_back(Line());
+  lines.back().text.reserve(line.length() + 2);
+  lines.back().text.append(line).append("\r\n");
+  lines.back().queuedAt = now;
+
+  LevelStats& level = m_levels[priority];
+  level.queued++;
+  level.depth = lines.size();
+  if (level.depth > level.highWater)
+    level.highWater = level.depth;
+
+  m_stats.queued++;
+  m_stats.depth++;
+  if (m_stats.depth > m_stats.highWater)
+    m_stats.highWater = m_stats.depth;
+}
+
+void SendQueue::Clear()
+{
+  for (int i = 0; i < SEND_PRIORITIES; i++)
+  {
+    m_lines[i].clear();
+    m_levels[i].depth = 0;
+  }
+  m_partial = -1;
+  m_offset = 0;
+  m_stats.depth = 0;
+}
+
+bool SendQueue::Empty() const
+{
+  return m_stats.depth == 0;
+}
+
+unsigned int SendQueue::Drop(SendPriority priority, const std::string& prefix)
+{
+  std::deque<Line>& lines = m_lines[priority];
+  std::deque<Line>::iterator i = lines.begin();
+  if (m_partial == priority && i != lines.end())
+    i++;
+
+  unsigned int dropped = 0;
+  while (i != lines.end())
+  {
+    if ((*i).text.compare(0, prefix.length(), prefix) == 0)
+    {
+      i = lines.erase(i);
+      dropped++;
+    }
+    else
+      i++;
+  }
+
+  m_levels[priority].depth = lines.size();
+  m_stats.depth -= dropped;
+  m_stats.dropped += dropped;
+  return dropped;
+}
+
+void SendQueue::Refill(uint64_t now)
+{
+  if (m_tokens >= m_burst || m_interval == 0)
+  {
+    m_tokens = m_burst;
+    m_lastRefill = now;
+    return;
+  }
+
+  uint64_t earned = (now - m_lastRefill) / m_interval;
+  if (earned >= m_burst - m_tokens)
+  {
+    m_tokens = m_burst;
+    m_lastRefill = now;
+  }
+  else
+  {
+    m_tokens += (unsigned int)earned;
+    m_lastRefill += earned * m_interval;
+  }
+}
+
+uint64_t SendQueue::GetNextToken() const
+{
+  if (m_tokens > 0)
+    return m_lastRefill;
+  return m_lastRefill + m_interval;
+}
+
+uint64_t SendQueue::GetOldest() const
+{
+  uint64_t oldest = 0;
+  for (int level = SEND_RESULT; level < SEND_PRIORITIES; level++)
+  {
+    if (!m_lines[level].empty() && (oldest == 0 || m_lines[level].front().queuedAt < oldest))
+      oldest = m_lines[level].front().queuedAt;
+  }
+  return oldest;
+}
+
+/* Priority of the next line to send, given the lines already taken from
+ * each queue, or -1 if none can be sent. Weighted picks spend credits.
+ */
+int SendQueue::Pick(const size_t* cursors, unsigned int* credits, bool tokens) const
+{
+  if (cursors[SEND_CRITICAL] < m_lines[SEND_CRITICAL].size())
+    return SEND_CRITICAL;
+  if (!tokens)
+    return -1;
+
+  int first = -1;
+  for (int level = SEND_RESULT; level < SEND_PRIORITIES; level++)
+  {
+    if (cursors[level] >= m_lines[level].size())
+      continue;
+    if (m_policy == SENDQUEUE_STRICT)
+      return level;
+
+    if (credits[level] > 0)
+    {
+      credits[level]--;
+      return level;
+    }
+    if (first == -1)
+      first = level;
+  }
+
+  if (first == -1)
+    return -1;
+
+  /* Every waiting priority spent its share, start another round */
+  memcpy(credits, weights, sizeof(weights));
+  credits[first]--;
+  return first;
+}
+
+int SendQueue::Drain(SendQueueWriteCbk_t writeCbk, void* userData, uint64_t now, bool force)
+{
+  if (Empty())
+    return 0;
+
+  Refill(now);
+
+  /* Pick the lines to send, remembering the credits left after each pick
+   * so that only the lines actually written are charged. A line partially
+   * written must be finished first, and was already charged.
+   */
+  iovec iov[SENDQUEUE_MAX_IOV];
+  int picked[SENDQUEUE_MAX_IOV];
+  unsigned int credits[SENDQUEUE_MAX_IOV][SEND_PRIORITIES];
+  size_t cursors[SEND_PRIORITIES];
+  unsigned int count = 0;
+  unsigned int tokens = m_tokens;
+
+  memset(cursors, 0, sizeof(cursors));
+  memcpy(credits[0], m_credits, sizeof(m_credits));
+
+  if (m_partial != -1)
+  {
+    const std::string& text = m_lines[m_partial].front().text;
+    iov[0].iov_base = (void *)(text.data() + m_offset);
+    iov[0].iov_len = text.length() - m_offset;
+    picked[0] = m_partial;
+    cursors[m_partial] = 1;
+    count = 1;
+  }
+
+  while (count < SENDQUEUE_MAX_IOV)
+  {
+    if (count > 0)
+      memcpy(credits[count], credits[count - 1], sizeof(credits[count]));
+
+    int level = Pick(cursors, credits[count], force || tokens > 0);
+    if (level == -1)
+      break;
+    if (level != SEND_CRITICAL && !force)
+      tokens--;
+
+    const std::string& text = m_lines[level][cursors[level]++].text;
+    iov[count].iov_base = (void *)text.data();
+    iov[count].iov_len = text.length();
+    picked[count] = level;
+    count++;
+  }
+
+  if (count == 0)
+  {
+    m_stats.throttled++;
+    return SENDQUEUE_THROTTLED;
+  }
+
+  ssize_t written;
+  do
+  {
+    written = writeCbk(iov, count, userData);
+  } while (written == -1 && errno == EINTR);
+
+  if (written == -1)
+    return (errno == EAGAIN || errno == EWOULDBLOCK ? SENDQUEUE_BLOCKED : SENDQUEUE_ERROR);
+
+  m_stats.writes++;
+  m_stats.bytes += written;
+
+  /* Charge the lines that were started and drop the ones completely written */
+  int sent = 0;
+  size_t left = (size_t)written;
+  for (unsigned int n = 0; n < count && left > 0; n++)
+  {
+    int level = picked[n];
+    if (m_partial == -1)
+    {
+      memcpy(m_credits, credits[n], sizeof(m_credits));
+      if (level != SEND_CRITICAL && !force && m_tokens > 0)
+        m_tokens--;
+    }
+
+    if (left < iov[n].iov_len)
+    {
+      m_partial = level;
+      m_offset += left;
+      break;
+    }
+
+    left -= iov[n].iov_len;
+    LevelStats& stats = m_levels[level];
+    stats.latency.Record(now - m_lines[level].front().queuedAt);
+    stats.sent++;
+    m_lines[level].pop_front();
+    stats.depth = m_lines[level].size();
+    m_partial = -1;
+    m_offset = 0;
+    sent++;
+  }
+
+  m_stats.sent += sent;
+  m_stats.depth -= sent;
+
+  if (m_partial != -1)
+  {
+    m_stats.partialWrites++;
+    return SENDQUEUE_BLOCKED;
+  }
+  if (!Empty() && count < SENDQUEUE_MAX_IOV && !force)
+  {
+    m_stats.throttled++;
+    return SENDQUEUE_THROTTLED;
+  }
+  return sent;
+}
+
+const SendQueue::Stats& SendQueue::GetStats() const
+{
+  return m_stats;
+}
+
+const SendQueue::LevelStats& SendQueue::GetLevelStats(SendPriority priority) const
+{
+  return m_levels[priority];
+}
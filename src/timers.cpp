@@ -22,243 +22,763 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/time.h>
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 #include "timers.h"
 
-class Timer
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+/* m_level of the timers in the dispatched list instead of the wheel */
+#define LEVEL_DISPATCHED -2
+
+class Timer : public Timers::Node
 {
   friend class Timers;
 
 public:
-  Timer(TimerCbk_t cbk, int nrep, unsigned int ms, void* userData)
-    : next(0), prev(0), m_cbk(cbk), m_nrep(nrep), m_ms(ms), m_userdata(userData)
+  Timer()
+    : m_handle(0), m_generation(1), m_level(-1), m_slot(0)
   {
-    SaveCurrentTime();
+    next = 0;
+    prev = 0;
   }
 
-  ~Timer()
+  inline void Init(TimerCbk_t cbk, int nrep, unsigned int ms, void* userData, unsigned int slack, TimerGroup group,
+                   Timers::Latency* latency, const Timers::Dispatcher& dispatcher)
   {
-    Timers::Instance()->DeleteFromList(this);
+    m_cbk = cbk;
+    m_nrep = nrep;
+    m_ms = ms;
+    m_slack = slack;
+    m_userdata = userData;
+    m_group = group;
+    m_latency = latency;
+    m_dispatcher = dispatcher;
+    m_dispatched = 0;
   }
 
-  inline const timeval& GetNextExecution() { return m_nextExecution; }
+  inline uint64_t GetNextExecution() { return m_nextExecution; }
   inline int GetRemainingRepetitions() { return m_nrep; }
 
-  Timer* next;
-  Timer* prev;
-
   inline TimerCbk_t GetCallback() { return m_cbk; }
   inline void* GetUserdata() { return m_userdata; }
 
 private:
-  inline void Update()
+  inline void Update(uint64_t now)
   {
     if (m_nrep > 0)
       m_nrep--;
-    SaveCurrentTime();
-  }
-
-  inline void SaveCurrentTime()
-  {
-    gettimeofday(&m_lastExecution, 0);
-
-    m_nextExecution.tv_sec = m_lastExecution.tv_sec + (unsigned int)(m_ms / 1000);
-    long us = (m_ms % 1000) * 1000;
-    if (m_lastExecution.tv_usec + us > 999999)
-    {
-      m_nextExecution.tv_sec++;
-      us = us - 1000000;
-    }
-    m_nextExecution.tv_usec = m_lastExecution.tv_usec + us;
+    m_nextExecution = now + m_ms * NSEC_PER_MSEC;
   }
 
   TimerCbk_t m_cbk;
   int m_nrep;
   unsigned long m_ms;
+  unsigned long m_slack;
   void* m_userdata;
-  timeval m_lastExecution;
-  timeval m_nextExecution;
+  TimerHandle m_handle; /* 0 when the pool slot is free */
+  uint32_t m_generation;
+  TimerGroup m_group;
+  Timers::Latency* m_latency;
+  Timers::Dispatcher m_dispatcher;
+  unsigned int m_dispatched; /* Expirations handed to the dispatcher that didn't run yet */
+  uint64_t m_nextExecution; /* In nanoseconds */
+
+  /* Position in the wheel, m_level is -1 when not linked, or LEVEL_DISPATCHED */
+  int m_level;
+  int m_slot;
 };
 
+/* The wheel works in miliseconds ticks, deadlines are rounded up so timers never fire early */
+static inline uint64_t ToTicks(uint64_t ns)
+{
+  return (ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+}
+
+/* Groups are chosen per thread, so that workers running different sessions don't mix their timers */
+static __thread TimerGroup currentGroup = 0;
+
+static inline uint32_t HandleIndex(TimerHandle handle)
+{
+  return (uint32_t)(handle & 0xFFFFFFFF);
+}
+
+static inline uint32_t HandleGeneration(TimerHandle handle)
+{
+  return (uint32_t)(handle >> 32);
+}
+
+static Timers* s_instance = 0;
+
 Timers* Timers::Instance()
 {
-  static Timers* instance = 0;
-  if (!instance)
-    instance = new Timers();
-  return instance;
+  if (!s_instance)
+    s_instance = new Timers();
+  return s_instance;
+}
+
+uint64_t Timers::CurrentTime()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 }
 
 Timers::Timers()
-  : m_firstTimer(0), m_lastTimer(0)
+  : m_elapsed(CurrentTime() / NSEC_PER_MSEC), m_fd(-1), m_armedDeadline(0), m_mutex(true)
 {
+  memset(&m_stats, 0, sizeof(m_stats));
+  FindLatency("core");
+
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+  {
+    m_occupied[level] = 0;
+    for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+    {
+      m_wheel[level][slot].next = &m_wheel[level][slot];
+      m_wheel[level][slot].prev = &m_wheel[level][slot];
+    }
+  }
+  m_dispatched.next = &m_dispatched;
+  m_dispatched.prev = &m_dispatched;
 }
 
 Timers::~Timers()
 {
-  for (Timer* s = m_firstTimer; s != 0; s = m_firstTimer)
-    delete s;
+  for (std::vector<Timer *>::iterator i = m_slabs.begin();
+       i != m_slabs.end();
+       i++)
+  {
+    delete [] (*i);
+  }
+
+  if (m_fd != -1)
+    close(m_fd);
+
+  for (std::vector<Latency *>::iterator i = m_latencies.begin();
+       i != m_latencies.end();
+       i++)
+  {
+    delete (*i);
+  }
+  s_instance = 0;
 }
 
-static inline bool CompareTimevals(const timeval& t1, const timeval& t2)
+int Timers::GetFd()
 {
-  if (t1.tv_sec > t2.tv_sec)
-    return true;
-  else if (t1.tv_sec == t2.tv_usec && t1.tv_usec > t2.tv_usec)
-    return true;
-  else
-    return false;
+  MutexLock lock(m_mutex);
+  if (m_fd == -1)
+  {
+    m_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    Rearm();
+  }
+  return m_fd;
+}
+
+void Timers::Rearm()
+{
+  if (m_fd == -1)
+    return;
+
+  uint64_t deadline = GetNextDeadline();
+  if (deadline == m_armedDeadline)
+    return;
+
+  /* A zeroed it_value disarms the timer */
+  itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+  its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+  timerfd_settime(m_fd, TFD_TIMER_ABSTIME, &its, 0);
+  m_armedDeadline = deadline;
 }
 
 void Timers::InsertTimer(Timer* timer)
 {
-  if (!m_firstTimer)
+  uint64_t when = ToTicks(timer->GetNextExecution());
+
+  /* Delay the expiration to the coarsest tick boundary allowed by the slack,
+   * so timers that are close to each other end up in the same slot.
+   */
+  if (timer->m_slack > 0)
   {
-    m_firstTimer = timer;
-    m_lastTimer = timer;
+    uint64_t limit = when + timer->m_slack;
+    uint64_t mask = ((uint64_t)1 << (63 - __builtin_clzll(when ^ limit))) - 1;
+    when = limit & ~mask;
   }
-  else
-  {
-    Timer* s;
-    Timer* s2 = 0;
-    const timeval& tv = timer->GetNextExecution();
 
-    for (s = m_firstTimer; s != 0; s = s->next)
-    {
-      if (CompareTimevals(s->GetNextExecution(), tv))
-        break;
-      s2 = s;
-    }
+  if (when < m_elapsed)
+    when = m_elapsed;
+
+  /* The level is given by the most significant bit in which the expiration
+   * time differs from the current wheel position.
+   */
+  uint64_t masked = (m_elapsed ^ when) | (WHEEL_SLOTS - 1);
+  int level = (63 - __builtin_clzll(masked)) / WHEEL_BITS;
+  if (level >= WHEEL_LEVELS)
+    level = WHEEL_LEVELS - 1;
+  int slot = (int)((when >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1));
+
+  Node* head = &m_wheel[level][slot];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+
+  timer->m_level = level;
+  timer->m_slot = slot;
+  m_occupied[level] |= (uint64_t)1 << slot;
+}
 
-    if (!s2)
-    {
-      /* First timer to be executed */
-      m_firstTimer->prev = timer;
-      timer->next = m_firstTimer;
-      m_firstTimer = timer;
-    }
-    else if (!s)
-    {
-      /* Last timer to be executed */
-      m_lastTimer->next = timer;
-      timer->prev = m_lastTimer;
-      m_lastTimer = timer;
-    }
-    else
-    {
-      /* Intermediate */
-      s2->next = timer;
-      s->prev = timer;
-      timer->next = s;
-      timer->prev = s2;
-    }
+void Timers::DeleteFromList(Timer* timer)
+{
+  if (timer->m_level == -1)
+    return;
+
+  timer->next->prev = timer->prev;
+  timer->prev->next = timer->next;
+
+  if (timer->m_level != LEVEL_DISPATCHED)
+  {
+    Node* head = &m_wheel[timer->m_level][timer->m_slot];
+    if (head->next == head)
+      m_occupied[timer->m_level] &= ~((uint64_t)1 << timer->m_slot);
   }
+
+  timer->next = 0;
+  timer->prev = 0;
+  timer->m_level = -1;
+}
+
+/* Finds a timer even if its group has been cancelled */
+Timer* Timers::LookupTimer(TimerHandle handle) const
+{
+  uint32_t index = HandleIndex(handle);
+  if (index >= m_stats.poolSize)
+    return 0;
+
+  Timer* timer = &m_slabs[index >> TIMER_SLAB_BITS][index & (TIMER_SLAB_SIZE - 1)];
+  if (timer->m_handle != handle || handle == 0)
+    return 0;
+  return timer;
+}
+
+Timer* Timers::FindTimer(TimerHandle handle) const
+{
+  Timer* timer = LookupTimer(handle);
+  if (timer && !IsAlive(timer))
+    return 0;
+  return timer;
+}
+
+bool Timers::IsAlive(const Timer* timer) const
+{
+  return timer->m_group == 0 || IsValidGroup(timer->m_group);
+}
+
+bool Timers::IsValid(TimerHandle timer) const
+{
+  MutexLock lock(m_mutex);
+  return FindTimer(timer) != 0;
 }
 
-Timer* Timers::Create(TimerCbk_t cbk, int nrep, unsigned int ms, void* userData)
+TimerHandle Timers::Create(TimerCbk_t cbk, int nrep, unsigned int ms, void* userData, unsigned int slack,
+                           TimerGroup group)
 {
   if (ms < 10)
     return 0;
 
-  Timer* newTimer = new Timer(cbk, nrep, ms, userData);
+  MutexLock lock(m_mutex);
+  if (group == 0)
+    group = currentGroup;
+  if (group != 0 && !IsValidGroup(group))
+    return 0;
+
+  if (m_freeIndices.size() == 0)
+    GrowPool();
+
+  uint32_t index = m_freeIndices.back();
+  m_freeIndices.pop_back();
+  if (++m_stats.poolUsed > m_stats.poolHighWater)
+    m_stats.poolHighWater = m_stats.poolUsed;
+
+  static const Dispatcher noDispatcher = { 0, 0 };
+  Timer* newTimer = &m_slabs[index >> TIMER_SLAB_BITS][index & (TIMER_SLAB_SIZE - 1)];
+  newTimer->Init(cbk, nrep, ms, userData, slack, group,
+                 (group != 0 ? m_groupLatencies[HandleIndex(group)] : m_latencies[0]),
+                 (group != 0 ? m_groupDispatchers[HandleIndex(group)] : noDispatcher));
+  newTimer->m_handle = ((TimerHandle)newTimer->m_generation << 32) | index;
+  newTimer->m_nextExecution = CurrentTime() + ms * NSEC_PER_MSEC;
   InsertTimer(newTimer);
 
-  return newTimer;
+  /* Only wake up earlier, a late timerfd is fixed on the next Execute */
+  if (m_fd != -1 && (m_armedDeadline == 0 || newTimer->m_nextExecution < m_armedDeadline))
+    Rearm();
+
+  return newTimer->m_handle;
+}
+
+void Timers::Destroy(TimerHandle handle)
+{
+  MutexLock lock(m_mutex);
+  Timer* timer = LookupTimer(handle);
+  if (timer)
+    ReleaseTimer(timer);
+}
+
+void Timers::ReleaseTimer(Timer* timer)
+{
+  uint32_t index = HandleIndex(timer->m_handle);
+  DeleteFromList(timer);
+  timer->m_handle = 0;
+  if (++timer->m_generation == 0)
+    timer->m_generation = 1;
+  m_freeIndices.push_back(index);
+  m_stats.poolUsed--;
 }
 
-void Timers::Destroy(Timer* timer)
+void Timers::GrowPool()
+{
+  uint32_t base = m_stats.poolSize;
+  m_slabs.push_back(new Timer[TIMER_SLAB_SIZE]);
+  m_stats.poolSize += TIMER_SLAB_SIZE;
+
+  /* The free list never grows past the pool size, so releasing a timer never allocates */
+  m_freeIndices.reserve(m_stats.poolSize);
+  for (uint32_t i = TIMER_SLAB_SIZE; i > 0; i--)
+    m_freeIndices.push_back(base + i - 1);
+}
+
+/* A subgroup of a destroyed group is born destroyed: its handle matches no slot */
+#define DEAD_GROUP ((TimerGroup)0xFFFFFFFF)
+
+TimerGroup Timers::CreateGroup()
 {
-  if (FindTimer(timer))
+  MutexLock lock(m_mutex);
+  if (currentGroup != 0 && !IsValidGroup(currentGroup))
+    return DEAD_GROUP;
+
+  uint32_t index;
+  if (m_freeGroups.size() > 0)
+  {
+    index = m_freeGroups.back();
+    m_freeGroups.pop_back();
+  }
+  else
+  {
+    index = m_groupGenerations.size();
+    m_groupGenerations.push_back(1);
+    m_groupLinks.push_back(GroupLinks());
+    m_groupLatencies.push_back(0);
+    m_groupDispatchers.push_back(Dispatcher());
+  }
+
+  GroupLinks& links = m_groupLinks[index];
+  links.firstChild = 0;
+  links.prev = 0;
+  if (currentGroup != 0)
   {
-    DeleteFromList(timer);
-    delete timer;
+    uint32_t parent = HandleIndex(currentGroup);
+    links.parent = parent + 1;
+    links.next = m_groupLinks[parent].firstChild;
+    if (links.next)
+      m_groupLinks[links.next - 1].prev = index + 1;
+    m_groupLinks[parent].firstChild = index + 1;
+
+    m_groupLatencies[index] = m_groupLatencies[parent];
+    m_groupDispatchers[index] = m_groupDispatchers[parent];
   }
+  else
+  {
+    links.parent = 0;
+    links.next = 0;
+    m_groupLatencies[index] = m_latencies[0];
+    m_groupDispatchers[index].cbk = 0;
+    m_groupDispatchers[index].data = 0;
+  }
+
+  return ((TimerGroup)m_groupGenerations[index] << 32) | index;
 }
 
-void Timers::DeleteFromList(Timer* timer)
+void Timers::DestroyGroup(TimerGroup group)
 {
-  /* Make sure that the timer is in the list */
-  if (!FindTimer(timer))
-    return;
+  MutexLock lock(m_mutex);
+  if (ReleaseGroup(group) && currentGroup == group)
+    currentGroup = 0;
+}
+
+/* Cancels the group and recycles its slot, and those of its subgroups,
+ * which are cancelled with it. Their timers are released when the wheel
+ * or ReleaseDispatched() reach them. Returns false if it was already
+ * destroyed.
+ */
+bool Timers::ReleaseGroup(TimerGroup group)
+{
+  if (!IsValidGroup(group))
+    return false;
+
+  uint32_t index = HandleIndex(group);
+  const GroupLinks& links = m_groupLinks[index];
+  if (links.prev)
+    m_groupLinks[links.prev - 1].next = links.next;
+  else if (links.parent)
+    m_groupLinks[links.parent - 1].firstChild = links.next;
+  if (links.next)
+    m_groupLinks[links.next - 1].prev = links.prev;
+
+  RecycleGroup(index);
+  return true;
+}
 
+/* Only walks the subgroups, the group is already out of its parent list */
+void Timers::RecycleGroup(uint32_t index)
+{
+  uint32_t child = m_groupLinks[index].firstChild;
+  while (child)
+  {
+    uint32_t next = m_groupLinks[child - 1].next;
+    RecycleGroup(child - 1);
+    child = next;
+  }
 
-  /* Unlink the timer */
-  if (timer->next)
-    timer->next->prev = timer->prev;
-  if (timer->prev)
-    timer->prev->next = timer->next;
+  if (++m_groupGenerations[index] == 0)
+    m_groupGenerations[index] = 1;
+  memset(&m_groupLinks[index], 0, sizeof(GroupLinks));
+  m_freeGroups.push_back(index);
+}
 
-  if (timer == m_firstTimer)
-    m_firstTimer = timer->next;
-  if (timer == m_lastTimer)
-    m_lastTimer = timer->prev;
+bool Timers::IsValidGroup(TimerGroup group) const
+{
+  MutexLock lock(m_mutex);
+  uint32_t index = HandleIndex(group);
+  return index < m_groupGenerations.size() && m_groupGenerations[index] == HandleGeneration(group);
 }
 
-long Timers::GetNextExecution() const
+TimerGroup Timers::SetCurrentGroup(TimerGroup group)
+{
+  TimerGroup previous = currentGroup;
+  currentGroup = group;
+  return previous;
+}
+
+void Timers::SetGroupDispatcher(TimerGroup group, TimerDispatchCbk_t dispatcher, void* dispatchData)
+{
+  MutexLock lock(m_mutex);
+  if (IsValidGroup(group))
+  {
+    m_groupDispatchers[HandleIndex(group)].cbk = dispatcher;
+    m_groupDispatchers[HandleIndex(group)].data = dispatchData;
+  }
+}
+
+Timers::Latency* Timers::FindLatency(const char* label)
+{
+  for (std::vector<Latency *>::iterator i = m_latencies.begin();
+       i != m_latencies.end();
+       i++)
+  {
+    if ((*i)->label == label)
+      return (*i);
+  }
+
+  Latency* latency = new Latency();
+  latency->label = label;
+  m_latencies.push_back(latency);
+  return latency;
+}
+
+void Timers::SetLabel(TimerHandle handle, const char* label)
 {
-  if (m_firstTimer)
+  MutexLock lock(m_mutex);
+  Timer* timer = FindTimer(handle);
+  if (timer)
+    timer->m_latency = FindLatency(label);
+}
+
+void Timers::SetGroupLabel(TimerGroup group, const char* label)
+{
+  MutexLock lock(m_mutex);
+  if (IsValidGroup(group))
+    m_groupLatencies[HandleIndex(group)] = FindLatency(label);
+}
+
+/* Copies, the histograms keep changing while the timers run */
+std::vector<Timers::Latency> Timers::GetLatencies() const
+{
+  MutexLock lock(m_mutex);
+  std::vector<Latency> latencies;
+  latencies.reserve(m_latencies.size());
+  for (std::vector<Latency *>::const_iterator i = m_latencies.begin();
+       i != m_latencies.end();
+       i++)
+  {
+    latencies.push_back(*(*i));
+  }
+  return latencies;
+}
+
+void Timers::DumpLatencies() const
+{
+  std::vector<Latency> latencies = GetLatencies();
+  for (std::vector<Latency>::const_iterator i = latencies.begin();
+       i != latencies.end();
+       i++)
   {
-    const timeval& nextExecution = m_firstTimer->GetNextExecution();
-    timeval curTime;
+    const Latency* latency = &(*i);
+    if (latency->lateness.Count() == 0)
+      continue;
+
+    printf("Timers '%s': %llu fired\n", latency->label.c_str(), (unsigned long long)latency->lateness.Count());
+    printf("  lateness (us): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+           (unsigned long long)latency->lateness.Percentile(50) / 1000,
+           (unsigned long long)latency->lateness.Percentile(90) / 1000,
+           (unsigned long long)latency->lateness.Percentile(99) / 1000,
+           (unsigned long long)latency->lateness.Max() / 1000);
+    printf("  duration (us): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+           (unsigned long long)latency->duration.Percentile(50) / 1000,
+           (unsigned long long)latency->duration.Percentile(90) / 1000,
+           (unsigned long long)latency->duration.Percentile(99) / 1000,
+           (unsigned long long)latency->duration.Max() / 1000);
+  }
+}
 
-    gettimeofday(&curTime, 0);
-    if (CompareTimevals(curTime, nextExecution))
+/* Finds the next slot that has to be processed. For levels above 0 this is
+ * the moment when the slot must be cascaded into the lower levels, so it can
+ * be earlier than the real execution time of the timers that it contains.
+ */
+bool Timers::NextExpiration(int& level, int& slot, uint64_t& deadline) const
+{
+  for (level = 0; level < WHEEL_LEVELS; level++)
+  {
+    if (!m_occupied[level])
+      continue;
+
+    int shift = level * WHEEL_BITS;
+    uint64_t slotRange = (uint64_t)1 << shift;
+    uint64_t levelRange = slotRange << WHEEL_BITS;
+    int curSlot = (int)((m_elapsed >> shift) & (WHEEL_SLOTS - 1));
+
+    uint64_t rotated = m_occupied[level];
+    if (curSlot > 0)
+      rotated = (rotated >> curSlot) | (rotated << (WHEEL_SLOTS - curSlot));
+    slot = (curSlot + __builtin_ctzll(rotated)) & (WHEEL_SLOTS - 1);
+
+    deadline = (m_elapsed & ~(levelRange - 1)) + slot * slotRange;
+    if (deadline <= m_elapsed && level > 0)
     {
-      return 1;
+      /* Only happens on the last level, for timers beyond the wheel range */
+      deadline += levelRange;
     }
+    return true;
+  }
+
+  return false;
+}
+
+Timers::Stats Timers::GetStats() const
+{
+  MutexLock lock(m_mutex);
+  return m_stats;
+}
+
+uint64_t Timers::GetNextDeadline() const
+{
+  MutexLock lock(m_mutex);
+  int level;
+  int slot;
+  uint64_t deadline;
+
+  if (!NextExpiration(level, slot, deadline))
+    return 0;
+  return deadline * NSEC_PER_MSEC;
+}
+
+long Timers::GetNextExecution() const
+{
+  uint64_t deadline = GetNextDeadline();
+  if (deadline == 0)
+    return -1;
+
+  uint64_t curTime = CurrentTime();
+  if (deadline <= curTime)
+    return 1;
+  return (long)ToTicks(deadline - curTime);
+}
+
+/* now is updated to the time when the callback returned */
+void Timers::FireTimer(Timer* timer, uint64_t& now)
+{
+  m_firedTicks.push_back(ToTicks(timer->GetNextExecution()));
+  m_stats.expirations++;
+
+  Latency* latency = timer->m_latency;
+  if (now > timer->GetNextExecution())
+    latency->lateness.Record(now - timer->GetNextExecution());
+  else
+    latency->lateness.Record(0);
+
+  TimerHandle handle = timer->m_handle;
+  TimerCbk_t cbk = timer->GetCallback();
+  void* userdata = timer->GetUserdata();
+  timer->Update(now);
+  int remainingReps = timer->GetRemainingRepetitions();
+
+  TimerGroup group = timer->m_group;
+
+  /* A dispatched timer stays allocated until RunDispatched, which also
+   * records how long its callback takes.
+   */
+  if (timer->m_dispatcher.cbk)
+  {
+    Dispatcher dispatcher = timer->m_dispatcher;
+    timer->m_dispatched++;
+    if (remainingReps != 0)
+      InsertTimer(timer);
     else
     {
-      long remaining;
-      remaining = (nextExecution.tv_sec - curTime.tv_sec) * 1000;
-      if (nextExecution.tv_usec < curTime.tv_usec)
-      {
-        remaining -= 1000;
-        remaining += (nextExecution.tv_usec + 1000000 - curTime.tv_usec) / 1000;
-      }
-      else
-        remaining += (nextExecution.tv_usec - curTime.tv_usec) / 1000;
-
-      return remaining;
+      timer->next = &m_dispatched;
+      timer->prev = m_dispatched.prev;
+      m_dispatched.prev->next = timer;
+      m_dispatched.prev = timer;
+      timer->m_level = LEVEL_DISPATCHED;
     }
+
+    unsigned int depth = m_mutex.UnlockAll();
+    dispatcher.cbk(handle, dispatcher.data);
+    m_mutex.Relock(depth);
+    now = CurrentTime();
+    return;
+  }
+
+  unsigned int depth = m_mutex.UnlockAll();
+  TimerGroup previousGroup = SetCurrentGroup(group);
+  cbk(userdata);
+  SetCurrentGroup(previousGroup);
+  m_mutex.Relock(depth);
+
+  uint64_t start = now;
+  now = CurrentTime();
+  latency->duration.Record(now - start);
+
+  /* The callback could have destroyed the timer or its group */
+  timer = LookupTimer(handle);
+  if (timer)
+  {
+    if (remainingReps == 0 || !IsAlive(timer))
+      ReleaseTimer(timer);
+    else
+      InsertTimer(timer);
+  }
+}
+
+void Timers::RunDispatched(TimerHandle handle)
+{
+  MutexLock lock(m_mutex);
+  Timer* timer = LookupTimer(handle);
+  if (!timer)
+    return;
+
+  timer->m_dispatched--;
+  if (!IsAlive(timer))
+  {
+    ReleaseTimer(timer);
+    return;
+  }
+
+  TimerCbk_t cbk = timer->GetCallback();
+  void* userdata = timer->GetUserdata();
+  TimerGroup group = timer->m_group;
+  Latency* latency = timer->m_latency;
+
+  /* Not in the wheel anymore, this was its last repetition */
+  if (timer->m_dispatched == 0 && timer->m_level == LEVEL_DISPATCHED)
+    ReleaseTimer(timer);
+
+  unsigned int depth = m_mutex.UnlockAll();
+  uint64_t start = CurrentTime();
+  TimerGroup previousGroup = SetCurrentGroup(group);
+  cbk(userdata);
+  SetCurrentGroup(previousGroup);
+  uint64_t duration = CurrentTime() - start;
+  m_mutex.Relock(depth);
+
+  latency->duration.Record(duration);
+}
+
+/* The dispatcher of a destroyed group may never run its timers */
+void Timers::ReleaseDispatched()
+{
+  Node* node = m_dispatched.next;
+  while (node != &m_dispatched)
+  {
+    Timer* timer = static_cast<Timer *>(node);
+    node = node->next;
+    if (!IsAlive(timer))
+      ReleaseTimer(timer);
   }
-  else
-    return -1;
 }
 
 void Timers::Execute()
 {
-  timeval curTime;
-  gettimeofday(&curTime, 0);
+  uint64_t curTime = CurrentTime();
+  uint64_t curTick = curTime / NSEC_PER_MSEC;
+  int level;
+  int slot;
+  uint64_t deadline;
+
+  MutexLock lock(m_mutex);
 
-  for (Timer* s = m_firstTimer; s != 0; s = m_firstTimer)
+  /* Clear the timerfd expiration count */
+  if (m_fd != -1)
   {
-    if (CompareTimevals(s->GetNextExecution(), curTime))
-      break;
+    uint64_t expirations;
+    while (read(m_fd, &expirations, sizeof(expirations)) == -1 && errno == EINTR)
+      ;
+  }
 
-    TimerCbk_t cbk = s->GetCallback();
-    void* userdata = s->GetUserdata();
-    s->Update();
-    int remainingReps = s->GetRemainingRepetitions();
+  unsigned long firedSlots = 0;
+  m_firedTicks.clear();
 
-    cbk(userdata);
+  while (NextExpiration(level, slot, deadline) && deadline <= curTick)
+  {
+    m_elapsed = deadline;
+    if (level == 0)
+      firedSlots++;
 
-    if (FindTimer(s))
+    /* Expire the timers in level 0, move down the others */
+    Node* head = &m_wheel[level][slot];
+    while (head->next != head)
     {
+      Timer* s = static_cast<Timer *>(head->next);
       DeleteFromList(s);
-      if (remainingReps == 0)
-        delete s;
+      if (!IsAlive(s))
+        ReleaseTimer(s);
+      else if (level == 0)
+        FireTimer(s, curTime);
       else
         InsertTimer(s);
     }
   }
-}
 
-Timer* Timers::FindTimer(Timer* timer)
-{
-  for (Timer* s = m_firstTimer; s != 0; s = s->next)
+  /* Without slack every distinct deadline would have needed its own tick */
+  if (firedSlots > 0)
   {
-    if (timer == s)
-      return s;
+    m_stats.wakeups++;
+    std::sort(m_firedTicks.begin(), m_firedTicks.end());
+    unsigned long deadlines = std::unique(m_firedTicks.begin(), m_firedTicks.end()) - m_firedTicks.begin();
+    if (deadlines > firedSlots)
+      m_stats.savedWakeups += deadlines - firedSlots;
   }
-  return 0;
+
+  if (curTick > m_elapsed)
+    m_elapsed = curTick;
+
+  ReleaseDispatched();
+  Rearm();
 }
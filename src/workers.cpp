@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2007, Alberto Alonso Pinto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted
+ * provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright notice, this list of conditions
+ *       and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+ *       and the following disclaimer in the documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Games Bot nor the names of its contributors may be used to endorse or
+ *       promote products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "workers.h"
+
+class Strand
+{
+  friend class Workers;
+
+  struct Task
+  {
+    WorkCbk_t cbk;
+    void* userData;
+  };
+
+  Strand()
+    : m_scheduled(false), m_closing(false)
+  {
+  }
+
+  Mutex m_mutex;
+  WorkQueue<Task> m_tasks;
+  bool m_scheduled; /* Queued in some worker or running */
+  bool m_closing;   /* Released once its tasks have run */
+};
+
+/* Worker running in this thread, if any */
+static __thread void* currentWorker = 0;
+
+static Workers* s_instance = 0;
+
+Workers* Workers::Instance()
+{
+  if (!s_instance)
+    s_instance = new Workers();
+  return s_instance;
+}
+
+Workers::Workers()
+  : m_errno(0), m_error(""), m_nextWorker(0), m_running(false), m_pending(0), m_sleeping(0), m_busy(0),
+    m_replySignalled(0), m_tasks(0), m_steals(0), m_replies(0)
+{
+  m_replyStub.next = 0;
+  m_replyHead = &m_replyStub;
+  m_replyTail = &m_replyStub;
+
+  m_replyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_replyFd == -1)
+  {
+    m_errno = errno;
+    m_error = strerror(m_errno);
+  }
+}
+
+Workers::~Workers()
+{
+  Stop();
+
+  /* Replies own their data, so they still have to run */
+  RunReplies();
+
+  if (m_replyFd != -1)
+    close(m_replyFd);
+  s_instance = 0;
+}
+
+bool Workers::Ok() const
+{
+  return !m_errno && m_replyFd != -1;
+}
+
+int Workers::Errno() const
+{
+  return m_errno;
+}
+
+const char* Workers::Error() const
+{
+  return m_error.c_str();
+}
+
+bool Workers::Start(unsigned int numThreads)
+{
+  if (!Ok() || m_workers.size() > 0)
+    return Ok();
+
+  /* All the workers must exist before any thread starts stealing from them */
+  for (unsigned int i = 0; i < numThreads; i++)
+  {
+    Worker* worker = new Worker();
+    worker->pool = this;
+    worker->index = i;
+    worker->tasks = 0;
+    worker->steals = 0;
+    m_workers.push_back(worker);
+  }
+
+  m_running = true;
+  for (unsigned int i = 0; i < numThreads; i++)
+  {
+    int rc = pthread_create(&m_workers[i]->thread, 0, WorkerMain, m_workers[i]);
+    if (rc != 0)
+    {
+      m_errno = rc;
+      m_error = strerror(rc);
+
+      m_idleMutex.Lock();
+      m_running = false;
+      m_idleCondition.Broadcast();
+      m_idleMutex.Unlock();
+
+      for (unsigned int ii = 0; ii < numThreads; ii++)
+      {
+        if (ii < i)
+          pthread_join(m_workers[ii]->thread, 0);
+        delete m_workers[ii];
+      }
+      m_workers.clear();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Workers::Stop()
+{
+  if (m_workers.size() == 0)
+    return;
+
+  /* Workers finish the scheduled strands before exiting */
+  m_idleMutex.Lock();
+  m_running = false;
+  m_idleCondition.Broadcast();
+  m_idleMutex.Unlock();
+
+  /* Until the last one exits the others may still look into its queue */
+  for (std::vector<Worker *>::iterator i = m_workers.begin();
+       i != m_workers.end();
+       i++)
+  {
+    pthread_join((*i)->thread, 0);
+  }
+  for (std::vector<Worker *>::iterator i = m_workers.begin();
+       i != m_workers.end();
+       i++)
+  {
+    m_tasks += (*i)->tasks;
+    m_steals += (*i)->steals;
+    delete (*i);
+  }
+  m_workers.clear();
+}
+
+void* Workers::WorkerMain(void* arg)
+{
+  Worker* worker = (Worker *)arg;
+  Workers* pool = worker->pool;
+
+  /* Signals are handled by the main thread */
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+  currentWorker = worker;
+
+  while (true)
+  {
+    Strand* strand = pool->Take(worker);
+    if (strand)
+    {
+      pool->RunStrand(worker, strand);
+      continue;
+    }
+
+    /* Announce the sleep before checking for work, Enqueue does the opposite */
+    pool->m_idleMutex.Lock();
+    __atomic_fetch_add(&pool->m_sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->m_pending, __ATOMIC_SEQ_CST) == 0 && pool->m_running)
+      pool->m_idleCondition.Wait(pool->m_idleMutex);
+    __atomic_fetch_sub(&pool->m_sleeping, 1, __ATOMIC_SEQ_CST);
+    bool exit = (!pool->m_running && __atomic_load_n(&pool->m_pending, __ATOMIC_SEQ_CST) == 0);
+    pool->m_idleMutex.Unlock();
+
+    if (exit)
+      break;
+  }
+
+  currentWorker = 0;
+  return 0;
+}
+
+Strand* Workers::CreateStrand()
+{
+  return new Strand();
+}
+
+void Workers::DestroyStrand(Strand* strand)
+{
+  if (m_workers.size() == 0)
+  {
+    delete strand;
+    return;
+  }
+
+  bool schedule = false;
+  strand->m_mutex.Lock();
+  strand->m_closing = true;
+  if (!strand->m_scheduled)
+  {
+    strand->m_scheduled = true;
+    schedule = true;
+  }
+  strand->m_mutex.Unlock();
+
+  if (schedule)
+    Schedule(strand);
+}
+
+void Workers::Post(Strand* strand, WorkCbk_t cbk, void* userData)
+{
+  if (m_workers.size() == 0)
+  {
+    cbk(userData);
+    return;
+  }
+
+  Strand::Task task;
+  task.cbk = cbk;
+  task.userData = userData;
+
+  bool schedule = false;
+  strand->m_mutex.Lock();
+  strand->m_tasks.PushBack(task);
+  if (!strand->m_scheduled)
+  {
+    strand->m_scheduled = true;
+    schedule = true;
+  }
+  strand->m_mutex.Unlock();
+
+  if (schedule)
+    Schedule(strand);
+}
+
+void Workers::Schedule(Strand* strand)
+{
+  __atomic_fetch_add(&m_busy, 1, __ATOMIC_SEQ_CST);
+
+  /* Work posted from a worker stays in that worker while nobody steals it */
+  Worker* worker = (Worker *)currentWorker;
+  if (worker == 0 || worker->pool != this)
+    worker = m_workers[__atomic_fetch_add(&m_nextWorker, 1, __ATOMIC_RELAXED) % m_workers.size()];
+  Enqueue(worker, strand);
+}
+
+void Workers::Enqueue(Worker* worker, Strand* strand)
+{
+  worker->mutex.Lock();
+  worker->queue.PushBack(strand);
+  worker->mutex.Unlock();
+
+  __atomic_fetch_add(&m_pending, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&m_sleeping, __ATOMIC_SEQ_CST) > 0)
+  {
+    m_idleMutex.Lock();
+    m_idleCondition.Signal();
+    m_idleMutex.Unlock();
+  }
+}
+
+Strand* Workers::Take(Worker* worker)
+{
+  Strand* strand = 0;
+
+  worker->mutex.Lock();
+  if (worker->queue.Size() > 0)
+  {
+    strand = worker->queue.Front();
+    worker->queue.PopFront();
+  }
+  worker->mutex.Unlock();
+
+  for (unsigned int i = 1; strand == 0 && i < m_workers.size(); i++)
+  {
+    Worker* victim = m_workers[(worker->index + i) % m_workers.size()];
+    victim->mutex.Lock();
+    if (victim->queue.Size() > 0)
+    {
+      strand = victim->queue.Back();
+      victim->queue.PopBack();
+      worker->steals++;
+    }
+    victim->mutex.Unlock();
+  }
+
+  if (strand)
+    __atomic_fetch_sub(&m_pending, 1, __ATOMIC_SEQ_CST);
+  return strand;
+}
+
+void Workers::RunStrand(Worker* worker, Strand* strand)
+{
+  for (int i = 0; i < STRAND_BATCH; i++)
+  {
+    strand->m_mutex.Lock();
+    if (strand->m_tasks.Size() == 0)
+    {
+      strand->m_mutex.Unlock();
+      break;
+    }
+    Strand::Task task = strand->m_tasks.Front();
+    strand->m_tasks.PopFront();
+    strand->m_mutex.Unlock();
+
+    task.cbk(task.userData);
+    worker->tasks++;
+  }
+
+  /* Go to the back of the queue if there is more work, so other strands get their turn */
+  strand->m_mutex.Lock();
+  bool reschedule = (strand->m_tasks.Size() > 0);
+  bool destroy = false;
+  if (!reschedule)
+  {
+    strand->m_scheduled = false;
+    destroy = strand->m_closing;
+  }
+  strand->m_mutex.Unlock();
+
+  if (reschedule)
+  {
+    Enqueue(worker, strand);
+    return;
+  }
+
+  if (destroy)
+    delete strand;
+
+  if (__atomic_sub_fetch(&m_busy, 1, __ATOMIC_SEQ_CST) == 0)
+  {
+    m_idleMutex.Lock();
+    m_doneCondition.Broadcast();
+    m_idleMutex.Unlock();
+  }
+}
+
+void Workers::Wait()
+{
+  m_idleMutex.Lock();
+  while (__atomic_load_n(&m_busy, __ATOMIC_SEQ_CST) > 0)
+    m_doneCondition.Wait(m_idleMutex);
+  m_idleMutex.Unlock();
+}
+
+void Workers::PushReply(ReplyNode* node)
+{
+  __atomic_store_n(&node->next, (ReplyNode *)0, __ATOMIC_RELAXED);
+  ReplyNode* prev = __atomic_exchange_n(&m_replyHead, node, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/* Returns 0 when empty, or when a producer is halfway through a push. In
+ * that case the producer signals the fd after completing it.
+ */
+Workers::ReplyNode* Workers::PopReply()
+{
+  ReplyNode* tail = m_replyTail;
+  ReplyNode* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &m_replyStub)
+  {
+    if (next == 0)
+      return 0;
+    m_replyTail = next;
+    tail = next;
+    next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next != 0)
+  {
+    m_replyTail = next;
+    return tail;
+  }
+
+  if (tail != __atomic_load_n(&m_replyHead, __ATOMIC_ACQUIRE))
+    return 0;
+
+  /* Keep a node in the queue before taking the last one */
+  PushReply(&m_replyStub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next != 0)
+  {
+    m_replyTail = next;
+    return tail;
+  }
+  return 0;
+}
+
+void Workers::Reply(WorkCbk_t cbk, void* userData)
+{
+  ReplyNode* node = new ReplyNode();
+  node->cbk = cbk;
+  node->userData = userData;
+  PushReply(node);
+
+  /* Only the first reply after the main thread drained the queue writes to the fd */
+  if (__atomic_exchange_n(&m_replySignalled, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    uint64_t one = 1;
+    while (write(m_replyFd, &one, sizeof(one)) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+int Workers::GetFd() const
+{
+  return m_replyFd;
+}
+
+void Workers::RunReplies()
+{
+  if (m_replyFd == -1)
+    return;
+
+  uint64_t count;
+  while (read(m_replyFd, &count, sizeof(count)) == -1 && errno == EINTR)
+    ;
+  __atomic_store_n(&m_replySignalled, 0, __ATOMIC_SEQ_CST);
+
+  ReplyNode* node;
+  while ((node = PopReply()) != 0)
+  {
+    node->cbk(node->userData);
+    delete node;
+    m_replies++;
+  }
+}
+
+Workers::Stats Workers::GetStats() const
+{
+  Stats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.threads = m_workers.size();
+  stats.tasks = m_tasks;
+  stats.steals = m_steals;
+  stats.replies = m_replies;
+
+  for (std::vector<Worker *>::const_iterator i = m_workers.begin();
+       i != m_workers.end();
+       i++)
+  {
+    stats.tasks += (*i)->tasks;
+    stats.steals += (*i)->steals;
+  }
+  return stats;
+}